@@ -4,139 +4,443 @@
 
 #include "audio.h"
 
+#include <libavutil/time.h>
 #include <libswresample/swresample.h>
 
 #include "../libs/microlog/microlog.h"
 #include "../player/player.h"
 #include "../utils/sync.h"
+#include "../utils/trace.h"
 #include "../video/video.h"
 
-int audio_decode_frame(AudioState *audio_state) {
-    int data_size = 0;
-    AVPacket *packet = av_packet_alloc();
-    AVFrame *frame = av_frame_alloc();
-    uint8_t *audio_buf = NULL;
-    double presentation_time_stamp = 0;
-
-    while (1) {
-        if (packet_queue_get(audio_state->audio_packet_queue, packet, 1) <= 0) {
-            log_warn("Nothing in the audio queue");
-            av_frame_free(&frame);
-            av_packet_free(&packet);
-            return -1;
-        }
+#define AUDIO_SPACE_WAIT_TIMEOUT_MS 100
 
-        log_info("Sending packet for decoding");
-        if (avcodec_send_packet(audio_state->codec_context, packet) < 0) {
-            log_warn("Failed to send packet for decoding");
-            av_packet_unref(packet);
-            continue;
-        }
+/** Whether samples of this format, rate and channel count need swr on their way to the device. While downmixing the
+ * mix takes planar float at the device rate, otherwise the device takes its own packed format, rate and layout. **/
+static bool needs_resampler(AudioState *audio_state, enum AVSampleFormat format, int sample_rate, int channels) {
+    if (sample_rate != audio_state->output_rate) {
+        return true;
+    }
+    if (audio_state->downmixing) {
+        return format != AV_SAMPLE_FMT_FLTP || channels != audio_state->downmix.in_channels;
+    }
+    return format != audio_state->output_format || channels != audio_state->output_layout.nb_channels;
+}
 
-        log_info("Receiving frame from decoder");
-        if (avcodec_receive_frame(audio_state->codec_context, frame) < 0) {
-            log_error("Failed to receive frame");
-            av_frame_unref(frame);
-            av_packet_unref(packet);
-            continue;
+/** Sets up swr to take the given input to the device rate, in the mix's planar float and layout when downmixing and
+ * in the device's format and layout otherwise. Rate, format and layout are converted in one pass. **/
+static int open_resampler(AudioState *audio_state, const AVChannelLayout *layout, enum AVSampleFormat format,
+                          int sample_rate) {
+    const AVChannelLayout *out_layout = audio_state->downmixing ? &audio_state->mix_layout
+                                                                : &audio_state->output_layout;
+    enum AVSampleFormat out_format = audio_state->downmixing ? AV_SAMPLE_FMT_FLTP : audio_state->output_format;
+
+    if (swr_alloc_set_opts2(&audio_state->swr_ctx, out_layout, out_format, audio_state->output_rate, layout, format,
+                            sample_rate, 0, NULL) < 0 || !audio_state->swr_ctx) {
+        log_error("swr_alloc_set_opts failed");
+        return -1;
+    }
+    if (swr_init(audio_state->swr_ctx) < 0) {
+        log_error("Failed to initialize the resampling context");
+        swr_free(&audio_state->swr_ctx);
+        return -1;
+    }
+    av_channel_layout_uninit(&audio_state->swr_in_layout);
+    if (av_channel_layout_copy(&audio_state->swr_in_layout, layout) < 0) {
+        log_error("Could not copy the resampler's input layout");
+        swr_free(&audio_state->swr_ctx);
+        return -1;
+    }
+    audio_state->swr_in_format = format;
+    audio_state->swr_in_rate = sample_rate;
+    log_info("Initialized audio resampling context: %s %d Hz %d channels to %s %d Hz %d channels",
+             av_get_sample_fmt_name(format), sample_rate, layout->nb_channels, av_get_sample_fmt_name(out_format),
+             audio_state->output_rate, out_layout->nb_channels);
+    return 0;
+}
+
+// Grows the planar float buffers swr resamples into ahead of the mix
+static int ensure_mix_capacity(AudioState *audio_state, int nb_samples) {
+    if (nb_samples <= audio_state->mix_capacity) {
+        return 0;
+    }
+    av_freep(&audio_state->mix_planes[0]);
+    audio_state->mix_capacity = 0;
+    if (av_samples_alloc(audio_state->mix_planes, NULL, audio_state->downmix.in_channels, nb_samples,
+                         AV_SAMPLE_FMT_FLTP, 0) < 0) {
+        log_error("Could not allocate audio mix buffers");
+        return -1;
+    }
+    audio_state->mix_capacity = nb_samples;
+    return 0;
+}
+
+/** Decodes the next frame into frame and points data at its samples in the output format. When the decoder already
+ * gives packed samples in that format and rate they are used as they are, otherwise swr converts them into
+ * audio_buffer, stretched or squeezed when the audio drifts off a video or external master. Surround going to a stereo
+ * or mono device is resampled to planar float first if it has to be, then mixed into audio_buffer. Runs on the audio
+ * decode thread, never on SDL's audio thread. Returns the number of bytes at data, 0 for a frame from before a seek, -1 when there is
+ * nothing to decode until a seek or quit. duration is the stream time the bytes cover, which differs from their play
+ * time while compensating. **/
+static int audio_decode_frame(AudioState *audio_state, AVFrame *frame, const uint8_t **data,
+                              double *presentation_time_stamp, double *duration) {
+    int data_size;
+
+    int ret = decoder_decode_frame(&audio_state->decoder, frame);
+    atomic_store(&audio_state->decoding_serial, audio_state->decoder.packet_serial);
+    atomic_store(&audio_state->finished_serial, audio_state->decoder.finished);
+    if (ret <= 0) {
+        // Aborted, or drained at end of stream. Either way there is nothing to play until a seek.
+        return -1;
+    }
+    if (audio_state->decoder.packet_serial != atomic_load(&audio_state->audio_packet_queue->serial)) {
+        // A seek came in after this frame's packet was queued, don't let it touch the clock
+        return 0;
+    }
+    atomic_fetch_add_explicit(&pipeline_stats.audio_frames, 1, memory_order_relaxed);
+
+    // A packet can hold several frames, so the clock follows the frame, not the packet
+    if (frame->pts != AV_NOPTS_VALUE) {
+        audio_state->decode_clock = av_q2d(audio_state->stream->time_base) * frame->pts;
+    } else {
+        log_warn("Undefined audio frame pts, extrapolating the clock");
+    }
+    *duration = (double) frame->nb_samples / frame->sample_rate;
+
+    int wanted_samples = synchronize_audio(audio_state, frame->nb_samples);
+    if (audio_state->swr_ctx && (frame->format != audio_state->swr_in_format ||
+                                 frame->sample_rate != audio_state->swr_in_rate ||
+                                 av_channel_layout_compare(&frame->ch_layout, &audio_state->swr_in_layout) != 0)) {
+        // The decoder switched formats under swr, whatever it still buffers was for the old one
+        log_info("Audio decoder switched to %s %d Hz %d channels, rebuilding the resampler",
+                 av_get_sample_fmt_name(frame->format), frame->sample_rate, frame->ch_layout.nb_channels);
+        swr_free(&audio_state->swr_ctx);
+        audio_state->compensating = 0;
+    }
+    if (!audio_state->swr_ctx && (wanted_samples != frame->nb_samples ||
+                                  needs_resampler(audio_state, frame->format, frame->sample_rate,
+                                                  frame->ch_layout.nb_channels))) {
+        // The decoder switched formats, or the passthrough now has to be stretched. Once set up swr stays in the path
+        // until the input changes again.
+        if (open_resampler(audio_state, &frame->ch_layout, frame->format, frame->sample_rate) < 0) {
+            return 0;
         }
+    }
 
-        if (packet->dts != AV_NOPTS_VALUE) {
-            sync_state->audio_clock = av_q2d(audio_state->stream->time_base) * packet->dts;
+    int bytes_per_sample = audio_state->output_layout.nb_channels * av_get_bytes_per_sample(audio_state->output_format);
+    int max_samples = (int) sizeof(audio_state->audio_buffer) / bytes_per_sample;
+    const float *const *mix_in = NULL;
+    int mix_samples = 0;
+    if (!audio_state->swr_ctx) {
+        if (audio_state->downmixing) {
+            mix_in = (const float *const *) frame->extended_data;
+            mix_samples = frame->nb_samples;
         } else {
-            log_warn("Undefined DTS value");
+            *data = frame->data[0];
+            data_size = frame->nb_samples * bytes_per_sample;
+        }
+        atomic_fetch_add_explicit(&pipeline_stats.audio_passthrough_frames, 1, memory_order_relaxed);
+    } else {
+        int in_rate = frame->sample_rate;
+        int out_rate = audio_state->output_rate;
+        if (wanted_samples != frame->nb_samples || audio_state->compensating) {
+            // Spread the difference over the whole frame, a zero delta ends a compensation that is no longer needed
+            if (swr_set_compensation(audio_state->swr_ctx,
+                                     (int) ((int64_t) (wanted_samples - frame->nb_samples) * out_rate / in_rate),
+                                     (int) ((int64_t) wanted_samples * out_rate / in_rate)) < 0) {
+                log_warn("Could not set audio drift compensation");
+                wanted_samples = frame->nb_samples;
+            }
+            audio_state->compensating = wanted_samples != frame->nb_samples;
+            audio_state->compensations += audio_state->compensating;
         }
 
-        // Resample audio to S16 format
+        // Anything that doesn't fit stays buffered inside swr for the next frame
         int out_samples = av_rescale_rnd(
-            swr_get_delay(audio_state->swr_ctx, frame->sample_rate) + frame->nb_samples,
-            frame->sample_rate,
-            frame->sample_rate,
+            swr_get_delay(audio_state->swr_ctx, in_rate) + wanted_samples,
+            out_rate,
+            in_rate,
             AV_ROUND_UP
         );
+        out_samples = FFMIN(out_samples, max_samples);
 
-        av_samples_alloc(&audio_buf,
-                         NULL,
-                         frame->ch_layout.nb_channels,
-                         out_samples,
-                         AV_SAMPLE_FMT_S16,
-                         0);
-
+        uint8_t *out = audio_state->audio_buffer;
+        uint8_t **out_planes = &out;
+        if (audio_state->downmixing) {
+            if (ensure_mix_capacity(audio_state, out_samples) < 0) {
+                return 0;
+            }
+            out_planes = audio_state->mix_planes;
+        }
+        int64_t begin = stats_begin();
         int converted_samples = swr_convert(
             audio_state->swr_ctx,
-            &audio_buf,
+            out_planes,
             out_samples,
-            (const uint8_t **) frame->data,
+            (const uint8_t **) frame->extended_data,
             frame->nb_samples
         );
-        data_size = converted_samples * frame->ch_layout.nb_channels * av_get_bytes_per_sample(AV_SAMPLE_FMT_S16);
+        stats_end(STATS_RESAMPLE, begin);
+        if (converted_samples < 0) {
+            log_error("Failed to convert audio frame");
+            return 0;
+        }
+        if (audio_state->downmixing) {
+            mix_in = (const float *const *) audio_state->mix_planes;
+            mix_samples = converted_samples;
+        } else {
+            *data = audio_state->audio_buffer;
+            data_size = converted_samples * bytes_per_sample;
+        }
+    }
 
-        if (data_size > sizeof(audio_state->audio_buffer)) {
-            log_error("Audio buffer too small");
-            av_freep(&audio_buf);
-            av_frame_free(&frame);
-            av_packet_free(&packet);
-            return -1;
+    if (mix_in) {
+        mix_samples = FFMIN(mix_samples, max_samples);
+        int64_t begin = stats_begin();
+        downmix_run(&audio_state->downmix, mix_in, mix_samples, audio_state->audio_buffer);
+        stats_end(STATS_DOWNMIX, begin);
+        *data = audio_state->audio_buffer;
+        data_size = mix_samples * bytes_per_sample;
+    }
+
+    *presentation_time_stamp = audio_state->decode_clock;
+    audio_state->decode_clock += *duration;
+    log_info("Decoded %d bytes of audio data", data_size);
+    return data_size;
+}
+
+static bool pcm_ring_full(AudioState *audio_state) {
+    return spsc_ring_size(&audio_state->pcm_ring) == audio_state->pcm_ring.capacity ||
+           spsc_ring_size(&audio_state->segment_ring) == audio_state->segment_ring.capacity;
+}
+
+/** Sleeps until the callback has made room. The flag is raised before the recheck so a callback that drains the ring
+ * in between is guaranteed to see it and post. **/
+static void wait_for_pcm_space(AudioState *audio_state) {
+    atomic_store(&audio_state->producer_waiting, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (pcm_ring_full(audio_state)) {
+        // Timeout covers quitting and a paused device, where no callback comes to post
+        SDL_SemWaitTimeout(audio_state->space_sem, AUDIO_SPACE_WAIT_TIMEOUT_MS);
+    }
+    atomic_store(&audio_state->producer_waiting, 0);
+}
+
+/** Copies converted samples covering duration from pts into the PCM ring, waiting for room as needed. Gives up once a
+ * seek makes them stale. **/
+static void pcm_ring_write(AudioState *audio_state, const uint8_t *data, size_t size, double pts, double duration,
+                           int serial) {
+    // Stream time per byte, off 1 / bytes_per_second by the drift compensation stretch
+    double seconds_per_byte = duration / (double) size;
+
+    while (size > 0) {
+        if (*audio_state->quit || serial != atomic_load(&audio_state->audio_packet_queue->serial)) {
+            return;
         }
 
-        memcpy(audio_state->audio_buffer, audio_buf, data_size);
-        presentation_time_stamp = sync_state->audio_clock;
-        int n = 2 * audio_state->codec_context->ch_layout.nb_channels;
-        sync_state->audio_clock += (double) data_size / (double) (n * audio_state->codec_context->sample_rate);
-        av_freep(&audio_buf);
-        av_frame_free(&frame);
-        av_packet_free(&packet);
-        log_info("Decoded %d bytes of audio data", data_size);
-        return data_size;
+        size_t written = 0;
+        if (spsc_ring_size(&audio_state->segment_ring) < audio_state->segment_ring.capacity) {
+            written = spsc_ring_write(&audio_state->pcm_ring, data, size);
+        }
+        if (written == 0) {
+            wait_for_pcm_space(audio_state);
+            continue;
+        }
+
+        // Samples first, then the segment that makes them visible to the callback
+        pts += written * seconds_per_byte;
+        AudioSegment segment = {spsc_ring_write_index(&audio_state->pcm_ring), pts, serial};
+        spsc_ring_push(&audio_state->segment_ring, &segment);
+        data += written;
+        size -= written;
     }
 }
 
+int audio_thread(void *userdata) {
+    PlayerState *player_state = (PlayerState *) userdata;
+    AudioState *audio_state = player_state->audio_state;
+    const uint8_t *data;
+    double presentation_time_stamp;
+    double duration;
+
+    trace_thread_name("audio decode");
+    while (!*audio_state->quit) {
+        wait_if_paused();
+
+        AVFrame *frame = object_pool_get(&audio_state->frame_pool);
+        if (!frame) {
+            break;
+        }
+        int64_t trace = trace_begin();
+        int data_size = audio_decode_frame(audio_state, frame, &data, &presentation_time_stamp, &duration);
+        if (data_size > 0) {
+            trace_end("audio_decode", trace, presentation_time_stamp);
+            // Passthrough samples are still in the frame, it only goes back to the pool once they are in the ring
+            pcm_ring_write(audio_state, data, data_size, presentation_time_stamp, duration,
+                           audio_state->decoder.packet_serial);
+        }
+        object_pool_put(&audio_state->frame_pool, frame);
+        if (data_size < 0 && atomic_load(&audio_state->audio_packet_queue->abort_request)) {
+            break;
+        }
+        // Otherwise a frame from before a seek, or the end of stream where the next decode blocks until a seek
+    }
+
+    log_info("Audio decode thread exiting, %lld underruns, %lld frames drift compensated",
+             (long long) atomic_load(&audio_state->underruns), (long long) audio_state->compensations);
+    return 0;
+}
+
+/** When this callback should have come, going by the bytes the device has taken so far. SDL's audio thread wakes up
+ * late by a varying amount and some backends pull several buffers back to back, the device itself plays at a steady
+ * rate, so the anchor is smoothed and the callback is placed on it. A pause, stall or underrun moves the callbacks off
+ * the count for good, past AUDIO_CALLBACK_RESYNC the anchor starts over from the current one. **/
+static double audio_callback_time(AudioState *audio_state) {
+    double now = av_gettime_relative() / 1000000.0;
+    double delivered = (double) audio_state->delivered_bytes / audio_state->bytes_per_second;
+    double anchor = now - delivered;
+
+    if (isnan(audio_state->callback_anchor) || fabs(anchor - audio_state->callback_anchor) > AUDIO_CALLBACK_RESYNC) {
+        audio_state->callback_anchor = anchor;
+    } else {
+        audio_state->callback_anchor = AUDIO_CALLBACK_SMOOTHING * audio_state->callback_anchor +
+                                       (1.0 - AUDIO_CALLBACK_SMOOTHING) * anchor;
+    }
+    // Never ahead of the real time, the clock would otherwise be stamped for a moment that hasn't come yet
+    return FFMIN(audio_state->callback_anchor + delivered, now);
+}
+
+/** Runs on SDL's real-time audio thread, so it only copies bytes out of the PCM ring: no decoding, no allocation, no
+ * locks. Whatever the ring can't cover is played as silence. Publishes the audio clock on the way out. **/
 void sdl_audio_callback(void *userdata, Uint8 *stream, int len) {
-    log_info("SDL audio callback called");
     AudioState *audio_state = (AudioState *) userdata;
-    int audio_size;
-    int len1;
-    double pts;
+    int serial = atomic_load(&audio_state->audio_packet_queue->serial);
+    double callback_time = audio_callback_time(audio_state);
+    int requested = len;
 
-    if (!audio_state->swr_ctx || !audio_state->codec_context) {
-        memset(stream, 0, len); // Output silence if not ready
-        log_warn("Audio context not ready");
-        return;
-    }
+    trace_thread_name("audio callback");
+    int64_t trace = trace_begin();
     while (len > 0) {
-        if (audio_state->buffer_index >= audio_state->buffer_size) {
-            audio_size = audio_decode_frame(audio_state);
-            if (audio_size < 0) {
-                log_info("Audio buffer empty, filling with silence");
-                audio_state->buffer_size = 1024;
-                memset(audio_state->audio_buffer, 0, audio_state->buffer_size);
-            } else {
-                log_info("Audio buffer filled with %d bytes", audio_size);
-                audio_size = synchronize_audio(audio_state,
-                                               (int16_t *) audio_state->audio_buffer,
-                                               audio_size,
-                                               pts);
-                audio_state->buffer_size = audio_size;
+        if (!audio_state->has_segment) {
+            if (!spsc_ring_pop(&audio_state->segment_ring, &audio_state->segment)) {
+                break;
             }
-            audio_state->buffer_index = 0;
+            audio_state->has_segment = 1;
+        }
+
+        size_t left = audio_state->segment.end - spsc_ring_read_index(&audio_state->pcm_ring);
+        if (left == 0) {
+            audio_state->played_pts = audio_state->segment.end_pts;
+            audio_state->played_serial = audio_state->segment.serial;
+            audio_state->has_segment = 0;
+            continue;
+        }
+        if (audio_state->segment.serial != serial) {
+            // Samples from before a seek
+            spsc_ring_read(&audio_state->pcm_ring, NULL, left);
+            audio_state->has_segment = 0;
+            continue;
+        }
+
+        size_t copied = spsc_ring_read(&audio_state->pcm_ring, stream, FFMIN(left, (size_t) len));
+        stream += copied;
+        len -= (int) copied;
+    }
+
+    if (len > 0) {
+        memset(stream, audio_state->device_spec.silence, len);
+        // Running dry at the end of the file or right after a seek is expected, anywhere else it is an underrun
+        if (atomic_load(&audio_state->finished_serial) != serial &&
+            atomic_load(&audio_state->decoding_serial) == serial) {
+            atomic_fetch_add_explicit(&audio_state->underruns, 1, memory_order_relaxed);
         }
+    }
+
+    if (atomic_exchange(&audio_state->producer_waiting, 0)) {
+        SDL_SemPost(audio_state->space_sem);
+    }
+
+    audio_state->delivered_bytes += requested;
+
+    /** The ring's read position is what the device will play once this buffer and everything queued ahead of it have
+     * been heard, the clock runs on from there until the next callback **/
+    double pts = audio_state->played_pts;
+    int pts_serial = audio_state->played_serial;
+    if (audio_state->has_segment) {
+        size_t left = audio_state->segment.end - spsc_ring_read_index(&audio_state->pcm_ring);
+        pts = audio_state->segment.end_pts - (double) left / audio_state->bytes_per_second;
+        pts_serial = audio_state->segment.serial;
+    }
+    pts -= (double) requested / audio_state->bytes_per_second + audio_state->device_latency;
+    if (pts_serial == serial && !isnan(pts)) {
+        clock_set_at(&sync_state->audio_clock, pts, serial, callback_time);
+        clock_sync_to_slave(&sync_state->external_clock, &sync_state->audio_clock);
+    }
+    if (trace) {
+        trace_end("audio_callback", trace, pts);
+        trace_counter("pcm_ring_bytes", (double) spsc_ring_size(&audio_state->pcm_ring));
+    }
+}
 
-        log_info("Audio buffer index: %d, size: %d", audio_state->buffer_index, audio_state->buffer_size);
-        len1 = audio_state->buffer_size - audio_state->buffer_index;
-        if (len1 > len) {
-            len1 = len;
+// Packed formats the decode thread can write for the device as they are, AV_SAMPLE_FMT_NONE for the rest
+static enum AVSampleFormat sample_format_from_sdl(SDL_AudioFormat format) {
+    switch (format) {
+        case AUDIO_U8:
+            return AV_SAMPLE_FMT_U8;
+        case AUDIO_S16SYS:
+            return AV_SAMPLE_FMT_S16;
+        case AUDIO_S32SYS:
+            return AV_SAMPLE_FMT_S32;
+        case AUDIO_F32SYS:
+            return AV_SAMPLE_FMT_FLT;
+        default:
+            return AV_SAMPLE_FMT_NONE;
+    }
+}
+
+/** Opens the device, letting it pick the sample format, rate, channel count, buffer size and silence value, so the
+ * pipeline resamples and downmixes once to what the hardware takes instead of SDL doing it again behind the callback.
+ * F32 is asked for first since that is what most decoders give. A format the decode thread can't write, like
+ * big-endian samples, is handed back to SDL to convert from F32. **/
+static int open_audio_device(AudioState *audio_state, SDL_AudioSpec *wanted_spec, double extra_latency) {
+    const int allowed_changes = SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE;
+
+    audio_state->device = SDL_OpenAudioDevice(NULL, 0, wanted_spec, &audio_state->device_spec,
+                                              allowed_changes | SDL_AUDIO_ALLOW_FORMAT_CHANGE);
+    if (audio_state->device == 0) {
+        log_error("Failed to open SDL audio: %s", SDL_GetError());
+        return -1;
+    }
+    if (sample_format_from_sdl(audio_state->device_spec.format) == AV_SAMPLE_FMT_NONE) {
+        log_warn("Audio device wants format 0x%x, letting SDL convert", audio_state->device_spec.format);
+        SDL_CloseAudioDevice(audio_state->device);
+        audio_state->device = SDL_OpenAudioDevice(NULL, 0, wanted_spec, &audio_state->device_spec, allowed_changes);
+        if (audio_state->device == 0) {
+            log_error("Failed to open SDL audio: %s", SDL_GetError());
+            return -1;
         }
-        memcpy(stream, (uint8_t *) audio_state->audio_buffer + audio_state->buffer_index, len1);
-        len -= len1;
-        stream += len1;
-        audio_state->buffer_index += len1;
-        log_info("Audio buffer index after copy: %d", audio_state->buffer_index);
     }
+    audio_state->output_format = sample_format_from_sdl(audio_state->device_spec.format);
+    audio_state->output_rate = audio_state->device_spec.freq;
+    av_channel_layout_uninit(&audio_state->output_layout);
+    av_channel_layout_default(&audio_state->output_layout, audio_state->device_spec.channels);
+
+    /** The device holds the buffer it is playing while the next callback fills another one, so a sample written by a
+     * callback is heard one device buffer after the callback returns, plus whatever the driver adds on top **/
+    audio_state->device_latency = (double) audio_state->device_spec.samples / audio_state->device_spec.freq +
+                                  extra_latency;
+    // Drift under a device buffer can't be told apart from callback timing
+    audio_state->audio_diff_threshold = (double) audio_state->device_spec.samples / audio_state->device_spec.freq;
+    log_info("Opened SDL audio device: %d Hz, %d channels, %s, %d samples (%u bytes) per buffer, %.1f ms latency",
+             audio_state->device_spec.freq, audio_state->device_spec.channels,
+             av_get_sample_fmt_name(audio_state->output_format), audio_state->device_spec.samples,
+             audio_state->device_spec.size, audio_state->device_latency * 1000.0);
+    return 0;
 }
 
-static int stream_component_open(AudioState *audio_state, AVFormatContext *format_context) {
+static int stream_component_open(AudioState *audio_state, AVFormatContext *format_context,
+                                 const PlayerOptions *options) {
     SDL_AudioSpec wanted_spec;
-    SDL_AudioSpec spec;
     int ret = 0;
 
 
@@ -161,6 +465,7 @@ static int stream_component_open(AudioState *audio_state, AVFormatContext *forma
         ret = -1;
         goto cleanup;
     }
+    codec_context->pkt_timebase = format_context->streams[audio_state->stream_index]->time_base;
 
     if (avcodec_open2(codec_context, codec, NULL) < 0) {
         log_error("Failed to open decoder");
@@ -170,60 +475,60 @@ static int stream_component_open(AudioState *audio_state, AVFormatContext *forma
     log_info("Opened audio decoder");
 
     wanted_spec.freq = codec_context->sample_rate;
-    wanted_spec.format = AUDIO_S16SYS;
+    wanted_spec.format = AUDIO_F32SYS;
     wanted_spec.channels = codec_context->ch_layout.nb_channels;
     wanted_spec.silence = 0;
     wanted_spec.callback = sdl_audio_callback;
     wanted_spec.userdata = audio_state;
     wanted_spec.samples = SDL_AUDIO_BUFFER_SIZE;
 
-    audio_state->swr_ctx = swr_alloc();
-
-    // Convert audio to FMT_S16
-    swr_alloc_set_opts2(
-        &audio_state->swr_ctx,
-        &codec_context->ch_layout, // output channel layout
-        AV_SAMPLE_FMT_S16, // output sample format
-        codec_context->sample_rate, // output sample rate
-        &codec_context->ch_layout, // input channel layout
-        codec_context->sample_fmt, // input sample format
-        codec_context->sample_rate, // input sample rate
-        0,
-        NULL
-    );
-
-    if (!audio_state->swr_ctx) {
-        log_error("swr_alloc_set_opts failed");
-        ret = -1;
-        goto cleanup;
+    if (!options->headless) {
+        if (open_audio_device(audio_state, &wanted_spec, options->audio_latency) < 0) {
+            ret = -1;
+            goto cleanup;
+        }
+    } else {
+        // The null sink takes what a device would most likely ask for, F32 stereo at the stream's rate
+        audio_state->output_format = AV_SAMPLE_FMT_FLT;
+        audio_state->output_rate = codec_context->sample_rate;
+        av_channel_layout_default(&audio_state->output_layout, FFMIN(codec_context->ch_layout.nb_channels, 2));
+        audio_state->device_spec.silence = 0;
+        log_info("Headless run, audio goes to the null sink");
     }
-    log_info("Allocated audio resampling context");
 
-    if (swr_init(audio_state->swr_ctx) < 0) {
-        log_error("Failed to initialize the resampling context");
-        swr_free(&audio_state->swr_ctx);
-        audio_state->swr_ctx = NULL;
-        ret = -1;
-        goto cleanup;
+    if (codec_context->ch_layout.nb_channels > audio_state->output_layout.nb_channels) {
+        if (downmix_init(&audio_state->downmix, &codec_context->ch_layout, audio_state->output_layout.nb_channels,
+                         audio_state->output_format, &options->downmix) == 0 &&
+            av_channel_layout_copy(&audio_state->mix_layout, &codec_context->ch_layout) == 0) {
+            audio_state->downmixing = 1;
+            log_info("Downmixing %d channels to %d with the %s kernel", codec_context->ch_layout.nb_channels,
+                     audio_state->output_layout.nb_channels, audio_state->downmix.kernel_name);
+        } else {
+            log_info("Downmix of %d channels to %d %s left to swr", codec_context->ch_layout.nb_channels,
+                     audio_state->output_layout.nb_channels, av_get_sample_fmt_name(audio_state->output_format));
+        }
     }
-    log_info("Initialized audio resampling context");
-
 
-    if (SDL_OpenAudio(&wanted_spec, &spec) < 0) {
-        log_error("Failed to open SDL audio");
+    /** Decoders with packed output in the device's format and rate skip swr altogether, and so does planar float on
+     * its way to the mix. Anything else is resampled, converted and interleaved by swr in one pass. **/
+    if (!needs_resampler(audio_state, codec_context->sample_fmt, codec_context->sample_rate,
+                         codec_context->ch_layout.nb_channels)) {
+        log_info("Audio decoder output is already %s at %d Hz, passing samples through",
+                 av_get_sample_fmt_name(codec_context->sample_fmt), codec_context->sample_rate);
+    } else if (open_resampler(audio_state, &codec_context->ch_layout, codec_context->sample_fmt,
+                              codec_context->sample_rate) < 0) {
         ret = -1;
         goto cleanup;
     }
-    log_info("Opened SDL audio device");
 
     audio_state->format_context = format_context;
     audio_state->stream = format_context->streams[audio_state->stream_index];
     audio_state->codec_context = codec_context;
-    audio_state->buffer_size = 0;
-    audio_state->buffer_index = 0;
-    audio_state->packet = (AVPacket){0};
-
-    SDL_PauseAudio(0);
+    if (options->headless) {
+        audio_state->audio_diff_threshold = (double) SDL_AUDIO_BUFFER_SIZE / codec_context->sample_rate;
+    }
+    audio_state->bytes_per_second = audio_state->output_rate * audio_state->output_layout.nb_channels *
+                                    av_get_bytes_per_sample(audio_state->output_format);
 
     return ret;
 
@@ -236,6 +541,10 @@ cleanup:
         swr_free(&audio_state->swr_ctx);
         log_info("Audio resampling context freed");
     }
+    if (audio_state->device) {
+        SDL_CloseAudioDevice(audio_state->device);
+        audio_state->device = 0;
+    }
 
     return ret;
 }
@@ -245,7 +554,7 @@ static int find_stream_index(PlayerState *player_state, AVFormatContext *fmt_ctx
     int related_stream = player_state->video_state->stream_index;
     audio_state->stream_index = av_find_best_stream(fmt_ctx,
                                                     AVMEDIA_TYPE_AUDIO,
-                                                    -1,
+                                                    player_state->sidecar_cache.audio_stream,
                                                     related_stream,
                                                     NULL,
                                                     0);
@@ -259,29 +568,88 @@ static int find_stream_index(PlayerState *player_state, AVFormatContext *fmt_ctx
 }
 
 int audio_init(AudioState *audio_state, PlayerState *player_state) {
-    if (find_stream_index(player_state, player_state->format_context) < 0) {
-        log_error("Could not find audio stream index");
+    audio_state->has_segment = 0;
+    audio_state->decode_clock = 0;
+    audio_state->played_pts = NAN;
+    audio_state->played_serial = -1;
+    audio_state->device = 0;
+    audio_state->swr_ctx = NULL;
+    audio_state->swr_in_format = AV_SAMPLE_FMT_NONE;
+    audio_state->swr_in_rate = 0;
+    memset(&audio_state->swr_in_layout, 0, sizeof(AVChannelLayout));
+    audio_state->downmixing = 0;
+    memset(&audio_state->mix_layout, 0, sizeof(AVChannelLayout));
+    memset(audio_state->mix_planes, 0, sizeof(audio_state->mix_planes));
+    audio_state->mix_capacity = 0;
+    memset(&audio_state->output_layout, 0, sizeof(AVChannelLayout));
+    audio_state->delivered_bytes = 0;
+    audio_state->callback_anchor = NAN;
+    audio_state->device_latency = 0;
+    audio_state->audio_diff_cum = 0;
+    audio_state->audio_diff_avg_coef = exp(log(0.01) / AUDIO_DIFF_AVG_NB);
+    audio_state->audio_diff_avg_count = 0;
+    audio_state->compensating = 0;
+    audio_state->compensations = 0;
+    atomic_init(&audio_state->producer_waiting, 0);
+    atomic_init(&audio_state->underruns, 0);
+    atomic_init(&audio_state->decoding_serial, 0);
+    atomic_init(&audio_state->finished_serial, 0);
+    audio_state->space_sem = SDL_CreateSemaphore(0);
+    if (frame_pool_init(&audio_state->frame_pool, "Audio Frames", 4) < 0 ||
+        spsc_ring_init(&audio_state->pcm_ring, AUDIO_PCM_RING_SIZE, 1) < 0 ||
+        spsc_ring_init(&audio_state->segment_ring, AUDIO_SEGMENT_RING_SIZE, sizeof(AudioSegment)) < 0 ||
+        !audio_state->space_sem) {
+        log_error("Could not allocate audio decode buffers");
         return -1;
     }
 
-    if (stream_component_open(audio_state, player_state->format_context) < 0) {
-        log_error("Could not open audio stream");
+    if (find_stream_index(player_state, player_state->format_context) < 0) {
+        log_error("Could not find audio stream index");
         return -1;
     }
+
+    // The queue has to exist before the device starts, the callback checks its serial straight away
     audio_state->audio_packet_queue = malloc(sizeof(PacketQueue));
-    if (packet_queue_init(audio_state->audio_packet_queue, "Audio Queue") < 0) {
+    if (packet_queue_init(audio_state->audio_packet_queue, "Audio Queue",
+                          player_state->format_context->streams[audio_state->stream_index]->time_base) < 0) {
         return -1;
     };
     log_info("Initialized audio packet queue");
 
+    if (stream_component_open(audio_state, player_state->format_context, &player_state->options) < 0) {
+        log_error("Could not open audio stream");
+        return -1;
+    }
+    if (decoder_init(&audio_state->decoder, "Audio Decoder", audio_state->codec_context,
+                     audio_state->audio_packet_queue, STATS_AUDIO_DECODE) < 0) {
+        return -1;
+    }
+
+    // Only start pulling samples once the decoder is ready to hand them out
+    if (audio_state->device) {
+        SDL_PauseAudioDevice(audio_state->device, 0);
+    }
+
     return 0;
 }
 
 void audio_cleanup(AudioState *audio_state) {
+    // Stop the callback before the rings it reads from go away
+    if (audio_state->device) {
+        SDL_CloseAudioDevice(audio_state->device);
+        audio_state->device = 0;
+        log_info("SDL audio device closed");
+    }
+
+    decoder_destroy(&audio_state->decoder);
     if (audio_state->swr_ctx) {
         swr_free(&audio_state->swr_ctx);
         log_info("Audio resampling context freed");
     }
+    av_freep(&audio_state->mix_planes[0]);
+    av_channel_layout_uninit(&audio_state->swr_in_layout);
+    av_channel_layout_uninit(&audio_state->mix_layout);
+    av_channel_layout_uninit(&audio_state->output_layout);
     if (audio_state->codec_context) {
         avcodec_free_context(&audio_state->codec_context);
         log_info("Audio codec context freed");
@@ -294,7 +662,11 @@ void audio_cleanup(AudioState *audio_state) {
         packet_queue_destroy(audio_state->audio_packet_queue);
         log_info("Audio packet queue destroyed");
     }
-
-    SDL_CloseAudio();
-    log_info("SDL audio device closed");
+    object_pool_destroy(&audio_state->frame_pool);
+    spsc_ring_destroy(&audio_state->pcm_ring);
+    spsc_ring_destroy(&audio_state->segment_ring);
+    if (audio_state->space_sem) {
+        SDL_DestroySemaphore(audio_state->space_sem);
+    }
+    log_info("Audio stream had %lld underruns", (long long) atomic_load(&audio_state->underruns));
 }
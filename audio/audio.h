@@ -6,35 +6,84 @@
 #define AUDIO_H
 
 #include <SDL_audio.h>
+#include "downmix.h"
+#include "../utils/decoder.h"
 #include "../utils/packet_queue.h"
+#include "../utils/pool.h"
+#include "../utils/spsc_ring.h"
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIO_FRAME_SIZE 192000
+#define AUDIO_PCM_RING_SIZE (256 * 1024) // bytes of converted samples the decode thread may run ahead
+#define AUDIO_SEGMENT_RING_SIZE 1024
+#define AUDIO_CALLBACK_SMOOTHING 0.95 // per callback, evens out how late SDL's audio thread gets scheduled
+#define AUDIO_CALLBACK_RESYNC 0.05 // seconds the callbacks may wander off the sample count before it is trusted again
 
 // Forward declarations
 typedef struct PlayerState PlayerState;
 
+/** Marks where a run of samples of one seek generation ends in the PCM ring, so the callback can drop samples
+ * decoded before a seek without the decode thread ever touching the read side. **/
+typedef struct AudioSegment {
+    size_t end; // absolute PCM ring write index just past the run
+    double end_pts; // pts of the sample at end
+    int serial;
+} AudioSegment;
+
 typedef struct AudioState {
     AVFormatContext *format_context;
     AVStream *stream;
     int stream_index;
     AVCodecContext *codec_context;
 
-    AVPacket packet;
+    Decoder decoder;
+    ObjectPool frame_pool;
 
     PacketQueue *audio_packet_queue;
-    uint8_t audio_buffer[(MAX_AUDIO_FRAME_SIZE * 3) / 2];
-    unsigned int buffer_size;
-    unsigned int buffer_index;
-    struct SwrContext *swr_ctx;
+    uint8_t audio_buffer[(MAX_AUDIO_FRAME_SIZE * 3) / 2]; // decode thread only, swr converts into it
+    struct SwrContext *swr_ctx; // NULL while the decoder's samples pass through as they are
+    enum AVSampleFormat swr_in_format; // what swr_ctx was set up to take, rebuilt when frames stop matching
+    int swr_in_rate;
+    AVChannelLayout swr_in_layout;
+    enum AVSampleFormat output_format; // packed, what the callback hands the device
+    int output_rate; // the device's
+    AVChannelLayout output_layout; // default layout for the device's channel count
+    Downmix downmix; // surround to a stereo or mono device
+    int downmixing;
+    AVChannelLayout mix_layout; // the input layout the downmix matrix was built for
+    uint8_t *mix_planes[DOWNMIX_MAX_IN_CHANNELS]; // decode thread only, swr's planar float output ahead of the mix
+    int mix_capacity; // samples per plane
+    int bytes_per_second; // of the converted output
+    SDL_AudioDeviceID device; // 0 in headless runs
+    SDL_AudioSpec device_spec; // as obtained from SDL
+    double device_latency; // seconds from a callback returning until its first sample is heard
+    double decode_clock; // decode thread only, pts just past the last converted sample
+
+    /** Decode thread writes converted samples here, the SDL callback only copies them out **/
+    SpscRing pcm_ring;
+    SpscRing segment_ring; // holds AudioSegment
+    AudioSegment segment; // callback's current segment
+    int has_segment;
+    double played_pts; // callback only, pts at the ring's read position once the last segment ran out
+    int played_serial;
+    int64_t delivered_bytes; // callback only, handed to the device since it opened, silence included
+    double callback_anchor; // callback only, smoothed callback time minus delivered_bytes in seconds, NAN until the first
+    SDL_sem *space_sem; // posted by the callback when the decode thread waits for room in the ring
+    atomic_int producer_waiting;
+    atomic_int_fast64_t underruns; // callbacks that had to pad with silence while still playing
+    // Published by the decode thread after every decode, the decoder's own fields are decode thread only
+    atomic_int decoding_serial; // serial of the samples being decoded
+    atomic_int finished_serial; // serial decoded to the end of the stream, 0 while decoding
 
-    double audio_diff_cum;
+    /** Drift compensation against a video or external master, decode thread only **/
+    double audio_diff_cum; // exponentially weighted sum of audio minus master
     double audio_diff_avg_coef;
-    double audio_diff_threshold;
+    double audio_diff_threshold; // seconds the average has to be off before swr compensates
     int audio_diff_avg_count;
-
+    int compensating; // swr has a compensation set
+    int64_t compensations; // frames resampled to a different length
 
     int *quit;
 } AudioState;
@@ -43,5 +92,7 @@ int audio_init(AudioState *audio, PlayerState *player_state);
 
 void audio_cleanup(AudioState *audio);
 
+int audio_thread(void *userdata);
+
 void sdl_audio_callback(void *userdata, Uint8 *stream, int len);
 #endif //AUDIO_H
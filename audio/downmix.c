@@ -0,0 +1,434 @@
+//
+// Created by Deshy on 2025/06/22.
+//
+#include "downmix.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL_cpuinfo.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "../libs/microlog/microlog.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define DOWNMIX_X86 1
+#include <immintrin.h>
+#else
+#define DOWNMIX_X86 0
+#endif
+
+#define DOWNMIX_S16_SCALE 32768.0f
+#define DOWNMIX_BENCH_SAMPLES 4096
+#define DOWNMIX_BENCH_ITERATIONS 4000
+
+static uint32_t xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// [0, 1) from the top 23 bits, as the mantissa of a float in [1, 2)
+static float uniform(uint32_t *state) {
+    uint32_t bits = (xorshift32(state) >> 9) | 0x3f800000u;
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value - 1.0f;
+}
+
+// Triangular between -1 and 1 LSB, which keeps quantization noise from following the signal
+static float tpdf(uint32_t *state) {
+    return uniform(state) - uniform(state);
+}
+
+/** Reference kernel, also the tail of the SIMD ones. Covers any channel counts the matrix holds. **/
+static void mix_scalar_range(Downmix *downmix, const float *const *in, int start, int end, void *out) {
+    for (int i = start; i < end; i++) {
+        for (int o = 0; o < downmix->out_channels; o++) {
+            float sum = 0.0f;
+            for (int c = 0; c < downmix->in_channels; c++) {
+                sum += downmix->matrix[o][c] * in[c][i];
+            }
+            int index = i * downmix->out_channels + o;
+            if (downmix->out_format == AV_SAMPLE_FMT_FLT) {
+                ((float *) out)[index] = sum;
+            } else {
+                float sample = sum * DOWNMIX_S16_SCALE + tpdf(&downmix->dither_state[0]);
+                ((int16_t *) out)[index] = av_clip_int16((int) lrintf(sample));
+            }
+        }
+    }
+}
+
+static void mix_scalar(Downmix *downmix, const float *const *in, int nb_samples, void *out) {
+    mix_scalar_range(downmix, in, 0, nb_samples, out);
+}
+
+#if DOWNMIX_X86
+__attribute__((target("sse2")))
+static inline __m128 tpdf_sse2(__m128i *state) {
+    const __m128i one = _mm_set1_epi32(0x3f800000);
+    __m128 draws[2];
+
+    for (int i = 0; i < 2; i++) {
+        __m128i x = *state;
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+        *state = x;
+        draws[i] = _mm_castsi128_ps(_mm_or_si128(_mm_srli_epi32(x, 9), one));
+    }
+    // Both draws are offset by one, the difference isn't
+    return _mm_sub_ps(draws[0], draws[1]);
+}
+
+/** Four frames per iteration: each input channel is one load and a multiply-add into left and right, then the two are
+ * interleaved and stored, for S16 after dither with a rounding, saturating pack. **/
+__attribute__((target("sse2")))
+static void mix_stereo_sse2(Downmix *downmix, const float *const *in, int nb_samples, void *out) {
+    __m128 left_coefficients[DOWNMIX_MAX_IN_CHANNELS];
+    __m128 right_coefficients[DOWNMIX_MAX_IN_CHANNELS];
+    int i = 0;
+
+    for (int c = 0; c < downmix->in_channels; c++) {
+        left_coefficients[c] = _mm_set1_ps(downmix->matrix[0][c]);
+        right_coefficients[c] = _mm_set1_ps(downmix->matrix[1][c]);
+    }
+
+    __m128i state = _mm_loadu_si128((const __m128i *) downmix->dither_state);
+    const __m128 scale = _mm_set1_ps(DOWNMIX_S16_SCALE);
+    for (; i + 4 <= nb_samples; i += 4) {
+        __m128 left = _mm_setzero_ps();
+        __m128 right = _mm_setzero_ps();
+        for (int c = 0; c < downmix->in_channels; c++) {
+            __m128 samples = _mm_loadu_ps(in[c] + i);
+            left = _mm_add_ps(left, _mm_mul_ps(samples, left_coefficients[c]));
+            right = _mm_add_ps(right, _mm_mul_ps(samples, right_coefficients[c]));
+        }
+        __m128 low = _mm_unpacklo_ps(left, right);
+        __m128 high = _mm_unpackhi_ps(left, right);
+
+        if (downmix->out_format == AV_SAMPLE_FMT_FLT) {
+            float *dst = (float *) out + 2 * i;
+            _mm_storeu_ps(dst, low);
+            _mm_storeu_ps(dst + 4, high);
+        } else {
+            low = _mm_add_ps(_mm_mul_ps(low, scale), tpdf_sse2(&state));
+            high = _mm_add_ps(_mm_mul_ps(high, scale), tpdf_sse2(&state));
+            __m128i packed = _mm_packs_epi32(_mm_cvtps_epi32(low), _mm_cvtps_epi32(high));
+            _mm_storeu_si128((__m128i *) ((int16_t *) out + 2 * i), packed);
+        }
+    }
+    _mm_storeu_si128((__m128i *) downmix->dither_state, state);
+
+    mix_scalar_range(downmix, in, i, nb_samples, out);
+}
+
+__attribute__((target("avx2")))
+static inline __m256 tpdf_avx2(__m256i *state) {
+    const __m256i one = _mm256_set1_epi32(0x3f800000);
+    __m256 draws[2];
+
+    for (int i = 0; i < 2; i++) {
+        __m256i x = *state;
+        x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+        x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+        x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 5));
+        *state = x;
+        draws[i] = _mm256_castsi256_ps(_mm256_or_si256(_mm256_srli_epi32(x, 9), one));
+    }
+    return _mm256_sub_ps(draws[0], draws[1]);
+}
+
+/** Same as the SSE2 kernel with eight frames per iteration. AVX2 unpacks and packs work within 128-bit lanes, so the
+ * interleaved halves and the packed S16 are put back in order with a cross-lane permute. **/
+__attribute__((target("avx2")))
+static void mix_stereo_avx2(Downmix *downmix, const float *const *in, int nb_samples, void *out) {
+    __m256 left_coefficients[DOWNMIX_MAX_IN_CHANNELS];
+    __m256 right_coefficients[DOWNMIX_MAX_IN_CHANNELS];
+    int i = 0;
+
+    for (int c = 0; c < downmix->in_channels; c++) {
+        left_coefficients[c] = _mm256_set1_ps(downmix->matrix[0][c]);
+        right_coefficients[c] = _mm256_set1_ps(downmix->matrix[1][c]);
+    }
+
+    __m256i state = _mm256_loadu_si256((const __m256i *) downmix->dither_state);
+    const __m256 scale = _mm256_set1_ps(DOWNMIX_S16_SCALE);
+    for (; i + 8 <= nb_samples; i += 8) {
+        __m256 left = _mm256_setzero_ps();
+        __m256 right = _mm256_setzero_ps();
+        for (int c = 0; c < downmix->in_channels; c++) {
+            __m256 samples = _mm256_loadu_ps(in[c] + i);
+            left = _mm256_add_ps(left, _mm256_mul_ps(samples, left_coefficients[c]));
+            right = _mm256_add_ps(right, _mm256_mul_ps(samples, right_coefficients[c]));
+        }
+        // Frames 0 1 4 5 and 2 3 6 7, swapped into 0-3 and 4-7
+        __m256 low = _mm256_unpacklo_ps(left, right);
+        __m256 high = _mm256_unpackhi_ps(left, right);
+        __m256 first = _mm256_permute2f128_ps(low, high, 0x20);
+        __m256 second = _mm256_permute2f128_ps(low, high, 0x31);
+
+        if (downmix->out_format == AV_SAMPLE_FMT_FLT) {
+            float *dst = (float *) out + 2 * i;
+            _mm256_storeu_ps(dst, first);
+            _mm256_storeu_ps(dst + 8, second);
+        } else {
+            first = _mm256_add_ps(_mm256_mul_ps(first, scale), tpdf_avx2(&state));
+            second = _mm256_add_ps(_mm256_mul_ps(second, scale), tpdf_avx2(&state));
+            __m256i packed = _mm256_packs_epi32(_mm256_cvtps_epi32(first), _mm256_cvtps_epi32(second));
+            packed = _mm256_permute4x64_epi64(packed, 0xD8);
+            _mm256_storeu_si256((__m256i *) ((int16_t *) out + 2 * i), packed);
+        }
+    }
+    _mm256_storeu_si256((__m256i *) downmix->dither_state, state);
+
+    mix_scalar_range(downmix, in, i, nb_samples, out);
+}
+#endif
+
+typedef struct DownmixKernelEntry {
+    const char *name;
+    DownmixKernel kernel;
+    int out_channels; // 0 for any
+    SDL_bool (*supported)(void); // NULL for always
+} DownmixKernelEntry;
+
+// Slowest first, downmix_init() takes the last one the CPU and the channel count allow
+static const DownmixKernelEntry kernels[] = {
+    {"scalar", mix_scalar, 0, NULL},
+#if DOWNMIX_X86
+    {"sse2", mix_stereo_sse2, 2, SDL_HasSSE2},
+    {"avx2", mix_stereo_avx2, 2, SDL_HasAVX2},
+#endif
+};
+
+static int kernel_usable(const DownmixKernelEntry *entry, int out_channels) {
+    return (entry->out_channels == 0 || entry->out_channels == out_channels) &&
+           (!entry->supported || entry->supported());
+}
+
+void downmix_options_default(DownmixOptions *options) {
+    memset(options, 0, sizeof(DownmixOptions));
+    options->preset = DOWNMIX_ITU;
+    options->gain = 1.0;
+}
+
+int downmix_parse_matrix(DownmixOptions *options, const char *text) {
+    int count = 0;
+
+    while (*text) {
+        char *end;
+        double coefficient = strtod(text, &end);
+        if (end == text || count == DOWNMIX_MAX_OUT_CHANNELS * DOWNMIX_MAX_IN_CHANNELS) {
+            return -1;
+        }
+        options->coefficients[count++] = (float) coefficient;
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+        text = end;
+    }
+    if (count == 0) {
+        return -1;
+    }
+    options->coefficient_count = count;
+    options->preset = DOWNMIX_CUSTOM;
+    return 0;
+}
+
+/** Left and right rows for a preset. Channels with no place in a stereo image (LFE, height) are dropped, like
+ * swresample does by default. The rows are scaled down together so full scale on every input can't clip. **/
+static void preset_matrix(Downmix *downmix, const AVChannelLayout *in, DownmixPreset preset) {
+    double center = preset == DOWNMIX_DIALOG ? DOWNMIX_DIALOG_CENTER_LEVEL : DOWNMIX_CENTER_LEVEL;
+    double surround = preset == DOWNMIX_DIALOG ? DOWNMIX_DIALOG_SURROUND_LEVEL : DOWNMIX_SURROUND_LEVEL;
+    double stereo[2][DOWNMIX_MAX_IN_CHANNELS] = {{0}};
+
+    for (int c = 0; c < downmix->in_channels; c++) {
+        switch (av_channel_layout_channel_from_index(in, c)) {
+            case AV_CHAN_FRONT_LEFT:
+            case AV_CHAN_FRONT_LEFT_OF_CENTER:
+                stereo[0][c] = 1.0;
+                break;
+            case AV_CHAN_FRONT_RIGHT:
+            case AV_CHAN_FRONT_RIGHT_OF_CENTER:
+                stereo[1][c] = 1.0;
+                break;
+            case AV_CHAN_FRONT_CENTER:
+                stereo[0][c] = center;
+                stereo[1][c] = center;
+                break;
+            case AV_CHAN_BACK_LEFT:
+            case AV_CHAN_SIDE_LEFT:
+                stereo[0][c] = surround;
+                break;
+            case AV_CHAN_BACK_RIGHT:
+            case AV_CHAN_SIDE_RIGHT:
+                stereo[1][c] = surround;
+                break;
+            case AV_CHAN_BACK_CENTER:
+                stereo[0][c] = surround * M_SQRT1_2;
+                stereo[1][c] = surround * M_SQRT1_2;
+                break;
+            default:
+                break;
+        }
+    }
+
+    double max_sum = 0.0;
+    for (int o = 0; o < downmix->out_channels; o++) {
+        double sum = 0.0;
+        for (int c = 0; c < downmix->in_channels; c++) {
+            // Mono is the average of left and right
+            double coefficient = downmix->out_channels == 1 ? (stereo[0][c] + stereo[1][c]) * 0.5 : stereo[o][c];
+            downmix->matrix[o][c] = (float) coefficient;
+            sum += coefficient;
+        }
+        max_sum = FFMAX(max_sum, sum);
+    }
+    if (max_sum > 1.0) {
+        for (int o = 0; o < downmix->out_channels; o++) {
+            for (int c = 0; c < downmix->in_channels; c++) {
+                downmix->matrix[o][c] = (float) (downmix->matrix[o][c] / max_sum);
+            }
+        }
+    }
+}
+
+int downmix_init(Downmix *downmix, const AVChannelLayout *in, int out_channels, enum AVSampleFormat out_format,
+                 const DownmixOptions *options) {
+    if (in->nb_channels > DOWNMIX_MAX_IN_CHANNELS || out_channels < 1 || out_channels > DOWNMIX_MAX_OUT_CHANNELS ||
+        (out_format != AV_SAMPLE_FMT_FLT && out_format != AV_SAMPLE_FMT_S16)) {
+        return -1;
+    }
+    if (options->preset != DOWNMIX_CUSTOM && in->order == AV_CHANNEL_ORDER_UNSPEC) {
+        // No idea which channel is which, the presets can't place them
+        return -1;
+    }
+
+    memset(downmix, 0, sizeof(Downmix));
+    downmix->in_channels = in->nb_channels;
+    downmix->out_channels = out_channels;
+    downmix->out_format = out_format;
+    if (options->preset == DOWNMIX_CUSTOM) {
+        if (options->coefficient_count != out_channels * in->nb_channels) {
+            log_error("Downmix matrix has %d coefficients, %d channels to %d needs %d", options->coefficient_count,
+                      in->nb_channels, out_channels, out_channels * in->nb_channels);
+            return -1;
+        }
+        for (int o = 0; o < out_channels; o++) {
+            for (int c = 0; c < in->nb_channels; c++) {
+                downmix->matrix[o][c] = options->coefficients[o * in->nb_channels + c];
+            }
+        }
+    } else {
+        preset_matrix(downmix, in, options->preset);
+    }
+    for (int o = 0; o < out_channels; o++) {
+        for (int c = 0; c < in->nb_channels; c++) {
+            downmix->matrix[o][c] *= (float) options->gain;
+        }
+    }
+
+    for (int i = 0; i < 8; i++) {
+        // Any odd, distinct seeds will do, xorshift only must never start at zero
+        downmix->dither_state[i] = 0x9E3779B9u * (uint32_t) (2 * i + 1);
+    }
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+        if (kernel_usable(&kernels[i], out_channels)) {
+            downmix->kernel = kernels[i].kernel;
+            downmix->kernel_name = kernels[i].name;
+        }
+    }
+    return 0;
+}
+
+int downmix_benchmark(void) {
+    static const struct {
+        const char *name;
+        int channels;
+    } inputs[] = {{"5.1", 6}, {"7.1", 8}};
+    static const enum AVSampleFormat formats[] = {AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_S16};
+    float *planes[DOWNMIX_MAX_IN_CHANNELS] = {0};
+    float *reference = av_malloc(DOWNMIX_BENCH_SAMPLES * DOWNMIX_MAX_OUT_CHANNELS * sizeof(float));
+    float *result = av_malloc(DOWNMIX_BENCH_SAMPLES * DOWNMIX_MAX_OUT_CHANNELS * sizeof(float));
+    uint32_t seed = 1;
+    int ret = 0;
+
+    if (!reference || !result) {
+        ret = -1;
+        goto cleanup;
+    }
+    for (int c = 0; c < DOWNMIX_MAX_IN_CHANNELS; c++) {
+        planes[c] = av_malloc(DOWNMIX_BENCH_SAMPLES * sizeof(float));
+        if (!planes[c]) {
+            ret = -1;
+            goto cleanup;
+        }
+        for (int i = 0; i < DOWNMIX_BENCH_SAMPLES; i++) {
+            planes[c][i] = uniform(&seed) - 0.5f;
+        }
+    }
+
+    for (size_t input = 0; input < sizeof(inputs) / sizeof(inputs[0]); input++) {
+        for (size_t format = 0; format < sizeof(formats) / sizeof(formats[0]); format++) {
+            AVChannelLayout layout;
+            DownmixOptions options;
+            av_channel_layout_default(&layout, inputs[input].channels);
+            downmix_options_default(&options);
+
+            for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+                Downmix downmix;
+                if (!kernel_usable(&kernels[k], 2) ||
+                    downmix_init(&downmix, &layout, 2, formats[format], &options) < 0) {
+                    continue;
+                }
+                downmix.kernel = kernels[k].kernel;
+                downmix.kernel_name = kernels[k].name;
+
+                int64_t begin = av_gettime_relative();
+                for (int iteration = 0; iteration < DOWNMIX_BENCH_ITERATIONS; iteration++) {
+                    downmix_run(&downmix, (const float *const *) planes, DOWNMIX_BENCH_SAMPLES, result);
+                }
+                double seconds = (av_gettime_relative() - begin) / 1000000.0;
+                double samples = (double) DOWNMIX_BENCH_SAMPLES * DOWNMIX_BENCH_ITERATIONS;
+
+                // Dither differs between kernels by design, S16 may be off by its two LSB of range plus rounding
+                double max_diff = 0.0;
+                if (k == 0) {
+                    memcpy(reference, result, DOWNMIX_BENCH_SAMPLES * 2 * av_get_bytes_per_sample(formats[format]));
+                } else {
+                    for (int i = 0; i < DOWNMIX_BENCH_SAMPLES * 2; i++) {
+                        double diff = formats[format] == AV_SAMPLE_FMT_FLT
+                                          ? fabs(reference[i] - result[i]) * DOWNMIX_S16_SCALE
+                                          : abs(((int16_t *) reference)[i] - ((int16_t *) result)[i]);
+                        max_diff = FFMAX(max_diff, diff);
+                    }
+                }
+                int mismatch = max_diff > 3.0;
+                printf("%s -> stereo %-4s %-6s %7.2f ns/frame %9.0fx real time at 48 kHz, max diff %.2f LSB%s\n",
+                       inputs[input].name, av_get_sample_fmt_name(formats[format]), kernels[k].name,
+                       seconds * 1e9 / samples, samples / seconds / 48000.0, max_diff, mismatch ? " MISMATCH" : "");
+                if (mismatch) {
+                    ret = -1;
+                }
+            }
+        }
+    }
+
+cleanup:
+    for (int c = 0; c < DOWNMIX_MAX_IN_CHANNELS; c++) {
+        av_free(planes[c]);
+    }
+    av_free(reference);
+    av_free(result);
+    return ret;
+}
@@ -0,0 +1,65 @@
+//
+// Created by Deshy on 2025/06/22.
+//
+
+#ifndef DOWNMIX_H
+#define DOWNMIX_H
+
+#include <stdint.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/samplefmt.h>
+
+#define DOWNMIX_MAX_IN_CHANNELS 8 // 7.1
+#define DOWNMIX_MAX_OUT_CHANNELS 2
+#define DOWNMIX_CENTER_LEVEL 0.7071 // -3 dB, ITU-R BS.775
+#define DOWNMIX_SURROUND_LEVEL 0.7071
+#define DOWNMIX_DIALOG_CENTER_LEVEL 1.0
+#define DOWNMIX_DIALOG_SURROUND_LEVEL 0.5 // -6 dB
+
+typedef enum DownmixPreset {
+    DOWNMIX_ITU, // centre and surrounds at -3 dB, LFE dropped
+    DOWNMIX_DIALOG, // centre at full level and surrounds at -6 dB, for movie mixes with quiet dialog
+    DOWNMIX_CUSTOM, // coefficients from the command line
+} DownmixPreset;
+
+typedef struct DownmixOptions {
+    DownmixPreset preset;
+    double gain; // linear, applied on top of the matrix
+    float coefficients[DOWNMIX_MAX_OUT_CHANNELS * DOWNMIX_MAX_IN_CHANNELS]; // DOWNMIX_CUSTOM, one output row after another
+    int coefficient_count;
+} DownmixOptions;
+
+typedef struct Downmix Downmix;
+
+typedef void (*DownmixKernel)(Downmix *downmix, const float *const *in, int nb_samples, void *out);
+
+/** Mixes planar float samples down to one or two interleaved output channels in a single pass: matrix and gain in one
+ * multiply-add per input channel, then for S16 output TPDF dither and rounding. Stereo output has SSE2 and AVX2
+ * kernels picked at runtime, everything else runs the scalar one. **/
+struct Downmix {
+    int in_channels;
+    int out_channels;
+    float matrix[DOWNMIX_MAX_OUT_CHANNELS][DOWNMIX_MAX_IN_CHANNELS]; // out x in, gain included
+    enum AVSampleFormat out_format; // AV_SAMPLE_FMT_FLT or AV_SAMPLE_FMT_S16
+    uint32_t dither_state[8]; // xorshift32, one per SIMD lane
+    DownmixKernel kernel;
+    const char *kernel_name;
+};
+
+void downmix_options_default(DownmixOptions *options);
+
+// Parses a comma separated list of coefficients into options as a DOWNMIX_CUSTOM matrix. Returns -1 on bad input.
+int downmix_parse_matrix(DownmixOptions *options, const char *text);
+
+/** Sets up a mix from in to out_channels interleaved samples of out_format. Returns -1 when the kernels don't cover the
+ * combination, swr has to do the mixing then. **/
+int downmix_init(Downmix *downmix, const AVChannelLayout *in, int out_channels, enum AVSampleFormat out_format,
+                 const DownmixOptions *options);
+
+static inline void downmix_run(Downmix *downmix, const float *const *in, int nb_samples, void *out) {
+    downmix->kernel(downmix, in, nb_samples, out);
+}
+
+// Times every kernel this CPU runs on 5.1 and 7.1 input and checks them against the scalar one. Returns -1 on mismatch.
+int downmix_benchmark(void);
+#endif //DOWNMIX_H
@@ -17,10 +17,19 @@
 
 #include "microlog.h"
 
-#if FEATURE_TOPICS
+#if FEATURE_TOPICS || FEATURE_ASYNC
 #include <string.h>
 #endif
 
+#if FEATURE_ASYNC
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#endif
+
 #define ULOG_NEW_LINE_ON true
 #define ULOG_NEW_LINE_OFF false
 #define ULOG_COLOR_ON true
@@ -89,6 +98,7 @@ static void print_level(ulog_Event *ev, FILE *file);
 static void print_message(ulog_Event *ev, FILE *file);
 static void process_callback(ulog_Event *ev, Callback *cb);
 static void write_formatted_message(ulog_Event *ev, FILE *file, bool full_time, bool color, bool new_line);
+static void dispatch_event(ulog_Event *ev);
 
 /* ============================================================================
    Feature: Color
@@ -468,6 +478,487 @@ void ulog_set_lock(ulog_LockFn function, void *lock_arg) {
 }
 
 
+/* ============================================================================
+   Feature: Async
+============================================================================ */
+#if FEATURE_ASYNC
+
+#define ASYNC_MAX_ARGS 12      // conversions (and '*' widths) kept per record
+#define ASYNC_STRING_BYTES 160 // room for copied %s arguments per record
+#define ASYNC_MESSAGE_SIZE 512 // formatted message, without the prefix
+#define ASYNC_POLL_NS 2000000  // formatter sleep when every ring is empty
+
+enum {
+    ARG_INT,
+    ARG_UINT,
+    ARG_LONG,
+    ARG_ULONG,
+    ARG_LLONG,
+    ARG_ULLONG,
+    ARG_SIZE,
+    ARG_PTRDIFF,
+    ARG_INTMAX,
+    ARG_UINTMAX,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+    ARG_UNSUPPORTED
+};
+
+enum { LEN_NONE, LEN_CHAR, LEN_SHORT, LEN_LONG, LEN_LLONG, LEN_SIZE, LEN_PTRDIFF, LEN_INTMAX, LEN_LDOUBLE };
+
+/// @brief One captured printf argument
+typedef struct {
+    unsigned char kind;
+    union {
+        long long i;
+        unsigned long long u;
+        double d;
+        const void *p;
+        unsigned short offset;  // into async_Record.strings
+    } value;
+} async_Arg;
+
+/// @brief Fixed-size binary log record, formatted later by the formatter
+///        thread. message and file are only pointers, so they have to be
+///        string literals.
+typedef struct {
+    unsigned long long seq;  // global order across threads
+    const char *message;
+    const char *file;
+    int line;
+    int level;
+    int topic;
+    unsigned char nargs;
+    bool truncated;  // ran out of argument slots, the rest of the format is printed as is
+    async_Arg args[ASYNC_MAX_ARGS];
+    char strings[ASYNC_STRING_BYTES];
+} async_Record;
+
+/// @brief Single-producer (the owning thread) single-consumer (the
+///        formatter) ring, one per logging thread
+typedef struct async_Ring {
+    async_Record records[ULOG_ASYNC_RING_SIZE];
+    atomic_size_t head;  // owned by the formatter
+    atomic_size_t tail;  // owned by the logging thread
+    struct async_Ring *next;
+} async_Ring;
+
+/// @brief Parsed printf conversion specification
+typedef struct {
+    int stars;  // '*' width/precision, each one takes an int argument
+    int length;
+    char conversion;
+} async_Spec;
+
+static atomic_bool async_running                = false;
+static atomic_ullong async_seq                  = 0;
+static atomic_ullong async_dropped_count        = 0;
+static _Atomic(async_Ring *) async_rings        = NULL;  // every ring ever created, never freed
+static _Thread_local async_Ring *async_local_ring = NULL;
+static pthread_t async_thread;
+
+/// @brief Parses the conversion after a '%'
+/// @param p - First character after the '%'
+/// @param spec - Parsed specification
+/// @return Pointer just past the conversion character
+static const char *async_parse_spec(const char *p, async_Spec *spec) {
+    spec->stars  = 0;
+    spec->length = LEN_NONE;
+
+    while (*p && strchr("-+ #0'", *p)) {
+        p++;
+    }
+    if (*p == '*') {
+        spec->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars++;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    if (p[0] == 'h' && p[1] == 'h') {
+        spec->length = LEN_CHAR;
+        p += 2;
+    } else if (p[0] == 'l' && p[1] == 'l') {
+        spec->length = LEN_LLONG;
+        p += 2;
+    } else if (*p == 'h') {
+        spec->length = LEN_SHORT;
+        p++;
+    } else if (*p == 'l') {
+        spec->length = LEN_LONG;
+        p++;
+    } else if (*p == 'q') {
+        spec->length = LEN_LLONG;
+        p++;
+    } else if (*p == 'z') {
+        spec->length = LEN_SIZE;
+        p++;
+    } else if (*p == 't') {
+        spec->length = LEN_PTRDIFF;
+        p++;
+    } else if (*p == 'j') {
+        spec->length = LEN_INTMAX;
+        p++;
+    } else if (*p == 'L') {
+        spec->length = LEN_LDOUBLE;
+        p++;
+    }
+
+    spec->conversion = *p;
+    return *p ? p + 1 : p;
+}
+
+/// @brief Which va_arg type a conversion consumes
+static int async_arg_kind(const async_Spec *spec) {
+    switch (spec->conversion) {
+        case 'd':
+        case 'i':
+            switch (spec->length) {
+                case LEN_LONG: return ARG_LONG;
+                case LEN_LLONG: return ARG_LLONG;
+                case LEN_SIZE: return ARG_SIZE;
+                case LEN_PTRDIFF: return ARG_PTRDIFF;
+                case LEN_INTMAX: return ARG_INTMAX;
+                default: return ARG_INT;  // char and short are promoted
+            }
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            switch (spec->length) {
+                case LEN_LONG: return ARG_ULONG;
+                case LEN_LLONG: return ARG_ULLONG;
+                case LEN_SIZE: return ARG_SIZE;
+                case LEN_PTRDIFF: return ARG_PTRDIFF;
+                case LEN_INTMAX: return ARG_UINTMAX;
+                default: return ARG_UINT;
+            }
+        case 'c':
+            return spec->length == LEN_NONE ? ARG_INT : ARG_UNSUPPORTED;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            return ARG_DOUBLE;  // long double is narrowed, the 'L' dropped when formatting
+        case 's':
+            return spec->length == LEN_NONE ? ARG_STRING : ARG_UNSUPPORTED;
+        case 'p':
+            return ARG_POINTER;
+        default:
+            return ARG_UNSUPPORTED;  // %n, wide characters, garbage
+    }
+}
+
+/// @brief Copies the arguments the format string asks for into the record
+static void async_capture(async_Record *r, const char *message, va_list args) {
+    size_t string_used = 0;
+
+    r->nargs     = 0;
+    r->truncated = false;
+
+    for (const char *p = message; *p;) {
+        if (*p++ != '%') {
+            continue;
+        }
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+
+        async_Spec spec;
+        p        = async_parse_spec(p, &spec);
+        int kind = async_arg_kind(&spec);
+        if (kind == ARG_UNSUPPORTED || r->nargs + spec.stars + 1 > ASYNC_MAX_ARGS) {
+            // Can't tell what is left on the va_list, stop here
+            r->truncated = true;
+            return;
+        }
+
+        for (int i = 0; i < spec.stars; i++) {
+            r->args[r->nargs].kind      = ARG_INT;
+            r->args[r->nargs++].value.i = va_arg(args, int);
+        }
+
+        async_Arg *a = &r->args[r->nargs++];
+        a->kind      = (unsigned char) kind;
+        switch (kind) {
+            case ARG_INT: a->value.i = va_arg(args, int); break;
+            case ARG_UINT: a->value.u = va_arg(args, unsigned int); break;
+            case ARG_LONG: a->value.i = va_arg(args, long); break;
+            case ARG_ULONG: a->value.u = va_arg(args, unsigned long); break;
+            case ARG_LLONG: a->value.i = va_arg(args, long long); break;
+            case ARG_ULLONG: a->value.u = va_arg(args, unsigned long long); break;
+            case ARG_SIZE: a->value.u = va_arg(args, size_t); break;
+            case ARG_PTRDIFF: a->value.i = va_arg(args, ptrdiff_t); break;
+            case ARG_INTMAX: a->value.i = va_arg(args, intmax_t); break;
+            case ARG_UINTMAX: a->value.u = va_arg(args, uintmax_t); break;
+            case ARG_DOUBLE:
+                a->value.d = spec.length == LEN_LDOUBLE ? (double) va_arg(args, long double) : va_arg(args, double);
+                break;
+            case ARG_POINTER: a->value.p = va_arg(args, void *); break;
+            case ARG_STRING: {
+                // Strings may not outlive the call, so they are copied (and cut short when out of room)
+                const char *s = va_arg(args, const char *);
+                if (!s) {
+                    s = "(null)";
+                }
+                size_t room = ASYNC_STRING_BYTES - string_used;
+                size_t len  = strlen(s);
+                if (room == 0) {
+                    a->value.offset = ASYNC_STRING_BYTES - 1;  // points at the last terminator
+                    break;
+                }
+                if (len > room - 1) {
+                    len = room - 1;
+                }
+                memcpy(r->strings + string_used, s, len);
+                r->strings[string_used + len] = '\0';
+                a->value.offset               = (unsigned short) string_used;
+                string_used += len + 1;
+                break;
+            }
+            default: break;
+        }
+    }
+}
+
+/// @brief Gets the calling thread's ring, creating it on the thread's
+///        first log call
+static async_Ring *async_thread_ring(void) {
+    if (async_local_ring) {
+        return async_local_ring;
+    }
+
+    async_Ring *ring = calloc(1, sizeof(async_Ring));
+    if (!ring) {
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    ring->next = atomic_load(&async_rings);
+    while (!atomic_compare_exchange_weak(&async_rings, &ring->next, ring)) {
+    }
+    async_local_ring = ring;
+    return ring;
+}
+
+/// @brief Queues a record on the calling thread's ring. Never blocks,
+///        a full ring drops the record.
+/// @return false if the thread has no ring and the caller has to log
+///         synchronously
+static bool async_enqueue(int level, const char *file, int line, int topic, const char *message, va_list args) {
+    async_Ring *ring = async_thread_ring();
+    if (!ring) {
+        return false;
+    }
+
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == ULOG_ASYNC_RING_SIZE) {
+        atomic_fetch_add_explicit(&async_dropped_count, 1, memory_order_relaxed);
+        return true;
+    }
+
+    async_Record *r = &ring->records[tail % ULOG_ASYNC_RING_SIZE];
+    r->seq          = atomic_fetch_add_explicit(&async_seq, 1, memory_order_relaxed);
+    r->message      = message;
+    r->file         = file;
+    r->line         = line;
+    r->level        = level;
+    r->topic        = topic;
+    async_capture(r, message, args);
+
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+/// @brief Rebuilds the message of a record, one conversion at a time
+static void async_format(const async_Record *r, char *out, size_t size) {
+    size_t pos = 0;
+    int arg    = 0;
+    const char *p = r->message;
+
+    while (*p && pos < size - 1) {
+        if (*p != '%') {
+            out[pos++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[pos++] = '%';
+            p += 2;
+            continue;
+        }
+
+        async_Spec spec;
+        const char *end = async_parse_spec(p + 1, &spec);
+        if (arg + spec.stars >= r->nargs) {
+            // Arguments past this point were not captured
+            int n = snprintf(out + pos, size - pos, "%s", p);
+            pos += n > 0 ? (size_t) n : 0;
+            break;
+        }
+
+        // Single conversion with '*' replaced by the captured value and no 'L'
+        char fmt[64];
+        size_t f = 0;
+        for (const char *c = p; c < end && f < sizeof(fmt) - 16; c++) {
+            if (*c == '*') {
+                f += (size_t) snprintf(fmt + f, sizeof(fmt) - f, "%d", (int) r->args[arg++].value.i);
+            } else if (*c != 'L') {
+                fmt[f++] = *c;
+            }
+        }
+        fmt[f] = '\0';
+
+        const async_Arg *a = &r->args[arg++];
+        char *dst          = out + pos;
+        size_t room        = size - pos;
+        int n              = 0;
+        switch (a->kind) {
+            case ARG_INT: n = snprintf(dst, room, fmt, (int) a->value.i); break;
+            case ARG_UINT: n = snprintf(dst, room, fmt, (unsigned int) a->value.u); break;
+            case ARG_LONG: n = snprintf(dst, room, fmt, (long) a->value.i); break;
+            case ARG_ULONG: n = snprintf(dst, room, fmt, (unsigned long) a->value.u); break;
+            case ARG_LLONG: n = snprintf(dst, room, fmt, a->value.i); break;
+            case ARG_ULLONG: n = snprintf(dst, room, fmt, a->value.u); break;
+            case ARG_SIZE: n = snprintf(dst, room, fmt, (size_t) a->value.u); break;
+            case ARG_PTRDIFF: n = snprintf(dst, room, fmt, (ptrdiff_t) a->value.i); break;
+            case ARG_INTMAX: n = snprintf(dst, room, fmt, (intmax_t) a->value.i); break;
+            case ARG_UINTMAX: n = snprintf(dst, room, fmt, (uintmax_t) a->value.u); break;
+            case ARG_DOUBLE: n = snprintf(dst, room, fmt, a->value.d); break;
+            case ARG_POINTER: n = snprintf(dst, room, fmt, a->value.p); break;
+            case ARG_STRING: n = snprintf(dst, room, fmt, r->strings + a->value.offset); break;
+            default: break;
+        }
+        if (n > 0) {
+            pos += (size_t) n < room ? (size_t) n : room - 1;
+        }
+        p = end;
+    }
+    out[pos] = '\0';
+}
+
+/// @brief Builds an event for an already formatted message and sends it out
+static void async_emit(const async_Record *r, const char *message, ...) {
+    ulog_Event ev = {
+            .message = message,
+            .file    = r->file,
+            .line    = r->line,
+            .level   = r->level,
+#if FEATURE_TOPICS
+            .topic = r->topic,
+#endif
+    };
+
+    va_start(ev.message_format_args, message);
+    dispatch_event(&ev);
+    va_end(ev.message_format_args);
+}
+
+/// @brief Formats the oldest queued record across all rings
+/// @return false if every ring was empty
+static bool async_drain_one(void) {
+    async_Ring *oldest = NULL;
+    unsigned long long oldest_seq = 0;
+
+    for (async_Ring *ring = atomic_load(&async_rings); ring; ring = ring->next) {
+        size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == tail) {
+            continue;
+        }
+        unsigned long long seq = ring->records[head % ULOG_ASYNC_RING_SIZE].seq;
+        if (!oldest || seq < oldest_seq) {
+            oldest     = ring;
+            oldest_seq = seq;
+        }
+    }
+    if (!oldest) {
+        return false;
+    }
+
+    size_t head           = atomic_load_explicit(&oldest->head, memory_order_relaxed);
+    const async_Record *r = &oldest->records[head % ULOG_ASYNC_RING_SIZE];
+    char message[ASYNC_MESSAGE_SIZE];
+    async_format(r, message, sizeof(message));
+    async_emit(r, "%s", message);
+
+    atomic_store_explicit(&oldest->head, head + 1, memory_order_release);
+    return true;
+}
+
+/// @brief Formatter thread, the only place that prints while async
+static void *async_formatter(void *arg) {
+    (void) arg;
+    unsigned long long reported_dropped = 0;
+    struct timespec poll = {0, ASYNC_POLL_NS};
+
+    while (true) {
+        // Read before draining, so the last pass covers everything queued before the stop
+        bool running = atomic_load(&async_running);
+        bool drained = false;
+        while (async_drain_one()) {
+            drained = true;
+        }
+
+        unsigned long long dropped = atomic_load_explicit(&async_dropped_count, memory_order_relaxed);
+        if (dropped != reported_dropped) {
+            fprintf(stdout, "ulog: %llu records dropped, a thread's ring was full\n", dropped - reported_dropped);
+            reported_dropped = dropped;
+        }
+
+        if (!running) {
+            break;
+        }
+        if (!drained) {
+            nanosleep(&poll, NULL);
+        }
+    }
+    return NULL;
+}
+
+int ulog_async_start(void) {
+    if (atomic_load(&async_running)) {
+        return 0;
+    }
+    atomic_store(&async_running, true);
+    if (pthread_create(&async_thread, NULL, async_formatter, NULL) != 0) {
+        atomic_store(&async_running, false);
+        return -1;
+    }
+    return 0;
+}
+
+void ulog_async_stop(void) {
+    if (!atomic_exchange(&async_running, false)) {
+        return;
+    }
+    pthread_join(async_thread, NULL);
+}
+
+unsigned long long ulog_async_dropped(void) {
+    return atomic_load(&async_dropped_count);
+}
+
+#endif  // FEATURE_ASYNC
+
 /* ============================================================================
    Core Functionality
 ============================================================================ */
@@ -606,6 +1097,22 @@ void ulog_log(int level, const char *file, int line, const char *topic, const ch
     }
 #endif
 
+#if FEATURE_ASYNC
+    if (atomic_load_explicit(&async_running, memory_order_acquire)) {
+        va_list args;
+        va_start(args, message);
+#if FEATURE_TOPICS
+        bool queued = async_enqueue(level, file, line, topic_id, message, args);
+#else
+        bool queued = async_enqueue(level, file, line, -1, message, args);
+#endif
+        va_end(args);
+        if (queued) {
+            return;
+        }
+    }
+#endif  // FEATURE_ASYNC
+
     ulog_Event ev = {
             .message = message,
             .file    = file,
@@ -618,17 +1125,23 @@ void ulog_log(int level, const char *file, int line, const char *topic, const ch
 
     va_start(ev.message_format_args, message);
 
+    dispatch_event(&ev);
+
+    va_end(ev.message_format_args);
+}
+
+/// @brief Sends the event to every output
+/// @param ev - Event
+static void dispatch_event(ulog_Event *ev) {
     lock();
 
-    log_to_stdout(&ev);
+    log_to_stdout(ev);
 
 #if FEATURE_EXTRA_OUTPUTS
-    log_to_extra_outputs(&ev);
+    log_to_extra_outputs(ev);
 #endif
 
     unlock();
-
-    va_end(ev.message_format_args);
 }
 
 static void print_level(ulog_Event *ev, FILE *file) {
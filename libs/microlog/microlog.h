@@ -40,6 +40,17 @@ extern "C" {
 | FEATURE_EMOJI_LEVELS  | OFF             | ULOG_USE_EMOJI                    |
 | FEATURE_EXTRA_OUTPUTS | OFF             | ULOG_EXTRA_OUTPUTS                |
 | FEATURE_TOPICS        | OFF             | ULOG_TOPICS_NUM                   |
+| FEATURE_MIN_LEVEL     | 0 (TRACE)       | ULOG_MIN_LEVEL                    |
+| FEATURE_ASYNC         | OFF             | ULOG_ASYNC                        |
+
+ULOG_MIN_LEVEL (0 = TRACE ... 5 = FATAL) removes every log call below that
+level at compile time, arguments included.
+
+ULOG_ASYNC adds ulog_async_start()/ulog_async_stop(). While started, log
+calls only copy a fixed-size binary record (format pointer + arguments) into
+a per-thread lock-free ring; a background thread formats and prints them.
+Format strings and file names must be string literals in that mode.
+ULOG_ASYNC_RING_SIZE sets the records per thread (default 512).
 
 ============================================================================ */
 
@@ -104,6 +115,21 @@ extern "C" {
 
 #endif  // ULOG_USE_EMOJI
 
+#ifndef ULOG_MIN_LEVEL
+#define ULOG_MIN_LEVEL 0
+#endif
+
+
+#ifdef ULOG_ASYNC
+#define FEATURE_ASYNC true
+#ifndef ULOG_ASYNC_RING_SIZE
+#define ULOG_ASYNC_RING_SIZE 512
+#endif
+#else
+#define FEATURE_ASYNC false
+#endif
+
+
 #if ULOG_TOPICS_NUM > 0
 #define FEATURE_TOPICS true
 #define CFG_TOPICS_DINAMIC_ALLOC false
@@ -135,12 +161,58 @@ enum { LOG_TRACE,
        LOG_ERROR,
        LOG_FATAL };
 
+// Compiled out calls keep their arguments type checked and "used", but never
+// evaluate them
+#define ULOG_DISCARD(...)                \
+    do {                                 \
+        if (0) {                         \
+            ulog_log(__VA_ARGS__);       \
+        }                                \
+    } while (0)
+
+#if ULOG_MIN_LEVEL <= 0
 #define log_trace(...) ulog_log(LOG_TRACE, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_trace(TOPIC_NAME, ...) ulog_log(LOG_TRACE, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#else
+#define log_trace(...) ULOG_DISCARD(LOG_TRACE, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_trace(TOPIC_NAME, ...) ULOG_DISCARD(LOG_TRACE, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#endif
+
+#if ULOG_MIN_LEVEL <= 1
 #define log_debug(...) ulog_log(LOG_DEBUG, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_debug(TOPIC_NAME, ...) ulog_log(LOG_DEBUG, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#else
+#define log_debug(...) ULOG_DISCARD(LOG_DEBUG, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_debug(TOPIC_NAME, ...) ULOG_DISCARD(LOG_DEBUG, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#endif
+
+#if ULOG_MIN_LEVEL <= 2
 #define log_info(...) ulog_log(LOG_INFO, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_info(TOPIC_NAME, ...) ulog_log(LOG_INFO, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#else
+#define log_info(...) ULOG_DISCARD(LOG_INFO, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_info(TOPIC_NAME, ...) ULOG_DISCARD(LOG_INFO, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#endif
+
+#if ULOG_MIN_LEVEL <= 3
 #define log_warn(...) ulog_log(LOG_WARN, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_warn(TOPIC_NAME, ...) ulog_log(LOG_WARN, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#else
+#define log_warn(...) ULOG_DISCARD(LOG_WARN, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_warn(TOPIC_NAME, ...) ULOG_DISCARD(LOG_WARN, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#endif
+
+#if ULOG_MIN_LEVEL <= 4
 #define log_error(...) ulog_log(LOG_ERROR, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_error(TOPIC_NAME, ...) ulog_log(LOG_ERROR, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#else
+#define log_error(...) ULOG_DISCARD(LOG_ERROR, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_error(TOPIC_NAME, ...) ULOG_DISCARD(LOG_ERROR, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
+#endif
+
+// FATAL is never compiled out
 #define log_fatal(...) ulog_log(LOG_FATAL, __FILE__, __LINE__, NULL, __VA_ARGS__)
+#define logt_fatal(TOPIC_NAME, ...) ulog_log(LOG_FATAL, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
 
 
 /// @brief Event structure
@@ -249,12 +321,6 @@ int ulog_add_fp(FILE *fp, int level);
 ============================================================================ */
 
 #define TOPIC_NOT_FOUND 0x7FFFFFFF
-#define logt_trace(TOPIC_NAME, ...) ulog_log(LOG_TRACE, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
-#define logt_debug(TOPIC_NAME, ...) ulog_log(LOG_DEBUG, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
-#define logt_info(TOPIC_NAME, ...) ulog_log(LOG_INFO, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
-#define logt_warn(TOPIC_NAME, ...) ulog_log(LOG_WARN, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
-#define logt_error(TOPIC_NAME, ...) ulog_log(LOG_ERROR, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
-#define logt_fatal(TOPIC_NAME, ...) ulog_log(LOG_FATAL, __FILE__, __LINE__, TOPIC_NAME, __VA_ARGS__)
 
 #if FEATURE_TOPICS
 
@@ -296,6 +362,31 @@ int ulog_disable_all_topics(void);
 
 #endif  // FEATURE_TOPICS
 
+/* ============================================================================
+   Feature: Async
+============================================================================ */
+#if FEATURE_ASYNC
+
+/// @brief Starts the background formatter thread. From here on log calls
+///        only queue binary records and never touch stdio or the lock.
+/// @return 0 if success, -1 if failed
+int ulog_async_start(void);
+
+/// @brief Prints everything still queued, stops the formatter thread and
+///        goes back to synchronous logging
+void ulog_async_stop(void);
+
+/// @brief Records dropped because a thread's ring was full
+unsigned long long ulog_async_dropped(void);
+
+#else  // FEATURE_ASYNC
+
+#define ulog_async_start(...)
+#define ulog_async_stop(...)
+#define ulog_async_dropped(...) 0ULL
+
+#endif  // FEATURE_ASYNC
+
 #ifdef __cplusplus
 }
 #endif
\ No newline at end of file
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
@@ -8,14 +10,186 @@
 #include <SDL_thread.h>
 #include "libs/microlog/microlog.h"
 #include "player/player.h"
+#include "utils/sync.h"
+#include "video/video.h"
+#include "utils/trace.h"
 
-int main(void) {
-    if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) < 0) {
+#define DEFAULT_URL "../data/videos/test.mp4"
+
+static void print_usage(const char *program) {
+    printf("Usage: %s [options] [file]\n"
+           "  --max-buffer=SECONDS   seconds of packets queued per stream (default %.1f)\n"
+           "  --min-buffer=SECONDS   low-water mark that wakes the demuxer (default %.1f)\n"
+           "  --picture-queue=N      decoded frames kept ahead of display, 1-%d (default %d)\n"
+           "  --decoder-threads=N    video decoder threads, 0 picks from resolution and cores (default 0)\n"
+           "  --decoder-thread-type=auto|frame|slice\n"
+           "                         video decoder threading mode (default auto)\n"
+           "  --headless             null audio/video sinks, prints pipeline stats as JSON when the file ends\n"
+           "  --rate=SPEED           headless clock speed, 1 is real time, 0 runs as fast as possible (default 0)\n"
+           "  --stats=FILE           write the headless JSON report to FILE instead of stdout\n"
+           "  --io=file|mmap|readahead\n"
+           "                         how local files are read: mmap maps them into memory, readahead keeps large\n"
+           "                         reads in flight ahead of the demuxer for slow disks and network mounts (default file)\n"
+           "  --no-load-shedding     never lower video decode quality to keep up\n"
+           "  --sync=audio|video|external\n"
+           "                         master clock, the other streams follow it (default audio)\n"
+           "  --audio-latency=MS     output latency the audio driver adds on top of the device buffer (default 0)\n"
+           "  --downmix=itu|dialog   how surround is mixed down for stereo and mono devices: itu keeps centre and\n"
+           "                         surrounds at -3 dB, dialog keeps the centre at full level (default itu)\n"
+           "  --downmix-matrix=C,... custom downmix coefficients, one output channel after another\n"
+           "  --downmix-gain=GAIN    linear gain applied with the downmix (default 1)\n"
+           "  --bench-downmix        time the downmix kernels this CPU supports and exit\n"
+           "  --no-cache             always probe the file, don't use or update the stream info cache\n"
+           "  --trace=FILE           record per-frame pipeline spans, written as Chrome trace JSON on exit\n",
+           program, DEFAULT_MAX_BUFFER_DURATION, DEFAULT_MIN_BUFFER_DURATION,
+           VIDEO_PICTURE_QUEUE_MAX, DEFAULT_PICTURE_QUEUE_SIZE);
+}
+
+static int parse_options(int argc, char **argv, PlayerOptions *options, const char **url) {
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (strncmp(arg, "--max-buffer=", 13) == 0) {
+            options->max_buffer_duration = atof(arg + 13);
+        } else if (strncmp(arg, "--min-buffer=", 13) == 0) {
+            options->min_buffer_duration = atof(arg + 13);
+        } else if (strncmp(arg, "--picture-queue=", 16) == 0) {
+            options->picture_queue_size = atoi(arg + 16);
+        } else if (strncmp(arg, "--decoder-threads=", 18) == 0) {
+            options->decoder_threads = atoi(arg + 18);
+        } else if (strncmp(arg, "--decoder-thread-type=", 22) == 0) {
+            const char *type = arg + 22;
+            if (strcmp(type, "frame") == 0) {
+                options->decoder_thread_type = FF_THREAD_FRAME;
+            } else if (strcmp(type, "slice") == 0) {
+                options->decoder_thread_type = FF_THREAD_SLICE;
+            } else if (strcmp(type, "auto") != 0) {
+                log_error("Unknown decoder thread type %s", type);
+                return -1;
+            }
+        } else if (strcmp(arg, "--headless") == 0) {
+            options->headless = 1;
+        } else if (strncmp(arg, "--rate=", 7) == 0) {
+            options->headless_rate = atof(arg + 7);
+        } else if (strncmp(arg, "--stats=", 8) == 0) {
+            options->stats_path = arg + 8;
+        } else if (strncmp(arg, "--io=", 5) == 0) {
+            const char *mode = arg + 5;
+            if (strcmp(mode, "mmap") == 0) {
+                options->io_mode = PLAYER_IO_MMAP;
+            } else if (strcmp(mode, "readahead") == 0) {
+                options->io_mode = PLAYER_IO_READAHEAD;
+            } else if (strcmp(mode, "file") != 0) {
+                log_error("Unknown io mode %s", mode);
+                return -1;
+            }
+        } else if (strcmp(arg, "--no-load-shedding") == 0) {
+            options->load_shedding = 0;
+        } else if (strncmp(arg, "--sync=", 7) == 0) {
+            const char *type = arg + 7;
+            if (strcmp(type, "audio") == 0) {
+                options->sync_type = AV_SYNC_AUDIO_MASTER;
+            } else if (strcmp(type, "video") == 0) {
+                options->sync_type = AV_SYNC_VIDEO_MASTER;
+            } else if (strcmp(type, "external") == 0) {
+                options->sync_type = AV_SYNC_EXTERNAL_MASTER;
+            } else {
+                log_error("Unknown sync type %s", type);
+                return -1;
+            }
+        } else if (strncmp(arg, "--audio-latency=", 16) == 0) {
+            options->audio_latency = atof(arg + 16) / 1000.0;
+        } else if (strncmp(arg, "--downmix=", 10) == 0) {
+            const char *preset = arg + 10;
+            if (strcmp(preset, "itu") == 0) {
+                options->downmix.preset = DOWNMIX_ITU;
+            } else if (strcmp(preset, "dialog") == 0) {
+                options->downmix.preset = DOWNMIX_DIALOG;
+            } else {
+                log_error("Unknown downmix %s", preset);
+                return -1;
+            }
+        } else if (strncmp(arg, "--downmix-matrix=", 17) == 0) {
+            if (downmix_parse_matrix(&options->downmix, arg + 17) < 0) {
+                log_error("Downmix matrix takes up to %d comma separated coefficients",
+                          DOWNMIX_MAX_OUT_CHANNELS * DOWNMIX_MAX_IN_CHANNELS);
+                return -1;
+            }
+        } else if (strncmp(arg, "--downmix-gain=", 15) == 0) {
+            options->downmix.gain = atof(arg + 15);
+        } else if (strcmp(arg, "--bench-downmix") == 0) {
+            return downmix_benchmark() < 0 ? -1 : 1;
+        } else if (strcmp(arg, "--no-cache") == 0) {
+            options->use_cache = 0;
+        } else if (strncmp(arg, "--trace=", 8) == 0) {
+            options->trace_path = arg + 8;
+        } else if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+            print_usage(argv[0]);
+            return 1;
+        } else if (arg[0] == '-') {
+            log_error("Unknown option %s", arg);
+            print_usage(argv[0]);
+            return -1;
+        } else {
+            *url = arg;
+        }
+    }
+
+    if (options->max_buffer_duration <= 0 || options->min_buffer_duration < 0 ||
+        options->min_buffer_duration >= options->max_buffer_duration) {
+        log_error("Buffer limits must satisfy 0 <= min-buffer < max-buffer");
+        return -1;
+    }
+    if (options->picture_queue_size < 1 || options->picture_queue_size > VIDEO_PICTURE_QUEUE_MAX) {
+        log_error("Picture queue size must be between 1 and %d", VIDEO_PICTURE_QUEUE_MAX);
+        return -1;
+    }
+    if (options->downmix.gain < 0) {
+        log_error("Downmix gain can't be negative");
+        return -1;
+    }
+    if (options->audio_latency < 0) {
+        log_error("Audio latency can't be negative");
+        return -1;
+    }
+    if (options->headless_rate < 0) {
+        log_error("Headless rate can't be negative");
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *URL = DEFAULT_URL;
+    PlayerOptions options;
+
+    player_options_default(&options);
+    int parsed = parse_options(argc, argv, &options, &URL);
+    if (parsed != 0) {
+        return parsed < 0 ? -1 : 0;
+    }
+
+    // No-op unless built with ULOG_ASYNC. From here on no thread, the audio one included, formats or prints its own logs
+    ulog_async_start();
+
+    if (options.trace_path) {
+        trace_start();
+        trace_thread_name("main");
+    }
+
+    if (options.headless) {
+        // Per-frame info logs would dominate the timings, and the report may go to stdout
+        ulog_set_level(LOG_WARN);
+    }
+
+    // Headless runs never open an audio device, so they also work on boxes without one
+    Uint32 sdl_flags = SDL_INIT_VIDEO | SDL_INIT_TIMER | (options.headless ? 0 : SDL_INIT_AUDIO);
+    if (SDL_Init(sdl_flags) < 0) {
         log_error("Could not initialize SDL: %s", SDL_GetError());
+        ulog_async_stop();
         return -1;
     }
 
-    char *URL = "../data/videos/test.mp4";
     int response = 0;
     SDL_Window *window = NULL;
     SDL_Renderer *renderer = NULL;
@@ -28,6 +202,27 @@ int main(void) {
         goto cleanup;
     }
 
+    if (options.headless) {
+        // A hidden window with a software renderer still exercises the texture upload path, and works with
+        // SDL_VIDEODRIVER=dummy. Without it the video sink just drains the picture queue.
+        window = SDL_CreateWindow(URL, SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 640, 480, SDL_WINDOW_HIDDEN);
+        renderer = window ? SDL_CreateRenderer(window, -1, SDL_RENDERER_SOFTWARE) : NULL;
+        if (!renderer) {
+            log_warn("No renderer for the headless run, skipping texture uploads: %s", SDL_GetError());
+        }
+
+        if (player_init(player, URL, renderer, &options) < 0) {
+            log_error("Could not initialize player");
+            response = -1;
+            goto cleanup;
+        }
+        if (player_run_headless(player) < 0) {
+            log_error("Headless run failed");
+            response = -1;
+        }
+        goto cleanup;
+    }
+
     window = SDL_CreateWindow(URL,
                               SDL_WINDOWPOS_CENTERED,
                               SDL_WINDOWPOS_CENTERED,
@@ -58,7 +253,7 @@ int main(void) {
         }
     }
 
-    if (player_init(player, URL, renderer) < 0) {
+    if (player_init(player, URL, renderer, &options) < 0) {
         log_error("Could not initialize player");
         response = -1;
         goto cleanup;
@@ -72,6 +267,10 @@ int main(void) {
 
     log_info("Player run completed");
 cleanup:
+    // Stop recording before teardown so the trace ends with the last frame, not with cleanup
+    if (options.trace_path && trace_write_json(options.trace_path) < 0) {
+        log_error("Could not write trace to %s", options.trace_path);
+    }
     if (window) {
         SDL_DestroyWindow(window);
         log_info("Window destroyed");
@@ -80,5 +279,6 @@ cleanup:
         player_cleanup(player);
         av_free(player);
     }
+    ulog_async_stop(); // prints whatever is still queued
     return response;
 }
@@ -4,6 +4,7 @@
 
 #include "player.h"
 
+#include <string.h>
 #include <SDL.h>
 #include <SDL_events.h>
 #include <libavutil/time.h>
@@ -11,6 +12,7 @@
 #include "../libs/microlog/microlog.h"
 #include "../audio/audio.h"
 #include "../utils/sync.h"
+#include "../utils/trace.h"
 #include "../video/video.h"
 
 static int init_controls(PlayerState *player_state, SDL_Renderer *renderer) {
@@ -93,13 +95,76 @@ static void discard_unused_streams(PlayerState *player_state) {
     log_info("Discarded unused streams");
 }
 
-int player_init(PlayerState *player_state, const char *filename, SDL_Renderer *renderer) {
+void player_options_default(PlayerOptions *options) {
+    options->max_buffer_duration = DEFAULT_MAX_BUFFER_DURATION;
+    options->min_buffer_duration = DEFAULT_MIN_BUFFER_DURATION;
+    options->picture_queue_size = DEFAULT_PICTURE_QUEUE_SIZE;
+    options->decoder_threads = 0;
+    options->decoder_thread_type = 0;
+    options->headless = 0;
+    options->headless_rate = 0;
+    options->stats_path = NULL;
+    options->trace_path = NULL;
+    options->use_cache = 1;
+    options->io_mode = PLAYER_IO_FILE;
+    options->load_shedding = 1;
+    options->audio_latency = 0;
+    options->sync_type = DEFAULT_AV_SYNC_TYPE;
+    downmix_options_default(&options->downmix);
+}
+
+// Reads the file through a mapping instead of the file protocol, on failure the format context is left as it was
+static int open_mmap_io(PlayerState *player_state, const char *filename) {
+    MmapIO *mmap_io = av_mallocz(sizeof(MmapIO));
+    if (!mmap_io) {
+        return -1;
+    }
+    if (mmap_io_open(mmap_io, filename) < 0) {
+        av_free(mmap_io);
+        return -1;
+    }
+    player_state->mmap_io = mmap_io;
+    player_state->format_context->pb = mmap_io->avio;
+    player_state->format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+    return 0;
+}
+
+// Same for the read-ahead layer
+static int open_readahead_io(PlayerState *player_state, const char *filename) {
+    ReadAheadIO *readahead_io = av_mallocz(sizeof(ReadAheadIO));
+    if (!readahead_io) {
+        return -1;
+    }
+    if (readahead_io_open(readahead_io, filename) < 0) {
+        av_free(readahead_io);
+        return -1;
+    }
+    player_state->readahead_io = readahead_io;
+    player_state->format_context->pb = readahead_io->avio;
+    player_state->format_context->flags |= AVFMT_FLAG_CUSTOM_IO;
+    return 0;
+}
+
+int player_init(PlayerState *player_state, const char *filename, SDL_Renderer *renderer, const PlayerOptions *options) {
+    player_state->options = *options;
+    int64_t open_begin = av_gettime_relative();
+    player_state->sidecar_cache.video_stream = -1;
+    player_state->sidecar_cache.audio_stream = -1;
+    if (player_state->options.use_cache) {
+        sidecar_cache_open(&player_state->sidecar_cache, filename);
+    }
     player_state->format_context = avformat_alloc_context();
 
     if (!player_state->format_context) {
         log_error("Could not allocate player format context");
         return -1;
     }
+    if (player_state->options.io_mode == PLAYER_IO_MMAP && open_mmap_io(player_state, filename) < 0) {
+        log_warn("Could not map %s, reading it through the file protocol", filename);
+    } else if (player_state->options.io_mode == PLAYER_IO_READAHEAD &&
+               open_readahead_io(player_state, filename) < 0) {
+        log_warn("No read-ahead for %s, reading it through the file protocol", filename);
+    }
 
     // Opening the video and reading the video file. Info is stored in the AVFormatContext
     if (avformat_open_input(&player_state->format_context, filename, 0, NULL) < 0) {
@@ -108,10 +173,14 @@ int player_init(PlayerState *player_state, const char *filename, SDL_Renderer *r
     }
     log_info("Opened source file %s", filename);
 
-    if (avformat_find_stream_info(player_state->format_context, NULL) < 0) {
+    // Probing reads and decodes megabytes on big TS/MKV files, a fresh cache entry already has everything it finds
+    if (sidecar_cache_apply(&player_state->sidecar_cache, player_state->format_context) == 0) {
+        log_info("Restored stream information from the cache");
+    } else if (avformat_find_stream_info(player_state->format_context, NULL) < 0) {
         log_error("Could not find stream information");
         return -1;
     }
+    log_info("Stream information ready after %.1f ms", (double) (av_gettime_relative() - open_begin) / 1000.0);
 
     VideoState *video_state = malloc(sizeof(VideoState));
     AudioState *audio_state = malloc(sizeof(AudioState));
@@ -131,28 +200,55 @@ int player_init(PlayerState *player_state, const char *filename, SDL_Renderer *r
         log_error("Could not initialize audio");
         return -1;
     }
-    set_get_audio_clock_fn((GetAudioClockFn) get_audio_clock, video_state, player_state->audio_state);
 
     player_state->audio_packet_queue = audio_state->audio_packet_queue;
     player_state->video_packet_queue = video_state->packet_queue;
-    player_state->seek_mutex = SDL_CreateMutex();
-    if (!player_state->seek_mutex) {
-        log_error("Could not create seek mutex");
+
+    player_state->read_wakeup.sem = SDL_CreateSemaphore(0);
+    if (!player_state->read_wakeup.sem) {
+        log_error("Could not create read wakeup semaphore");
+        return -1;
+    }
+    atomic_init(&player_state->read_wakeup.waiting, 0);
+    packet_queue_set_read_wakeup(player_state->audio_packet_queue, &player_state->read_wakeup,
+                                 player_state->options.min_buffer_duration);
+    // The video decoder's own pipeline has to stay fed on top of the low-water mark
+    packet_queue_set_read_wakeup(player_state->video_packet_queue, &player_state->read_wakeup,
+                                 player_state->options.min_buffer_duration + video_state->decoder_delay);
+    log_info("Buffering between %.2fs and %.2fs per stream",
+             player_state->options.min_buffer_duration, player_state->options.max_buffer_duration);
+
+    if (demux_command_queue_init(&player_state->demux_commands) < 0) {
         return -1;
     }
     player_state->pause_mutex = SDL_CreateMutex();
     player_state->pause_cond = SDL_CreateCond();
     player_state->paused = 0;
-    player_state->seek_complete = 1;
     player_state->quit = malloc(sizeof(int));
     *player_state->quit = 0;
     video_state->quit = player_state->quit;
     audio_state->quit = player_state->quit;
 
-    sync_init(DEFAULT_AV_SYNC_TYPE, player_state);
+    sync_init(player_state->options.sync_type, player_state);
     discard_unused_streams(player_state);
 
-    if (init_controls(player_state, renderer)) {
+    // Same rule as ffplay, Ogg marks its timestamps discontinuous but seeks fine by time
+    player_state->seek_by_bytes = (player_state->format_context->iformat->flags & AVFMT_TS_DISCONT) &&
+                                  strcmp(player_state->format_context->iformat->name, "ogg") != 0;
+    SidecarCache *cache = &player_state->sidecar_cache;
+    if (cache->keyframe_count > 0 && cache->video_stream == video_state->stream_index) {
+        keyframe_index_load(&player_state->keyframe_index, video_state->stream_index, video_state->stream->time_base,
+                            cache->keyframes, cache->keyframe_count);
+    } else if (!player_state->options.headless && video_state->stream_index >= 0 &&
+               keyframe_index_start(&player_state->keyframe_index, filename, video_state->stream_index,
+                                    video_state->stream->time_base) < 0) {
+        // Benchmarks never seek, so headless runs don't pay for a second demuxer reading the file
+        log_warn("No keyframe index, seeks use the demuxer's own search");
+    }
+    sidecar_cache_unmap(cache);
+
+    // Nothing is drawn in headless runs, and the font may not even exist on a build box
+    if (!player_state->options.headless && init_controls(player_state, renderer)) {
         log_error("Could not initialize controls");
         return -1;
     }
@@ -160,34 +256,48 @@ int player_init(PlayerState *player_state, const char *filename, SDL_Renderer *r
     return 0;
 }
 
+/** Hands the seek to the demux thread and wakes it wherever it sleeps, on full queues, at EOF or while paused. The
+ * event loop never waits for the seek itself. **/
 static void stream_seek(PlayerState *player_state, int64_t pos, int64_t rel, int flags) {
-    SDL_LockMutex(player_state->seek_mutex);
-
-    if (!player_state->seek_req && player_state->seek_complete) {
-        player_state->seek_pos = pos;
-        player_state->seek_flags = flags;
-        player_state->seek_rel = rel;
-        player_state->seek_req = 1;
-        player_state->seek_complete = 0;
+    DemuxCommand command = {
+        .type = DEMUX_COMMAND_SEEK,
+        .target = pos,
+        .rel = rel,
+        .flags = flags,
+        .issued_us = av_gettime_relative(),
+    };
 
-        sync_reset_clock(pos / (double) AV_TIME_BASE);
+    if (demux_command_push(&player_state->demux_commands, &command) < 0) {
+        return;
     }
-
-    SDL_UnlockMutex(player_state->seek_mutex);
+    SDL_SemPost(player_state->read_wakeup.sem);
+    SDL_LockMutex(player_state->pause_mutex);
+    SDL_CondBroadcast(player_state->pause_cond);
+    SDL_UnlockMutex(player_state->pause_mutex);
 }
 
 static void handle_seek(PlayerState *player_state, double incr) {
     if (!player_state) return;
 
     double pos;
-    SDL_LockMutex(player_state->seek_mutex);
-    if (sync_state->av_sync_type == AV_SYNC_AUDIO_MASTER ||
-        sync_state->av_sync_type == AV_SYNC_VIDEO_MASTER) {
+    // Presses in quick succession add up, the clock only moves once the seek has run
+    int64_t pending = demux_command_seek_target(&player_state->demux_commands);
+    if (pending != AV_NOPTS_VALUE) {
+        pos = pending / (double) AV_TIME_BASE;
+    } else if (sync_state->av_sync_type == AV_SYNC_AUDIO_MASTER ||
+               sync_state->av_sync_type == AV_SYNC_VIDEO_MASTER) {
         pos = get_master_clock();
     } else {
         pos = get_external_clock();
     }
-    SDL_UnlockMutex(player_state->seek_mutex);
+    if (isnan(pos)) {
+        // Right after a seek the clocks have nothing of the new serial yet
+        pos = get_video_clock();
+    }
+    if (isnan(pos)) {
+        log_warn("No clock to seek from yet, ignoring seek");
+        return;
+    }
 
     pos += incr;
     if (pos < 0) pos = 0;
@@ -199,42 +309,103 @@ static void handle_seek(PlayerState *player_state, double incr) {
 
     int seek_flags = (incr < 0) ? AVSEEK_FLAG_BACKWARD : 0;
     seek_flags |= AVSEEK_FLAG_ANY;
-    stream_seek(player_state, seek_target, incr, seek_flags);
+    stream_seek(player_state, seek_target, (int64_t) (incr * AV_TIME_BASE), seek_flags);
 }
 
-static void flush_codec_buffers(PlayerState *player_state) {
-    if (player_state->audio_state->codec_context) {
-        avcodec_flush_buffers(player_state->audio_state->codec_context);
+/** Seeks straight to the last keyframe before target (AV_TIME_BASE) using the keyframe index, so the demuxer neither
+ * searches the file nor lands in the middle of a GOP. rel is how far the user asked to move: a forward seek whose
+ * keyframe isn't past the position it started from takes the next keyframe instead, so on long GOPs +10s never ends
+ * up going nowhere or backwards. Returns the timestamp landed on in AV_TIME_BASE, or AV_NOPTS_VALUE when the index
+ * isn't complete yet, has no keyframe to go forward to, or the seek failed, and the caller should search as before. **/
+static int64_t seek_to_keyframe(PlayerState *player_state, int64_t target, int64_t rel) {
+    KeyframeIndex *index = &player_state->keyframe_index;
+    AVFormatContext *format_context = player_state->format_context;
+    const KeyframeEntry *keyframe = keyframe_index_lookup(index, av_rescale_q(target, AV_TIME_BASE_Q,
+                                                                              index->time_base));
+    int ret = -1;
+
+    if (keyframe && rel > 0 &&
+        keyframe->timestamp <= av_rescale_q(target - rel, AV_TIME_BASE_Q, index->time_base)) {
+        keyframe = keyframe_index_next(index, keyframe);
     }
-
-    if (player_state->video_state->codec_context) {
-        avcodec_flush_buffers(player_state->video_state->codec_context);
+    if (!keyframe) {
+        return AV_NOPTS_VALUE;
+    }
+    if (player_state->seek_by_bytes && keyframe->pos >= 0) {
+        ret = avformat_seek_file(format_context, -1, keyframe->pos, keyframe->pos, keyframe->pos, AVSEEK_FLAG_BYTE);
+    }
+    if (ret < 0) {
+        ret = avformat_seek_file(format_context, index->stream_index, keyframe->timestamp, keyframe->timestamp,
+                                 keyframe->timestamp, 0);
+    }
+    if (ret < 0) {
+        log_warn("Keyframe seek failed, falling back to the demuxer's search");
+        return AV_NOPTS_VALUE;
     }
+
+    int64_t landed = av_rescale_q(keyframe->timestamp, index->time_base, AV_TIME_BASE_Q);
+    log_info("Seeked to keyframe at %.3fs for target %.3fs", landed / (double) AV_TIME_BASE,
+             target / (double) AV_TIME_BASE);
+    return landed;
 }
 
-static void flush_queues(PlayerState *player_state, int64_t seek_target) {
+/** Starts a new serial on both queues. The decoders notice the change on their next packet and flush themselves, and
+ * anything decoded before the seek is dropped by serial instead of being displayed. **/
+static void flush_queues(PlayerState *player_state) {
     if (player_state->audio_state->stream_index >= 0) {
         packet_queue_flush(player_state->audio_packet_queue);
-        sync_state->audio_clock = seek_target / (double) AV_TIME_BASE;
-
-        AVPacket *flush_pkt = av_packet_alloc();
-        flush_pkt->data = NULL;
-        packet_queue_put(player_state->audio_packet_queue, flush_pkt);
-        av_packet_free(&flush_pkt);
         log_info("Flushed audio queue");
     }
 
     if (player_state->video_state->stream_index >= 0) {
         packet_queue_flush(player_state->video_packet_queue);
-
-        AVPacket *flush_pkt = av_packet_alloc();
-        flush_pkt->data = NULL;
-        packet_queue_put(player_state->video_packet_queue, flush_pkt);
-        av_packet_free(&flush_pkt);
-
         video_state_reset(player_state->video_state);
         log_info("Flushed video queue");
     }
+
+    // Demux thread may be asleep on full queues or at EOF
+    SDL_SemPost(player_state->read_wakeup.sem);
+}
+
+void player_execute_seek(PlayerState *player_state, const DemuxCommand *command) {
+    VideoState *video_state = player_state->video_state;
+    int stream_index = -1;
+    int64_t seek_target = command->target;
+
+    if (player_state->audio_state->stream_index >= 0) {
+        stream_index = player_state->audio_state->stream_index;
+    } else if (video_state->stream_index >= 0) {
+        stream_index = video_state->stream_index;
+    }
+    log_info("Seeking to %.3fs, %d request(s), %.1f ms after the first one", seek_target / (double) AV_TIME_BASE,
+             command->coalesced, (av_gettime_relative() - command->issued_us) / 1000.0);
+    int64_t trace = trace_begin();
+
+    int64_t landed = seek_to_keyframe(player_state, seek_target, command->rel);
+    if (landed == AV_NOPTS_VALUE && stream_index >= 0) {
+        AVRational time_base = player_state->format_context->streams[stream_index]->time_base;
+        int64_t rel = av_rescale_q(command->rel, AV_TIME_BASE_Q, time_base);
+        seek_target = av_rescale_q(seek_target, AV_TIME_BASE_Q, time_base);
+
+        int64_t seek_min = rel > 0 ? seek_target - rel + 2 : INT64_MIN;
+        int64_t seek_max = rel > 0 ? seek_target + rel - 2 : INT64_MAX;
+        if (avformat_seek_file(player_state->format_context, stream_index, seek_min, seek_target, seek_max,
+                               command->flags) < 0) {
+            log_error("Error while seeking");
+        } else {
+            landed = command->target;
+        }
+    }
+
+    if (landed != AV_NOPTS_VALUE) {
+        sync_reset_clock(command->target / (double) AV_TIME_BASE);
+        flush_queues(player_state);
+        // The presenter reports the latency once the first picture of the new serial is on screen
+        atomic_store(&video_state->seek_serial, atomic_load(&video_state->packet_queue->serial));
+        atomic_store(&video_state->seek_issued_us, command->issued_us);
+    }
+    trace_end("seek", trace, command->target / (double) AV_TIME_BASE);
+    demux_command_seek_done(&player_state->demux_commands);
 }
 
 static void toggle_pause(PlayerState *player_state) {
@@ -247,7 +418,10 @@ static void toggle_pause(PlayerState *player_state) {
 
     SDL_UnlockMutex(player_state->pause_mutex);
 
-    SDL_PauseAudio(player_state->paused);
+    if (player_state->audio_state->device) {
+        SDL_PauseAudioDevice(player_state->audio_state->device, player_state->paused);
+    }
+    sync_set_paused(player_state->paused);
 
     log_info("Player %s", player_state->paused ? "paused" : "resumed");
 }
@@ -262,8 +436,36 @@ void wait_if_paused() {
     SDL_UnlockMutex(player_state->pause_mutex);
 }
 
-int player_run(PlayerState *player_state) {
-    SDL_Event event;
+/** Stops the demux and decode threads and waits for them. Every wait they can be sleeping in gets woken, so nothing
+ * that is freed afterwards, the rings, queues, codec contexts and the format context's IO, is still in use. No-op
+ * once they are stopped. **/
+static void player_stop_threads(PlayerState *player_state) {
+    if (!player_state->packet_queueing_thread && !player_state->video_decode_thread &&
+        !player_state->audio_decode_thread) {
+        return;
+    }
+    *player_state->quit = 1;
+    packet_queue_abort(player_state->audio_packet_queue);
+    packet_queue_abort(player_state->video_packet_queue);
+    SDL_SemPost(player_state->read_wakeup.sem);
+    SDL_SemPost(player_state->audio_state->space_sem);
+    SDL_LockMutex(player_state->video_state->picture_queue_mutex);
+    SDL_CondBroadcast(player_state->video_state->picture_queue_cond);
+    SDL_UnlockMutex(player_state->video_state->picture_queue_mutex);
+    SDL_LockMutex(player_state->pause_mutex);
+    SDL_CondBroadcast(player_state->pause_cond);
+    SDL_UnlockMutex(player_state->pause_mutex);
+
+    SDL_WaitThread(player_state->packet_queueing_thread, NULL);
+    SDL_WaitThread(player_state->video_decode_thread, NULL);
+    SDL_WaitThread(player_state->audio_decode_thread, NULL);
+    player_state->packet_queueing_thread = NULL;
+    player_state->video_decode_thread = NULL;
+    player_state->audio_decode_thread = NULL;
+    log_info("Pipeline threads stopped");
+}
+
+static int start_threads(PlayerState *player_state) {
     player_state->packet_queueing_thread = SDL_CreateThread(packet_queueing_thread, "packet queuing thread",
                                                             player_state);
     player_state->video_decode_thread = SDL_CreateThread(video_thread, "video thread", player_state);
@@ -271,112 +473,223 @@ int player_run(PlayerState *player_state) {
         log_error("Could not create video decode thread");
         return -1;
     }
+    player_state->audio_decode_thread = SDL_CreateThread(audio_thread, "audio thread", player_state);
+    if (!player_state->audio_decode_thread) {
+        log_error("Could not create audio decode thread");
+        return -1;
+    }
+    return 0;
+}
+
+// Acts on one input event. Returns -1 once the player should quit.
+static int handle_event(PlayerState *player_state, SDL_Event *event) {
+    switch (event->type) {
+        case SDL_MOUSEBUTTONDOWN:
+            if (event->button.button == SDL_BUTTON_LEFT) {
+                int x = event->button.x;
+                int y = event->button.y;
+
+                if (SDL_PointInRect(&(SDL_Point){x, y}, &player_state->pause_button)) {
+                    toggle_pause(player_state);
+                } else if (SDL_PointInRect(&(SDL_Point){x, y}, &player_state->rewind_button)) {
+                    handle_seek(player_state, -10.0);
+                } else if (SDL_PointInRect(&(SDL_Point){x, y}, &player_state->forward_button)) {
+                    handle_seek(player_state, 10.0);
+                }
+            }
+            break;
+        case SDL_KEYDOWN:
+            switch (event->key.keysym.sym) {
+                case SDLK_SPACE:
+                    toggle_pause(player_state);
+                    break;
+                case SDLK_LEFT:
+                    handle_seek(player_state, -10.0);
+                    break;
+                case SDLK_RIGHT:
+                    handle_seek(player_state, 10.0);
+                    break;
+                case SDLK_UP:
+                    handle_seek(player_state, 60.0);
+                    break;
+                case SDLK_DOWN:
+                    handle_seek(player_state, -60.0);
+                    break;
+                case SDLK_i:
+                    video_log_frame_stats(player_state->video_state);
+                    presenter_request_stats(&player_state->presenter);
+                    break;
+                default:
+                    break;
+            }
+            break;
+
+        case FF_QUIT_EVENT:
+        case SDL_QUIT:
+            return -1;
+        default:
+            break;
+    }
+    return 0;
+}
+
+// Next input event, waiting for one until due_us (av_gettime_relative() time). 0 once due_us has passed without one.
+static int wait_event_until(SDL_Event *event, int64_t due_us) {
+    int64_t now = av_gettime_relative();
+
+    if (due_us <= now) {
+        return SDL_PollEvent(event);
+    }
+    return SDL_WaitEventTimeout(event, (int) ((due_us - now + 999) / 1000));
+}
 
-    schedule_refresh(player_state->video_state, 40); // pushes an FF_REFRESH_EVENT to event loop
+int player_run(PlayerState *player_state) {
+    SDL_Event event;
+    if (start_threads(player_state) < 0) {
+        return -1;
+    }
+
+    /** From here on this thread owns the renderer, as SDL wants it: the presenter picks, uploads and presents a
+     * picture every vblank and input is handled in between presents. Seeks only queue a command, so input never holds
+     * a present back. Only the demux thread touches the format context. **/
+    if (presenter_start(&player_state->presenter, player_state->video_state) < 0) {
+        return -1;
+    }
 
     while (true) {
         if (*player_state->quit) {
             log_info("Quiting player");
             break;
         }
-        if (player_state->paused) {
-            av_read_pause(player_state->format_context);
-        } else {
-            av_read_play(player_state->format_context);
-        }
-        if (player_state->seek_req) {
-            SDL_LockMutex(player_state->seek_mutex);
-            int stream_index = -1;
-            int64_t seek_target = player_state->seek_pos;
-            int seek_flags = player_state->seek_flags;
-
-            if (player_state->audio_state->stream_index >= 0) {
-                stream_index = player_state->audio_state->stream_index;
-            } else if (player_state->video_state->stream_index >= 0) {
-                stream_index = player_state->video_state->stream_index;
-            }
+        int64_t due_us = presenter_present(&player_state->presenter);
 
-            if (stream_index >= 0) {
-                seek_target = av_rescale_q(seek_target,
-                                           AV_TIME_BASE_Q,
-                                           player_state->format_context->streams[stream_index]->time_base);
-
-                int64_t seek_min = player_state->seek_rel > 0
-                                       ? seek_target - player_state->seek_rel + 2
-                                       : INT64_MIN;
-                int64_t seek_max = player_state->seek_rel > 0 ? seek_target + player_state->seek_rel - 2 : INT64_MAX;
-                if (avformat_seek_file(player_state->format_context, stream_index, seek_min, seek_target, seek_max,
-                                       seek_flags) < 0) {
-                    log_error("Error while seeking");
-                } else {
-                    flush_codec_buffers(player_state);
-
-                    flush_queues(player_state, seek_target);
-                }
+        // With vsync the present has already waited for the vblank, without it the rest of the refresh is waited here
+        while (wait_event_until(&event, due_us)) {
+            if (handle_event(player_state, &event) < 0) {
+                player_stop_threads(player_state);
+                presenter_stop(&player_state->presenter);
+                SDL_Quit();
+                return 0;
             }
+        }
+    }
+    return 0;
+}
 
-            player_state->seek_req = 0;
-            player_state->seek_complete = 1;
-            SDL_UnlockMutex(player_state->seek_mutex);
+// Everything has been decoded and consumed by the sinks
+static bool headless_finished(PlayerState *player_state) {
+    VideoState *video_state = player_state->video_state;
+    AudioState *audio_state = player_state->audio_state;
+    int video_serial = atomic_load(&video_state->packet_queue->serial);
+    int audio_serial = atomic_load(&audio_state->audio_packet_queue->serial);
+
+    return atomic_load(&video_state->finished_serial) == video_serial && video_state->picture_queue_size == 0 &&
+           atomic_load(&audio_state->finished_serial) == audio_serial &&
+           spsc_ring_size(&audio_state->pcm_ring) == 0;
+}
+
+/** Benchmark run: demux, decode and conversion threads run as usual, but audio and video end in null sinks driven
+ * from here instead of the audio device and the vsync'd presenter. With headless_rate 0 the sinks take data as
+ * soon as it shows up, otherwise they follow a clock running at that speed. Writes a JSON report at the end. **/
+int player_run_headless(PlayerState *player_state) {
+    VideoState *video_state = player_state->video_state;
+    AudioState *audio_state = player_state->audio_state;
+    double rate = player_state->options.headless_rate;
+    // One frame of what the null sink is fed, the callback only ever hands out whole ones
+    int bytes_per_sample = av_get_bytes_per_sample(audio_state->output_format) *
+                           audio_state->output_layout.nb_channels;
+    uint8_t audio_sink[HEADLESS_AUDIO_CHUNK];
+    int64_t audio_bytes_played = 0;
+    int64_t last_sample_us = 0;
+    double start_pts = player_state->format_context->start_time != AV_NOPTS_VALUE
+                           ? player_state->format_context->start_time / (double) AV_TIME_BASE
+                           : 0;
+
+    stats_reset();
+    if (start_threads(player_state) < 0) {
+        return -1;
+    }
+    log_warn("Headless run started (%s)", rate > 0 ? "fixed clock" : "as fast as possible");
+
+    while (!headless_finished(player_state)) {
+        int64_t now = av_gettime_relative();
+        double elapsed = (double) (now - pipeline_stats.start_us) / 1000000.0 * rate;
+        bool idle = true;
+
+        // Audio null sink, pulls through the same callback the device would
+        int64_t wanted = rate > 0
+                             ? (int64_t) (elapsed * audio_state->bytes_per_second) - audio_bytes_played
+                             : (int64_t) spsc_ring_size(&audio_state->pcm_ring);
+        wanted = FFMIN(wanted, HEADLESS_AUDIO_CHUNK);
+        wanted -= wanted % bytes_per_sample;
+        if (wanted > 0) {
+            sdl_audio_callback(audio_state, audio_sink, (int) wanted);
+            audio_bytes_played += wanted;
+            idle = false;
         }
-        SDL_WaitEvent(&event);
-        switch (event.type) {
-            case SDL_MOUSEBUTTONDOWN:
-                if (event.button.button == SDL_BUTTON_LEFT) {
-                    int x = event.button.x;
-                    int y = event.button.y;
-
-                    if (SDL_PointInRect(&(SDL_Point){x, y}, &player_state->pause_button)) {
-                        toggle_pause(player_state);
-                    } else if (SDL_PointInRect(&(SDL_Point){x, y}, &player_state->rewind_button)) {
-                        handle_seek(player_state, -10.0);
-                    } else if (SDL_PointInRect(&(SDL_Point){x, y}, &player_state->forward_button)) {
-                        handle_seek(player_state, 10.0);
-                    }
-                }
-                break;
-            case SDL_KEYDOWN:
-                switch (event.key.keysym.sym) {
-                    case SDLK_SPACE:
-                        toggle_pause(player_state);
-                        break;
-                    case SDLK_LEFT:
-                        handle_seek(player_state, -10.0);
-                        break;
-                    case SDLK_RIGHT:
-                        handle_seek(player_state, 10.0);
-                        break;
-                    case SDLK_UP:
-                        handle_seek(player_state, 60.0);
-                        break;
-                    case SDLK_DOWN:
-                        handle_seek(player_state, -60.0);
-                        break;
-                    default:
-                        break;
-                }
-                break;
 
-            case FF_QUIT_EVENT:
-            case SDL_QUIT:
-                if (player_state && player_state->quit) {
-                    *player_state->quit = 1;
-                }
-                SDL_Quit();
-                return 0;
-            case FF_REFRESH_EVENT:
-                if (event.user.data1) {
-                    video_refresh_timer(event.user.data1);
-                }
-                break;
+        if (video_present_headless(video_state, rate > 0 ? start_pts + elapsed : NAN)) {
+            idle = false;
+        }
+
+        if (now - last_sample_us >= HEADLESS_SAMPLE_INTERVAL_US) {
+            stats_sample_queues(packet_queue_duration(player_state->audio_packet_queue),
+                                packet_queue_duration(player_state->video_packet_queue),
+                                video_state->picture_queue_size,
+                                (int64_t) spsc_ring_size(&audio_state->pcm_ring));
+            last_sample_us = now;
+        }
 
-            default:
-                break;
+        if (idle) {
+            SDL_Delay(1);
         }
     }
+    stats_stop();
+    // The report only counts work that actually finished
+    player_stop_threads(player_state);
+
+    FILE *out = stdout;
+    if (player_state->options.stats_path) {
+        out = fopen(player_state->options.stats_path, "w");
+        if (!out) {
+            log_error("Could not open %s for the stats report", player_state->options.stats_path);
+            return -1;
+        }
+    }
+    int ret = stats_write_json(out, player_state->format_context->url, rate, video_state->frames_dropped_stale,
+                               atomic_load(&audio_state->underruns));
+    if (out != stdout) {
+        fclose(out);
+    }
+    return ret;
+}
+
+// A missing or stale entry, or one that now gains the keyframes the last run didn't get to finish
+static bool cache_needs_write(PlayerState *player_state) {
+    SidecarCache *cache = &player_state->sidecar_cache;
+
+    if (!cache->media_path || !player_state->format_context || !player_state->video_state ||
+        !player_state->audio_state) {
+        return false;
+    }
+    if (!cache->hit || cache->video_stream != player_state->video_state->stream_index ||
+        cache->audio_stream != player_state->audio_state->stream_index) {
+        return true;
+    }
+    return cache->keyframe_count == 0 && atomic_load(&player_state->keyframe_index.complete);
 }
 
 void player_cleanup(PlayerState *player_state) {
+    // Nothing below may go away while a pipeline thread can still reach it
+    player_stop_threads(player_state);
+    presenter_stop(&player_state->presenter);
+    if (cache_needs_write(player_state)) {
+        sidecar_cache_write(&player_state->sidecar_cache, player_state->format_context,
+                            player_state->video_state->stream_index, player_state->audio_state->stream_index,
+                            &player_state->keyframe_index);
+    }
+    sidecar_cache_close(&player_state->sidecar_cache);
+    keyframe_index_destroy(&player_state->keyframe_index);
     if (player_state->pause_texture) {
         SDL_DestroyTexture(player_state->pause_texture);
     }
@@ -398,6 +711,15 @@ void player_cleanup(PlayerState *player_state) {
         avformat_close_input(&player_state->format_context);
         log_info("Closed player format context");
     }
+    if (player_state->mmap_io) {
+        // avformat_close_input() doesn't touch a custom AVIOContext
+        mmap_io_close(player_state->mmap_io);
+        av_freep(&player_state->mmap_io);
+    }
+    if (player_state->readahead_io) {
+        readahead_io_close(player_state->readahead_io);
+        av_freep(&player_state->readahead_io);
+    }
     if (player_state->video_state) {
         video_cleanup(player_state->video_state);
         free(player_state->video_state);
@@ -408,8 +730,9 @@ void player_cleanup(PlayerState *player_state) {
         free(player_state->audio_state);
         log_info("Freed player audio state");
     }
-    if (player_state->seek_mutex) {
-        SDL_DestroyMutex(player_state->seek_mutex);
+    demux_command_queue_destroy(&player_state->demux_commands);
+    if (player_state->read_wakeup.sem) {
+        SDL_DestroySemaphore(player_state->read_wakeup.sem);
     }
 
     free(player_state->quit);
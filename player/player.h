@@ -9,32 +9,72 @@
 #include <SDL_thread.h>
 #include <SDL_ttf.h>
 #include <libavformat/avformat.h>
+#include "../audio/downmix.h"
+#include "../utils/demux_command.h"
+#include "../utils/keyframe_index.h"
+#include "../utils/mmap_io.h"
 #include "../utils/packet_queue.h"
+#include "../utils/readahead_io.h"
+#include "../utils/sidecar_cache.h"
+#include "../video/presenter.h"
+
+#define DEFAULT_MAX_BUFFER_DURATION 5.0
+#define DEFAULT_MIN_BUFFER_DURATION 1.0
+#define HEADLESS_AUDIO_CHUNK 16384 // most bytes the null audio sink pulls per loop
+#define HEADLESS_SAMPLE_INTERVAL_US 10000
 
 // Forward declarations
 typedef struct AudioState AudioState;
 typedef struct VideoState VideoState;
 
+typedef enum PlayerIoMode {
+    PLAYER_IO_FILE, // avformat's own file protocol
+    PLAYER_IO_MMAP, // local files mapped into memory, see mmap_io.h
+    PLAYER_IO_READAHEAD, // large reads kept in flight ahead of the demuxer, see readahead_io.h
+} PlayerIoMode;
+
+typedef struct PlayerOptions {
+    double max_buffer_duration; // seconds queued per stream before the demuxer goes to sleep
+    double min_buffer_duration; // a queue draining below this wakes the demuxer again
+    int picture_queue_size; // decoded frames the video thread may keep ahead of display
+    int decoder_threads; // 0 picks from resolution and cores
+    int decoder_thread_type; // 0 picks from codec capabilities, otherwise FF_THREAD_FRAME / FF_THREAD_SLICE
+    int headless; // null audio/video sinks, no device, no vsync, stats as JSON at the end
+    double headless_rate; // playback speed of the headless clock, 0 runs as fast as the pipeline can go
+    const char *stats_path; // where the headless JSON report goes, NULL for stdout
+    const char *trace_path; // Chrome trace-event JSON written on exit, NULL leaves tracing off
+    int use_cache; // restore stream info and keyframes of files opened before instead of probing
+    PlayerIoMode io_mode;
+    int load_shedding; // skip deblocking / frames in the video decoder when it falls behind
+    double audio_latency; // seconds the audio driver adds on top of the device buffer
+    int sync_type; // AV_SYNC_*, the clock the other streams follow
+    DownmixOptions downmix; // surround going to a device with fewer channels
+} PlayerOptions;
+
 typedef struct PlayerState {
     AVFormatContext *format_context;
+    MmapIO *mmap_io; // NULL unless the file is read through a mapping
+    ReadAheadIO *readahead_io; // NULL unless the file is read through the read-ahead layer
 
     AudioState *audio_state;
     VideoState *video_state;
 
     PacketQueue *audio_packet_queue;
     PacketQueue *video_packet_queue;
+    ReadWakeup read_wakeup;
+    PlayerOptions options;
 
     SDL_Thread *video_decode_thread;
+    SDL_Thread *audio_decode_thread;
     SDL_Thread *packet_queueing_thread;
-    SDL_mutex *seek_mutex;
+    Presenter presenter; // picks the picture for every vblank, the main thread presents it
     SDL_mutex *pause_mutex;
     SDL_cond *pause_cond;
     int paused;
-    int seek_complete;
-    int seek_req;
-    int seek_flags;
-    int seek_rel;
-    int64_t seek_pos;
+    DemuxCommandQueue demux_commands; // seeks, run by the demux thread
+    KeyframeIndex keyframe_index; // video keyframes, built in the background for seeking
+    SidecarCache sidecar_cache;
+    int seek_by_bytes; // container timestamps can jump (MPEG-TS), seek to the keyframe's byte offset instead
     int *quit;
 
     SDL_Rect pause_button;
@@ -48,11 +88,18 @@ typedef struct PlayerState {
 } PlayerState;
 
 
-int player_init(PlayerState *player, const char *filename, SDL_Renderer *renderer);
+void player_options_default(PlayerOptions *options);
+
+int player_init(PlayerState *player, const char *filename, SDL_Renderer *renderer, const PlayerOptions *options);
 
 void wait_if_paused();
 
+// Demux thread only, it owns the format context
+void player_execute_seek(PlayerState *player_state, const DemuxCommand *command);
+
 void player_cleanup(PlayerState *player);
 
 int player_run(PlayerState *player);
+
+int player_run_headless(PlayerState *player);
 #endif //PLAYER_H
@@ -0,0 +1,135 @@
+//
+// Created by Deshy on 2025/06/20.
+//
+#include "clock.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <libavutil/time.h>
+
+static double now_seconds(void) {
+    return av_gettime_relative() / 1000000.0;
+}
+
+// Odd sequence keeps readers off until write_end(). Another writer in the middle of an update is waited out.
+static void write_begin(Clock *clock) {
+    unsigned sequence = atomic_load_explicit(&clock->sequence, memory_order_relaxed);
+    while (true) {
+        if (!(sequence & 1) &&
+            atomic_compare_exchange_weak_explicit(&clock->sequence, &sequence, sequence + 1, memory_order_acquire,
+                                                  memory_order_relaxed)) {
+            break;
+        }
+        sequence = atomic_load_explicit(&clock->sequence, memory_order_relaxed);
+    }
+    // Field stores can't move above the odd sequence
+    atomic_thread_fence(memory_order_release);
+}
+
+static void write_end(Clock *clock) {
+    atomic_fetch_add_explicit(&clock->sequence, 1, memory_order_release);
+}
+
+static void load(Clock *clock, ClockSnapshot *snapshot) {
+    snapshot->pts = atomic_load_explicit(&clock->pts, memory_order_relaxed);
+    snapshot->pts_drift = atomic_load_explicit(&clock->pts_drift, memory_order_relaxed);
+    snapshot->last_updated = atomic_load_explicit(&clock->last_updated, memory_order_relaxed);
+    snapshot->speed = atomic_load_explicit(&clock->speed, memory_order_relaxed);
+    snapshot->serial = atomic_load_explicit(&clock->serial, memory_order_relaxed);
+    snapshot->paused = atomic_load_explicit(&clock->paused, memory_order_relaxed);
+}
+
+void clock_snapshot(Clock *clock, ClockSnapshot *snapshot) {
+    unsigned before;
+    unsigned after;
+
+    do {
+        before = atomic_load_explicit(&clock->sequence, memory_order_acquire);
+        load(clock, snapshot);
+        // Field loads can't move below the second sequence load
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&clock->sequence, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+// Caller holds the sequence
+static void store(Clock *clock, double pts, int serial, double time) {
+    atomic_store_explicit(&clock->pts, pts, memory_order_relaxed);
+    atomic_store_explicit(&clock->last_updated, time, memory_order_relaxed);
+    atomic_store_explicit(&clock->pts_drift, pts - time, memory_order_relaxed);
+    atomic_store_explicit(&clock->serial, serial, memory_order_relaxed);
+}
+
+static double snapshot_time(const ClockSnapshot *snapshot, double time) {
+    if (snapshot->paused) {
+        return snapshot->pts;
+    }
+    return snapshot->pts_drift + time - (time - snapshot->last_updated) * (1.0 - snapshot->speed);
+}
+
+void clock_init(Clock *clock, const atomic_int *queue_serial) {
+    atomic_init(&clock->sequence, 0);
+    atomic_init(&clock->pts, NAN);
+    atomic_init(&clock->pts_drift, NAN);
+    atomic_init(&clock->last_updated, now_seconds());
+    atomic_init(&clock->speed, 1.0);
+    atomic_init(&clock->serial, -1);
+    atomic_init(&clock->paused, 0);
+    clock->queue_serial = queue_serial;
+}
+
+double clock_get(Clock *clock) {
+    ClockSnapshot snapshot;
+
+    clock_snapshot(clock, &snapshot);
+    if (clock->queue_serial && atomic_load(clock->queue_serial) != snapshot.serial) {
+        return NAN;
+    }
+    return snapshot_time(&snapshot, now_seconds());
+}
+
+void clock_set_at(Clock *clock, double pts, int serial, double time) {
+    write_begin(clock);
+    store(clock, pts, serial, time);
+    write_end(clock);
+}
+
+void clock_set(Clock *clock, double pts, int serial) {
+    clock_set_at(clock, pts, serial, now_seconds());
+}
+
+void clock_set_speed(Clock *clock, double speed) {
+    double time = now_seconds();
+    ClockSnapshot snapshot;
+
+    write_begin(clock);
+    // Restart from the current time, so the old speed stays applied to the time that has already passed
+    load(clock, &snapshot);
+    store(clock, snapshot_time(&snapshot, time), snapshot.serial, time);
+    atomic_store_explicit(&clock->speed, speed, memory_order_relaxed);
+    write_end(clock);
+}
+
+void clock_set_paused(Clock *clock, int paused) {
+    double time = now_seconds();
+    ClockSnapshot snapshot;
+
+    write_begin(clock);
+    load(clock, &snapshot);
+    if (snapshot.paused != paused) {
+        store(clock, snapshot_time(&snapshot, time), snapshot.serial, time);
+        atomic_store_explicit(&clock->paused, paused, memory_order_relaxed);
+    }
+    write_end(clock);
+}
+
+void clock_sync_to_slave(Clock *clock, Clock *slave) {
+    ClockSnapshot slave_snapshot;
+    double clock_time = clock_get(clock);
+    double slave_time = clock_get(slave);
+
+    clock_snapshot(slave, &slave_snapshot);
+    if (!isnan(slave_time) && (isnan(clock_time) || fabs(clock_time - slave_time) > CLOCK_NOSYNC_THRESHOLD)) {
+        clock_set(clock, slave_time, slave_snapshot.serial);
+    }
+}
@@ -0,0 +1,59 @@
+//
+// Created by Deshy on 2025/06/20.
+//
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <stdatomic.h>
+
+#define CLOCK_NOSYNC_THRESHOLD 10.0 // a slave further off than this drags the clock along with it
+
+/** A media clock in the style of ffplay's: the pts at the last update is kept as drift against the system clock, so
+ * reading it in between updates extrapolates at speed. Fields are published through a seqlock: writers bump sequence
+ * to odd, store, and bump it back to even, readers retry until they saw the same even sequence on both sides of their
+ * loads. Readers never lock and never see half an update, writers on different threads (the audio callback and a
+ * seek, say) take turns on the sequence. **/
+typedef struct Clock {
+    atomic_uint sequence;
+    _Atomic double pts; // clock base
+    _Atomic double pts_drift; // pts minus the time of the last update
+    _Atomic double last_updated; // seconds on av_gettime_relative()
+    _Atomic double speed;
+    atomic_int serial; // seek generation the pts belongs to
+    atomic_int paused;
+
+    const atomic_int *queue_serial; // packet queue this clock follows, the clock reads NAN while they differ
+} Clock;
+
+typedef struct ClockSnapshot {
+    double pts;
+    double pts_drift;
+    double last_updated;
+    double speed;
+    int serial;
+    int paused;
+} ClockSnapshot;
+
+// queue_serial may be NULL for a clock that never goes stale, like the external one
+void clock_init(Clock *clock, const atomic_int *queue_serial);
+
+// Consistent copy of every field
+void clock_snapshot(Clock *clock, ClockSnapshot *snapshot);
+
+// Current time on the clock, NAN before the first update or once a seek has made it stale
+double clock_get(Clock *clock);
+
+// time is when pts was true, in seconds on av_gettime_relative()
+void clock_set_at(Clock *clock, double pts, int serial, double time);
+
+void clock_set(Clock *clock, double pts, int serial);
+
+void clock_set_speed(Clock *clock, double speed);
+
+// Freezes the clock at its current time, or lets it run on from there
+void clock_set_paused(Clock *clock, int paused);
+
+// Moves clock to slave when it has none yet or drifted more than CLOCK_NOSYNC_THRESHOLD away
+void clock_sync_to_slave(Clock *clock, Clock *slave);
+#endif //CLOCK_H
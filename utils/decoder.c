@@ -0,0 +1,108 @@
+//
+// Created by Deshy on 2025/06/11.
+//
+#include "decoder.h"
+
+#include "../libs/microlog/microlog.h"
+
+int decoder_init(Decoder *decoder, const char *name, AVCodecContext *codec_context, PacketQueue *packet_queue,
+                 StatsStage stats_stage) {
+    decoder->name = name;
+    decoder->codec_context = codec_context;
+    decoder->packet_queue = packet_queue;
+    decoder->stats_stage = stats_stage;
+    decoder->packet = av_packet_alloc();
+    decoder->packet_serial = -1;
+    decoder->packet_pending = 0;
+    decoder->finished = 0;
+    decoder->packets_in = 0;
+    decoder->frames_out = 0;
+    decoder->flushes = 0;
+
+    if (!decoder->packet) {
+        log_error("[%s] Could not allocate decoder packet", name);
+        return -1;
+    }
+    return 0;
+}
+
+int decoder_decode_frame(Decoder *decoder, AVFrame *frame) {
+    int ret;
+
+    while (true) {
+        // Pull out everything the decoder already has before feeding it more
+        if (atomic_load(&decoder->packet_queue->serial) == decoder->packet_serial) {
+            do {
+                int64_t begin = stats_begin();
+                ret = avcodec_receive_frame(decoder->codec_context, frame);
+                stats_end(decoder->stats_stage, begin);
+                if (ret >= 0) {
+                    decoder->frames_out++;
+                    return 1;
+                }
+                if (ret == AVERROR_EOF) {
+                    // Fully drained. Flushing resets the EOF state so packets after a seek decode again.
+                    decoder->finished = decoder->packet_serial;
+                    avcodec_flush_buffers(decoder->codec_context);
+                    log_info("[%s] Decoder drained: %lld packets in, %lld frames out", decoder->name,
+                             (long long) decoder->packets_in, (long long) decoder->frames_out);
+                    return 0;
+                }
+                if (ret != AVERROR(EAGAIN)) {
+                    log_error("[%s] Failed to receive frame: %s", decoder->name, av_err2str(ret));
+                }
+            } while (ret != AVERROR(EAGAIN));
+        }
+
+        do {
+            if (!decoder->packet_pending) {
+                int serial;
+                /** Empty after the last send, unless this loop is going round again because a seek made the packet
+                 * stale, refused one included. packet_queue_get() moves into it without unreferencing. **/
+                av_packet_unref(decoder->packet);
+                if (packet_queue_get(decoder->packet_queue, decoder->packet, 1, &serial) < 0) {
+                    return -1;
+                }
+                if (serial != decoder->packet_serial) {
+                    // First packet of a new seek generation, drop whatever the decoder still holds from before.
+                    // Done here rather than on the seeking thread so it never races with avcodec_send_packet().
+                    avcodec_flush_buffers(decoder->codec_context);
+                    decoder->packet_serial = serial;
+                    decoder->finished = 0;
+                    decoder->flushes++;
+                    log_info("[%s] Decoder flushed for serial %d", decoder->name, serial);
+                }
+            }
+            decoder->packet_pending = 0;
+        } while (atomic_load(&decoder->packet_queue->serial) != decoder->packet_serial);
+
+        // An empty packet is the demuxer's end of stream marker, sending NULL puts the decoder in draining mode
+        int64_t begin = stats_begin();
+        ret = avcodec_send_packet(decoder->codec_context, decoder->packet->data ? decoder->packet : NULL);
+        stats_end(decoder->stats_stage, begin);
+        if (ret == AVERROR(EAGAIN)) {
+            // Both directions full can't happen as we drained above, but keep the packet just in case
+            log_warn("[%s] Decoder refused packet, resending after receiving", decoder->name);
+            decoder->packet_pending = 1;
+        } else {
+            if (ret < 0 && ret != AVERROR_EOF) {
+                log_warn("[%s] Failed to send packet for decoding: %s", decoder->name, av_err2str(ret));
+            } else {
+                decoder->packets_in++;
+            }
+            av_packet_unref(decoder->packet);
+        }
+    }
+}
+
+void decoder_log_stats(Decoder *decoder) {
+    log_info("[%s] Decoder stats: %lld packets in, %lld frames out, %lld flushes", decoder->name,
+             (long long) decoder->packets_in, (long long) decoder->frames_out, (long long) decoder->flushes);
+}
+
+void decoder_destroy(Decoder *decoder) {
+    if (decoder->packet) {
+        decoder_log_stats(decoder);
+        av_packet_free(&decoder->packet);
+    }
+}
@@ -0,0 +1,41 @@
+//
+// Created by Deshy on 2025/06/11.
+//
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+#include "packet_queue.h"
+#include "stats.h"
+
+/** send/receive state machine shared by the audio and video decoders. Every frame a packet produces is handed out,
+ * a packet the decoder refuses with EAGAIN is kept and resent, and an empty packet from the demuxer drains the
+ * decoder at end of stream. **/
+typedef struct Decoder {
+    const char *name;
+    AVCodecContext *codec_context;
+    PacketQueue *packet_queue;
+    AVPacket *packet;
+    StatsStage stats_stage; // time spent inside the codec is charged here
+
+    int packet_serial; // serial of the packets being decoded, i.e. of the frames coming out
+    int packet_pending; // packet was refused with EAGAIN and has to be sent again
+    int finished; // serial that was fully drained, 0 while decoding
+
+    int64_t packets_in; // packets accepted by avcodec_send_packet, drain packets included
+    int64_t frames_out;
+    int64_t flushes;
+} Decoder;
+
+int decoder_init(Decoder *decoder, const char *name, AVCodecContext *codec_context, PacketQueue *packet_queue,
+                 StatsStage stats_stage);
+
+// 1 when frame was filled, 0 when the decoder was drained at end of stream, -1 when the queue was aborted
+int decoder_decode_frame(Decoder *decoder, AVFrame *frame);
+
+void decoder_log_stats(Decoder *decoder);
+
+void decoder_destroy(Decoder *decoder);
+#endif //DECODER_H
@@ -0,0 +1,104 @@
+//
+// Created by Deshy on 2025/06/19.
+//
+#include "demux_command.h"
+
+#include <string.h>
+#include <libavutil/avutil.h>
+
+#include "../libs/microlog/microlog.h"
+
+int demux_command_queue_init(DemuxCommandQueue *queue) {
+    memset(queue, 0, sizeof(DemuxCommandQueue));
+    atomic_init(&queue->pending, 0);
+    queue->seek_target = AV_NOPTS_VALUE;
+    queue->mutex = SDL_CreateMutex();
+    if (!queue->mutex) {
+        log_error("Could not create demux command mutex");
+        return -1;
+    }
+    return 0;
+}
+
+void demux_command_queue_destroy(DemuxCommandQueue *queue) {
+    if (queue->coalesced > 0) {
+        log_info("Demux commands: %lld seek requests coalesced", (long long) queue->coalesced);
+    }
+    if (queue->mutex) {
+        SDL_DestroyMutex(queue->mutex);
+        queue->mutex = NULL;
+    }
+}
+
+int demux_command_push(DemuxCommandQueue *queue, const DemuxCommand *command) {
+    int ret = 0;
+
+    SDL_LockMutex(queue->mutex);
+    DemuxCommand *last = queue->count > 0
+                             ? &queue->commands[(queue->head + queue->count - 1) % DEMUX_COMMAND_CAPACITY]
+                             : NULL;
+    if (command->type == DEMUX_COMMAND_SEEK && last && last->type == DEMUX_COMMAND_SEEK) {
+        // The demux thread hasn't got to the last one yet, go straight to the new target
+        log_info("Seek to %.3fs replaces the pending one to %.3fs", command->target / (double) AV_TIME_BASE,
+                 last->target / (double) AV_TIME_BASE);
+        last->target = command->target;
+        last->rel = command->rel;
+        last->flags = command->flags;
+        last->coalesced++;
+        queue->coalesced++;
+        ret = 1;
+    } else if (queue->count == DEMUX_COMMAND_CAPACITY) {
+        log_warn("Demux command queue full, dropping command %d", command->type);
+        ret = -1;
+    } else {
+        DemuxCommand *slot = &queue->commands[(queue->head + queue->count) % DEMUX_COMMAND_CAPACITY];
+        *slot = *command;
+        slot->coalesced = 1;
+        queue->count++;
+        atomic_fetch_add(&queue->pending, 1);
+    }
+
+    if (ret >= 0 && command->type == DEMUX_COMMAND_SEEK) {
+        queue->seek_active = 1;
+        queue->seek_target = command->target;
+    }
+    SDL_UnlockMutex(queue->mutex);
+    return ret;
+}
+
+int demux_command_pop(DemuxCommandQueue *queue, DemuxCommand *command) {
+    if (!demux_command_pending(queue)) {
+        return 0;
+    }
+
+    SDL_LockMutex(queue->mutex);
+    *command = queue->commands[queue->head];
+    queue->head = (queue->head + 1) % DEMUX_COMMAND_CAPACITY;
+    queue->count--;
+    atomic_fetch_sub(&queue->pending, 1);
+    SDL_UnlockMutex(queue->mutex);
+    return 1;
+}
+
+int64_t demux_command_seek_target(DemuxCommandQueue *queue) {
+    SDL_LockMutex(queue->mutex);
+    int64_t target = queue->seek_active ? queue->seek_target : AV_NOPTS_VALUE;
+    SDL_UnlockMutex(queue->mutex);
+    return target;
+}
+
+void demux_command_seek_done(DemuxCommandQueue *queue) {
+    SDL_LockMutex(queue->mutex);
+    // A newer seek may have been queued while this one ran, playback is still headed there
+    int seek_queued = 0;
+    for (int i = 0; i < queue->count; i++) {
+        if (queue->commands[(queue->head + i) % DEMUX_COMMAND_CAPACITY].type == DEMUX_COMMAND_SEEK) {
+            seek_queued = 1;
+        }
+    }
+    if (!seek_queued) {
+        queue->seek_active = 0;
+        queue->seek_target = AV_NOPTS_VALUE;
+    }
+    SDL_UnlockMutex(queue->mutex);
+}
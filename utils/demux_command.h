@@ -0,0 +1,62 @@
+//
+// Created by Deshy on 2025/06/19.
+//
+
+#ifndef DEMUX_COMMAND_H
+#define DEMUX_COMMAND_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <SDL_mutex.h>
+
+#define DEMUX_COMMAND_CAPACITY 16
+
+typedef enum DemuxCommandType {
+    DEMUX_COMMAND_SEEK,
+} DemuxCommandType;
+
+typedef struct DemuxCommand {
+    DemuxCommandType type;
+    int64_t target; // seek target in AV_TIME_BASE
+    int64_t rel; // how far the user asked to move, in AV_TIME_BASE
+    int flags; // AVSEEK_FLAG_*
+    int64_t issued_us; // av_gettime_relative() of the first request folded into this command
+    int coalesced; // requests folded into this command
+} DemuxCommand;
+
+/** Commands for the demux thread, which owns the AVFormatContext, so nothing else has to touch it while
+ * av_read_frame() may be running. A seek replaces a seek that is still waiting instead of queueing behind it, so a
+ * burst of key presses costs one seek to the latest target. **/
+typedef struct DemuxCommandQueue {
+    SDL_mutex *mutex;
+    DemuxCommand commands[DEMUX_COMMAND_CAPACITY];
+    int head;
+    int count;
+    atomic_int pending; // count, for a lock-free look from the demux loop
+
+    int seek_active; // a seek is queued or running, seek_target is where playback is headed
+    int64_t seek_target;
+    int64_t coalesced; // requests that never ran on their own
+} DemuxCommandQueue;
+
+int demux_command_queue_init(DemuxCommandQueue *queue);
+
+void demux_command_queue_destroy(DemuxCommandQueue *queue);
+
+// Queues a command. Returns 1 when it was folded into the seek already waiting, -1 when the queue is full.
+int demux_command_push(DemuxCommandQueue *queue, const DemuxCommand *command);
+
+// Takes the oldest command, returns 0 when there is none. Demux thread only.
+int demux_command_pop(DemuxCommandQueue *queue, DemuxCommand *command);
+
+static inline int demux_command_pending(DemuxCommandQueue *queue) {
+    return atomic_load(&queue->pending) > 0;
+}
+
+/** Where the last requested seek takes playback, AV_NOPTS_VALUE once it is done. Relative seeks start from here
+ * rather than from the clock, which doesn't move until the seek has run. **/
+int64_t demux_command_seek_target(DemuxCommandQueue *queue);
+
+// Demux thread, after it has run a seek it popped
+void demux_command_seek_done(DemuxCommandQueue *queue);
+#endif //DEMUX_COMMAND_H
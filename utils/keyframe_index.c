@@ -0,0 +1,217 @@
+//
+// Created by Deshy on 2025/06/14.
+//
+#include "keyframe_index.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <libavutil/time.h>
+
+#include "../libs/microlog/microlog.h"
+#include "trace.h"
+
+#define KEYFRAME_INDEX_INITIAL_CAPACITY 1024
+
+// Lets avformat give up on a blocking read once the player is shutting down
+static int interrupt_callback(void *opaque) {
+    KeyframeIndex *index = (KeyframeIndex *) opaque;
+    return atomic_load(&index->abort_request);
+}
+
+static int add_entry(KeyframeIndex *index, int64_t timestamp, int64_t pos) {
+    if (index->count == index->capacity) {
+        int capacity = index->capacity ? index->capacity * 2 : KEYFRAME_INDEX_INITIAL_CAPACITY;
+        KeyframeEntry *entries = av_realloc_array(index->entries, capacity, sizeof(KeyframeEntry));
+        if (!entries) {
+            return -1;
+        }
+        index->entries = entries;
+        index->capacity = capacity;
+    }
+    index->entries[index->count].timestamp = timestamp;
+    index->entries[index->count].pos = pos;
+    index->count++;
+    return 0;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    int64_t ta = ((const KeyframeEntry *) a)->timestamp;
+    int64_t tb = ((const KeyframeEntry *) b)->timestamp;
+    return (ta > tb) - (ta < tb);
+}
+
+/** Demuxes the whole file without decoding anything. Other streams are discarded and the indexed one is set to
+ * AVDISCARD_NONKEY, which lets demuxers that support it (Matroska, MPEG-TS) skip over non-key packets. **/
+static int keyframe_index_thread(void *userdata) {
+    KeyframeIndex *index = (KeyframeIndex *) userdata;
+    AVFormatContext *format_context = NULL;
+    AVPacket *packet = NULL;
+    int64_t begin = av_gettime_relative();
+    bool sorted = true;
+    int ret = 0;
+
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_LOW);
+    trace_thread_name("keyframe index");
+
+    format_context = avformat_alloc_context();
+    if (!format_context) {
+        log_error("Could not allocate keyframe index format context");
+        ret = -1;
+        goto cleanup;
+    }
+    format_context->interrupt_callback.callback = interrupt_callback;
+    format_context->interrupt_callback.opaque = index;
+
+    if (avformat_open_input(&format_context, index->url, NULL, NULL) < 0) {
+        log_error("Keyframe index could not open %s", index->url);
+        ret = -1;
+        goto cleanup;
+    }
+    if (avformat_find_stream_info(format_context, NULL) < 0 || index->stream_index >= format_context->nb_streams) {
+        log_error("Keyframe index could not find stream %d", index->stream_index);
+        ret = -1;
+        goto cleanup;
+    }
+    for (int i = 0; i < format_context->nb_streams; i++) {
+        format_context->streams[i]->discard = i == index->stream_index ? AVDISCARD_NONKEY : AVDISCARD_ALL;
+    }
+
+    packet = av_packet_alloc();
+    if (!packet) {
+        ret = -1;
+        goto cleanup;
+    }
+
+    while (!atomic_load(&index->abort_request)) {
+        ret = av_read_frame(format_context, packet);
+        if (ret < 0) {
+            ret = ret == AVERROR_EOF ? 0 : ret;
+            break;
+        }
+
+        int64_t timestamp = packet->pts != AV_NOPTS_VALUE ? packet->pts : packet->dts;
+        if (packet->stream_index == index->stream_index && (packet->flags & AV_PKT_FLAG_KEY) &&
+            timestamp != AV_NOPTS_VALUE) {
+            if (index->count && timestamp < index->entries[index->count - 1].timestamp) {
+                sorted = false;
+            }
+            if (add_entry(index, timestamp, packet->pos) < 0) {
+                log_error("Could not grow keyframe index");
+                ret = -1;
+            }
+        }
+        av_packet_unref(packet);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    if (ret < 0 || atomic_load(&index->abort_request)) {
+        log_warn("Keyframe index abandoned after %d keyframes, seeks keep using the demuxer", index->count);
+        ret = -1;
+        goto cleanup;
+    }
+    if (!sorted) {
+        qsort(index->entries, index->count, sizeof(KeyframeEntry), compare_entries);
+    }
+    if (index->count > 0) {
+        // Entries are written before the flag, lookups read the flag before the entries
+        atomic_store_explicit(&index->complete, 1, memory_order_release);
+    }
+    log_info("Keyframe index built: %d keyframes in %.1f ms", index->count,
+             (double) (av_gettime_relative() - begin) / 1000.0);
+
+cleanup:
+    av_packet_free(&packet);
+    avformat_close_input(&format_context);
+    return ret;
+}
+
+static void reset_index(KeyframeIndex *index, int stream_index, AVRational time_base) {
+    index->url = NULL;
+    index->stream_index = stream_index;
+    index->time_base = time_base;
+    index->entries = NULL;
+    index->count = 0;
+    index->capacity = 0;
+    index->thread = NULL;
+    atomic_init(&index->complete, 0);
+    atomic_init(&index->abort_request, 0);
+}
+
+int keyframe_index_start(KeyframeIndex *index, const char *url, int stream_index, AVRational time_base) {
+    reset_index(index, stream_index, time_base);
+
+    index->url = av_strdup(url);
+    if (!index->url) {
+        log_error("Could not copy url for the keyframe index");
+        return -1;
+    }
+
+    index->thread = SDL_CreateThread(keyframe_index_thread, "keyframe index", index);
+    if (!index->thread) {
+        log_error("Could not create keyframe index thread: %s", SDL_GetError());
+        return -1;
+    }
+    return 0;
+}
+
+int keyframe_index_load(KeyframeIndex *index, int stream_index, AVRational time_base, const KeyframeEntry *entries,
+                        int count) {
+    reset_index(index, stream_index, time_base);
+    if (count <= 0) {
+        return -1;
+    }
+
+    index->entries = av_malloc_array(count, sizeof(KeyframeEntry));
+    if (!index->entries) {
+        log_error("Could not allocate keyframe index");
+        return -1;
+    }
+    memcpy(index->entries, entries, count * sizeof(KeyframeEntry));
+    index->count = count;
+    index->capacity = count;
+    atomic_store_explicit(&index->complete, 1, memory_order_release);
+    log_info("Loaded keyframe index: %d keyframes", count);
+    return 0;
+}
+
+const KeyframeEntry *keyframe_index_lookup(KeyframeIndex *index, int64_t timestamp) {
+    if (!atomic_load_explicit(&index->complete, memory_order_acquire)) {
+        return NULL;
+    }
+
+    // Binary search for the last entry <= timestamp
+    int low = 0;
+    int high = index->count - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (index->entries[mid].timestamp <= timestamp) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return &index->entries[low];
+}
+
+const KeyframeEntry *keyframe_index_next(KeyframeIndex *index, const KeyframeEntry *keyframe) {
+    if (keyframe - index->entries + 1 >= index->count) {
+        return NULL;
+    }
+    return keyframe + 1;
+}
+
+void keyframe_index_destroy(KeyframeIndex *index) {
+    if (index->thread) {
+        atomic_store(&index->abort_request, 1);
+        SDL_WaitThread(index->thread, NULL);
+        index->thread = NULL;
+    }
+    av_freep(&index->entries);
+    av_freep(&index->url);
+    index->count = 0;
+    index->capacity = 0;
+    atomic_store(&index->complete, 0);
+}
@@ -0,0 +1,50 @@
+//
+// Created by Deshy on 2025/06/14.
+//
+
+#ifndef KEYFRAME_INDEX_H
+#define KEYFRAME_INDEX_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <SDL_thread.h>
+#include <libavformat/avformat.h>
+
+typedef struct KeyframeEntry {
+    int64_t timestamp; // in the stream's time_base
+    int64_t pos; // byte offset of the packet, -1 if the demuxer doesn't know it
+} KeyframeEntry;
+
+/** Every keyframe of one stream, collected by a low priority thread that demuxes the file through its own
+ * AVFormatContext so playback is never blocked. The entries may only be looked at once complete is set. **/
+typedef struct KeyframeIndex {
+    char *url;
+    int stream_index;
+    AVRational time_base;
+
+    KeyframeEntry *entries; // sorted by timestamp
+    int count;
+    int capacity;
+
+    atomic_int complete;
+    atomic_int abort_request;
+    SDL_Thread *thread;
+} KeyframeIndex;
+
+// Starts building the index for stream_index of url in the background
+int keyframe_index_start(KeyframeIndex *index, const char *url, int stream_index, AVRational time_base);
+
+// Fills a complete index from entries built earlier, e.g. the sidecar cache, without starting the builder
+int keyframe_index_load(KeyframeIndex *index, int stream_index, AVRational time_base, const KeyframeEntry *entries,
+                        int count);
+
+/** Last keyframe at or before timestamp (stream time_base), or the first one when timestamp is before all of them.
+ * NULL while the index is still being built or when it failed. **/
+const KeyframeEntry *keyframe_index_lookup(KeyframeIndex *index, int64_t timestamp);
+
+// Keyframe after one returned by keyframe_index_lookup(), NULL for the last one
+const KeyframeEntry *keyframe_index_next(KeyframeIndex *index, const KeyframeEntry *keyframe);
+
+// Stops the builder if it is still running and frees the index
+void keyframe_index_destroy(KeyframeIndex *index);
+#endif //KEYFRAME_INDEX_H
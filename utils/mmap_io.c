@@ -0,0 +1,133 @@
+//
+// Created by Deshy on 2025/06/16.
+//
+#include "mmap_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+
+#include "../libs/microlog/microlog.h"
+
+// Asks the kernel to start reading the next window once the read position gets halfway into the current one
+static void prefetch(MmapIO *io) {
+    if (io->pos + MMAP_IO_READAHEAD / 2 < io->advised_end || io->advised_end >= io->size) {
+        return;
+    }
+
+    long page_size = sysconf(_SC_PAGESIZE);
+    size_t start = (size_t) io->pos & ~((size_t) page_size - 1);
+    size_t end = FFMIN(start + MMAP_IO_READAHEAD, io->size);
+    madvise(io->data + start, end - start, MADV_WILLNEED);
+    io->advised_end = end;
+}
+
+static int mmap_io_read(void *opaque, uint8_t *buf, int buf_size) {
+    MmapIO *io = (MmapIO *) opaque;
+
+    if (io->pos >= (int64_t) io->size) {
+        return AVERROR_EOF;
+    }
+    int size = (int) FFMIN((int64_t) buf_size, (int64_t) io->size - io->pos);
+    memcpy(buf, io->data + io->pos, size);
+    io->pos += size;
+    prefetch(io);
+    return size;
+}
+
+static int64_t mmap_io_seek(void *opaque, int64_t offset, int whence) {
+    MmapIO *io = (MmapIO *) opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return (int64_t) io->size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = io->pos + offset;
+            break;
+        case SEEK_END:
+            pos = (int64_t) io->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > (int64_t) io->size) {
+        return AVERROR(EINVAL);
+    }
+
+    // A jump outside the prefetched window starts a new one from the landing position
+    if (pos < io->pos || (size_t) pos >= io->advised_end) {
+        io->advised_end = 0;
+    }
+    io->pos = pos;
+    prefetch(io);
+    return pos;
+}
+
+int mmap_io_open(MmapIO *io, const char *path) {
+    struct stat file_stat;
+    uint8_t *buffer = NULL;
+
+    memset(io, 0, sizeof(MmapIO));
+    io->fd = open(path, O_RDONLY);
+    if (io->fd < 0) {
+        log_error("Could not open %s for mapping: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(io->fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode) || file_stat.st_size == 0) {
+        log_warn("%s is not a regular file, can't map it", path);
+        goto fail;
+    }
+
+    io->size = file_stat.st_size;
+    io->data = mmap(NULL, io->size, PROT_READ, MAP_PRIVATE, io->fd, 0);
+    if (io->data == MAP_FAILED) {
+        log_error("Could not map %s: %s", path, strerror(errno));
+        io->data = NULL;
+        goto fail;
+    }
+    madvise(io->data, io->size, MADV_SEQUENTIAL);
+    prefetch(io);
+
+    buffer = av_malloc(MMAP_IO_BUFFER_SIZE);
+    if (!buffer) {
+        goto fail;
+    }
+    io->avio = avio_alloc_context(buffer, MMAP_IO_BUFFER_SIZE, 0, io, mmap_io_read, NULL, mmap_io_seek);
+    if (!io->avio) {
+        av_free(buffer);
+        goto fail;
+    }
+    // Reads go straight from the mapping into the caller's buffer, so packet payloads are copied once instead of
+    // through the AVIO buffer, and seeks cost nothing
+    io->avio->direct = 1;
+    log_info("Mapped %s: %zu bytes", path, io->size);
+    return 0;
+
+fail:
+    mmap_io_close(io);
+    return -1;
+}
+
+void mmap_io_close(MmapIO *io) {
+    if (io->avio) {
+        av_freep(&io->avio->buffer);
+        avio_context_free(&io->avio);
+    }
+    if (io->data) {
+        munmap(io->data, io->size);
+        io->data = NULL;
+    }
+    if (io->fd >= 0) {
+        close(io->fd);
+    }
+    io->fd = -1;
+}
@@ -0,0 +1,32 @@
+//
+// Created by Deshy on 2025/06/16.
+//
+
+#ifndef MMAP_IO_H
+#define MMAP_IO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libavformat/avio.h>
+
+#define MMAP_IO_BUFFER_SIZE 32768 // AVIO buffer for the demuxer's small header reads, packets bypass it
+#define MMAP_IO_READAHEAD (8 * 1024 * 1024) // bytes ahead of the read position the kernel is asked to fetch
+
+/** Local file mapped into memory and handed to the demuxer as an AVIOContext. Reads are a memcpy out of the mapping
+ * instead of a read() syscall, and the page cache is told to prefetch ahead of the read position. Truncating the file
+ * while it is mapped would fault, so this is only for files that stay put while they play. **/
+typedef struct MmapIO {
+    int fd;
+    uint8_t *data;
+    size_t size;
+    int64_t pos;
+    size_t advised_end; // prefetch has been requested up to here
+    AVIOContext *avio;
+} MmapIO;
+
+// Maps path and sets up io->avio for AVFormatContext.pb (remember AVFMT_FLAG_CUSTOM_IO)
+int mmap_io_open(MmapIO *io, const char *path);
+
+// Call after avformat_close_input(), which leaves custom AVIOContexts alone
+void mmap_io_close(MmapIO *io);
+#endif //MMAP_IO_H
@@ -10,45 +10,154 @@
 #include <stdbool.h>
 #include "../audio/audio.h"
 #include "../video/video.h"
+#include "trace.h"
 
-#define MAX_AUDIO_QUEUE_SIZE (10 * 1024 * 1024)
-#define MAX_VIDEO_QUEUE_SIZE (5 * 256 * 1024)
+// Hard memory cap across both queues, the time based limits in PlayerOptions do the real work
+#define MAX_QUEUE_SIZE (64 * 1024 * 1024)
+// Safety nets only, consumers and seeks post the read wakeup
+#define FULL_WAIT_TIMEOUT_MS 1000
+#define EOF_WAIT_TIMEOUT_MS 500
 
 
+static void wake(PacketQueue *queue, atomic_int *waiting, SDL_cond *cond) {
+    // Pairs with the fence in the sleeping side: either it sees our update or we see its waiting flag
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(waiting)) {
+        SDL_LockMutex(queue->mutex);
+        SDL_CondSignal(cond);
+        SDL_UnlockMutex(queue->mutex);
+    }
+}
+
+static int64_t packet_timestamp(AVPacket *pkt) {
+    return pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+}
+
+static void release_packet(PacketQueue *queue, AVPacket *pkt) {
+    atomic_fetch_sub(&queue->nb_packets, 1);
+    atomic_fetch_sub(&queue->size, pkt->size);
+    atomic_fetch_sub(&queue->duration, pkt->duration);
+    if (packet_timestamp(pkt) != AV_NOPTS_VALUE) {
+        atomic_store(&queue->last_get_pts, packet_timestamp(pkt));
+    }
+    wake(queue, &queue->producer_waiting, queue->space_cond);
+
+    ReadWakeup *read_wakeup = queue->read_wakeup;
+    if (read_wakeup && atomic_load(&read_wakeup->waiting) &&
+        packet_queue_duration(queue) < queue->low_water_duration) {
+        // Only the first consumer below the mark gets to post, the demux thread needs one wakeup
+        if (atomic_exchange(&read_wakeup->waiting, 0)) {
+            SDL_SemPost(read_wakeup->sem);
+        }
+    }
+}
+
+/** Seconds of data buffered. Packet durations are summed where the container provides them, otherwise we fall back to
+ * the timestamp span between the newest queued and the last dequeued packet. **/
+double packet_queue_duration(PacketQueue *queue) {
+    if (atomic_load(&queue->nb_packets) <= 0) {
+        return 0.0;
+    }
+
+    int64_t duration = atomic_load(&queue->duration);
+    int64_t last_put = atomic_load(&queue->last_put_pts);
+    int64_t last_get = atomic_load(&queue->last_get_pts);
+
+    if (last_put != AV_NOPTS_VALUE && last_get != AV_NOPTS_VALUE && last_put - last_get > duration) {
+        duration = last_put - last_get;
+    }
+    if (duration < 0) {
+        duration = 0;
+    }
+    return duration * av_q2d(queue->time_base);
+}
+
+void packet_queue_set_read_wakeup(PacketQueue *queue, ReadWakeup *read_wakeup, double low_water_duration) {
+    queue->read_wakeup = read_wakeup;
+    queue->low_water_duration = low_water_duration;
+}
+
 int packet_queue_put(PacketQueue *queue, AVPacket *packet) {
-    AVPacket *pkt_copy = av_packet_alloc();
+    AVPacket *pkt_copy = object_pool_get(&queue->packet_pool);
 
     if (!pkt_copy) {
         log_error("[%s]Failed to allocate packet copy", queue->name);
         return -1;
     }
 
-    if (av_packet_ref(pkt_copy, packet) < 0) {
-        av_packet_free(&pkt_copy);
-        return -1;
-    }
+    // Moving the reference instead of av_packet_ref() saves allocating a new AVBufferRef per packet
+    av_packet_move_ref(pkt_copy, packet);
+    QueuedPacket entry = {pkt_copy, atomic_load(&queue->serial)};
 
-    SDL_LockMutex(queue->mutex);
+    // Account before publishing so the consumer never sees the counters go negative
+    atomic_fetch_add(&queue->nb_packets, 1);
+    atomic_fetch_add(&queue->size, pkt_copy->size);
+    atomic_fetch_add(&queue->duration, pkt_copy->duration);
+    if (packet_timestamp(pkt_copy) != AV_NOPTS_VALUE) {
+        atomic_store(&queue->last_put_pts, packet_timestamp(pkt_copy));
+    }
 
-    av_fifo_write(queue->packet_fifo, &pkt_copy, 1);
-    queue->nb_packets++;
-    queue->size += pkt_copy->size;
+    int stalled = 0;
+    while (!spsc_ring_push(&queue->packet_ring, &entry)) {
+        if (atomic_load(&queue->abort_request)) {
+            atomic_fetch_sub(&queue->nb_packets, 1);
+            atomic_fetch_sub(&queue->size, pkt_copy->size);
+            atomic_fetch_sub(&queue->duration, pkt_copy->duration);
+            av_packet_free(&pkt_copy); // can't go back to the pool from the producer side
+            return -1;
+        }
+        if (!stalled) {
+            // Plain backpressure while the demuxer is ahead, once per stall rather than per wakeup
+            log_debug("[%s] Packet ring full, waiting for space", queue->name);
+            stalled = 1;
+        }
+        SDL_LockMutex(queue->mutex);
+        atomic_store(&queue->producer_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (spsc_ring_size(&queue->packet_ring) == queue->packet_ring.capacity &&
+            !atomic_load(&queue->abort_request)) {
+            SDL_CondWaitTimeout(queue->space_cond, queue->mutex, 100);
+        }
+        atomic_store(&queue->producer_waiting, 0);
+        SDL_UnlockMutex(queue->mutex);
+    }
 
-    SDL_CondSignal(queue->cond); // Wake up packet_queue_get()
-    SDL_UnlockMutex(queue->mutex);
-    log_info("[%s] Packet queued: %d packets, size: %d", queue->name, queue->nb_packets, queue->size);
+    wake(queue, &queue->consumer_waiting, queue->cond); // Wake up packet_queue_get()
+    log_info("[%s] Packet queued: %d packets, size: %d", queue->name, atomic_load(&queue->nb_packets),
+             atomic_load(&queue->size));
     return 0;
 }
 
-int packet_queue_init(PacketQueue *queue, char *name) {
-    queue->packet_fifo = av_fifo_alloc2(32, sizeof(AVPacket *), AV_FIFO_FLAG_AUTO_GROW);
+int packet_queue_init(PacketQueue *queue, char *name, AVRational time_base) {
+    if (spsc_ring_init(&queue->packet_ring, PACKET_QUEUE_CAPACITY, sizeof(QueuedPacket)) < 0) {
+        log_error("Failed to create %s packet ring", name);
+        return -1;
+    }
+    // Never more packets out than fit in the ring, plus the one the producer is holding
+    if (packet_pool_init(&queue->packet_pool, name, PACKET_QUEUE_CAPACITY + 1) < 0) {
+        return -1;
+    }
+    atomic_init(&queue->nb_packets, 0);
+    atomic_init(&queue->size, 0);
+    atomic_init(&queue->duration, 0);
+    atomic_init(&queue->last_put_pts, AV_NOPTS_VALUE);
+    atomic_init(&queue->last_get_pts, AV_NOPTS_VALUE);
+    queue->time_base = time_base;
+    queue->read_wakeup = NULL;
+    queue->low_water_duration = 0;
+    atomic_init(&queue->serial, 0);
+    atomic_init(&queue->abort_request, 0);
+    atomic_init(&queue->consumer_waiting, 0);
+    atomic_init(&queue->producer_waiting, 0);
+
     queue->mutex = SDL_CreateMutex();
     if (!queue->mutex) {
         log_error("Failed to create %s mutex: %s", name, SDL_GetError());
         return -1;
     }
     queue->cond = SDL_CreateCond();
-    if (!queue->cond) {
+    queue->space_cond = SDL_CreateCond();
+    if (!queue->cond || !queue->space_cond) {
         log_error("Failed to create %s condition variable: %s", name, SDL_GetError());
         return -1;
     }
@@ -57,96 +166,219 @@ int packet_queue_init(PacketQueue *queue, char *name) {
     return 0;
 }
 
-int packet_queue_get(PacketQueue *queue, AVPacket *packet, int block) {
-    AVPacket *pkt = av_packet_alloc();
+int packet_queue_get(PacketQueue *queue, AVPacket *packet, int block, int *serial) {
+    QueuedPacket entry;
     int ret = 0;
 
-    SDL_LockMutex(queue->mutex);
-    log_debug("[%s] Locked packet queue mutex, waiting for packet...", queue->name);
     while (true) {
-        if (av_fifo_read(queue->packet_fifo, &pkt, 1) >= 0) {
+        if (atomic_load(&queue->abort_request)) {
+            ret = -1;
+            break;
+        }
+
+        if (spsc_ring_pop(&queue->packet_ring, &entry)) {
+            release_packet(queue, entry.packet);
+            if (entry.serial != atomic_load(&queue->serial)) {
+                // Queued before the last flush, nobody wants it anymore
+                object_pool_put(&queue->packet_pool, entry.packet);
+                continue;
+            }
             log_debug("[%s] Got packet from queue", queue->name);
-            queue->nb_packets--;
-            queue->size -= pkt->size;
-            av_packet_move_ref(packet, pkt);
-            av_packet_free(&pkt);
+            av_packet_move_ref(packet, entry.packet);
+            object_pool_put(&queue->packet_pool, entry.packet);
+            if (serial) {
+                *serial = entry.serial;
+            }
             ret = 1;
             break;
         } else if (!block) {
             log_debug("[%s] No packet available and not blocking", queue->name);
             ret = 0;
             break;
-        } else {
-            log_warn("[%s] Waiting for packet in queue...", queue->name);
+        }
+
+        // Only now, with the ring empty, do we fall back to sleeping on the condition
+        log_warn("[%s] Waiting for packet in queue...", queue->name);
+        SDL_LockMutex(queue->mutex);
+        atomic_store(&queue->consumer_waiting, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (spsc_ring_size(&queue->packet_ring) == 0 && !atomic_load(&queue->abort_request)) {
             SDL_CondWait(queue->cond, queue->mutex);
         }
+        atomic_store(&queue->consumer_waiting, 0);
+        SDL_UnlockMutex(queue->mutex);
     }
-    SDL_UnlockMutex(queue->mutex);
-    log_info("[%s] Packet dequeued: %d packets, size: %d", queue->name, queue->nb_packets, queue->size);
+    log_info("[%s] Packet dequeued: %d packets, size: %d", queue->name, atomic_load(&queue->nb_packets),
+             atomic_load(&queue->size));
     return ret;
 }
 
+/** Called from outside the consumer thread (seeks), so it can't pop the ring itself. Starting a new serial makes every
+ * packet already queued stale, the consumer drops those as it reaches them. **/
 void packet_queue_flush(PacketQueue *queue) {
-    SDL_LockMutex(queue->mutex);
+    atomic_fetch_add(&queue->serial, 1);
+    // Timestamps from before the seek would make the span look huge until the consumer catches up
+    atomic_store(&queue->last_get_pts, AV_NOPTS_VALUE);
+    log_info("[%s] Packet queue flushed", queue->name);
+}
 
-    AVPacket *pkt;
-    while (av_fifo_read(queue->packet_fifo, &pkt, 1) >= 0) {
-        av_packet_free(&pkt);
-    }
-    queue->nb_packets = 0;
-    queue->size = 0;
+void packet_queue_abort(PacketQueue *queue) {
+    atomic_store(&queue->abort_request, 1);
+    SDL_LockMutex(queue->mutex);
+    SDL_CondSignal(queue->cond);
+    SDL_CondSignal(queue->space_cond);
     SDL_UnlockMutex(queue->mutex);
-    log_info("[%s] Packet queue flushed", queue->name);
 }
 
 void packet_queue_destroy(PacketQueue *queue) {
-    packet_queue_flush(queue);
-    if (queue->packet_fifo) {
-        av_fifo_freep2(&queue->packet_fifo);
+    // No consumer left at this point, drain the ring directly
+    QueuedPacket entry;
+    while (spsc_ring_pop(&queue->packet_ring, &entry)) {
+        av_packet_free(&entry.packet);
     }
+    spsc_ring_destroy(&queue->packet_ring);
+    object_pool_destroy(&queue->packet_pool);
     if (queue->mutex) {
         SDL_DestroyMutex(queue->mutex);
     }
     if (queue->cond) {
         SDL_DestroyCond(queue->cond);
     }
+    if (queue->space_cond) {
+        SDL_DestroyCond(queue->space_cond);
+    }
 
     free(queue);
 }
 
+static bool queue_has_enough_packets(PacketQueue *queue, double max_duration) {
+    return packet_queue_duration(queue) >= max_duration;
+}
+
+// Keep reading while either stream is short, otherwise the starving one would stall playback
+static bool queues_full(PlayerState *player_state) {
+    PacketQueue *audio_queue = player_state->audio_packet_queue;
+    PacketQueue *video_queue = player_state->video_packet_queue;
+
+    return atomic_load(&audio_queue->size) + atomic_load(&video_queue->size) > MAX_QUEUE_SIZE ||
+           (queue_has_enough_packets(audio_queue, player_state->options.max_buffer_duration) &&
+            queue_has_enough_packets(video_queue, player_state->options.max_buffer_duration +
+                                                  player_state->video_state->decoder_delay));
+}
+
+// Sleep until a consumer drains below its low-water mark, a seek happens or the timeout runs out
+static void wait_for_read_wakeup(PlayerState *player_state, Uint32 timeout_ms, bool recheck_full) {
+    ReadWakeup *read_wakeup = &player_state->read_wakeup;
+
+    atomic_store(&read_wakeup->waiting, 1);
+    // The consumers may have drained between our check and raising the flag, look once more before sleeping
+    if (!recheck_full || queues_full(player_state)) {
+        SDL_SemWaitTimeout(read_wakeup->sem, timeout_ms);
+    }
+    atomic_store(&read_wakeup->waiting, 0);
+}
+
+/** Pauses the demuxer (network protocols stop streaming) and sleeps while playback is paused, but still wakes up for
+ * commands so seeking while paused works. **/
+static void wait_while_paused(PlayerState *player_state, int *read_paused) {
+    if (player_state->paused != *read_paused) {
+        *read_paused = player_state->paused;
+        if (*read_paused) {
+            av_read_pause(player_state->format_context);
+        } else {
+            av_read_play(player_state->format_context);
+        }
+    }
+
+    SDL_LockMutex(player_state->pause_mutex);
+    while (player_state->paused && !*player_state->quit && !demux_command_pending(&player_state->demux_commands)) {
+        SDL_CondWait(player_state->pause_cond, player_state->pause_mutex);
+    }
+    SDL_UnlockMutex(player_state->pause_mutex);
+}
+
+// Commands are only run between av_read_frame() calls, nothing else touches the format context
+static void run_demux_commands(PlayerState *player_state) {
+    DemuxCommand command;
+
+    while (demux_command_pop(&player_state->demux_commands, &command)) {
+        switch (command.type) {
+            case DEMUX_COMMAND_SEEK:
+                player_execute_seek(player_state, &command);
+                break;
+        }
+    }
+}
+
+// Packet timestamp in seconds, NAN when it has none
+static double packet_seconds(AVFormatContext *format_context, AVPacket *packet) {
+    int64_t timestamp = packet_timestamp(packet);
+    if (timestamp == AV_NOPTS_VALUE) {
+        return NAN;
+    }
+    return timestamp * av_q2d(format_context->streams[packet->stream_index]->time_base);
+}
+
 int packet_queueing_thread(void *userdata) {
     PlayerState *player_state = (PlayerState *) userdata;
+    PacketQueue *audio_queue = player_state->audio_packet_queue;
+    PacketQueue *video_queue = player_state->video_packet_queue;
     AVPacket *packet = av_packet_alloc();
+    int drained_serial = -1; // serial the end of stream drain packets were already sent for
+    int read_paused = 0;
 
+    trace_thread_name("demux");
     while (true) {
-        wait_if_paused();
+        wait_while_paused(player_state, &read_paused);
 
         if (*player_state->quit) {
             log_warn("Player quit, exiting packet queueing thread");
             break;
         }
 
-        if (player_state->audio_packet_queue->size > MAX_AUDIO_QUEUE_SIZE ||
-            player_state->video_packet_queue->size > MAX_VIDEO_QUEUE_SIZE) {
-            SDL_Delay(10);
+        run_demux_commands(player_state);
+
+        if (queues_full(player_state)) {
+            log_debug("Queues full (audio %.2fs, video %.2fs), waiting for consumers",
+                      packet_queue_duration(audio_queue), packet_queue_duration(video_queue));
+            wait_for_read_wakeup(player_state, FULL_WAIT_TIMEOUT_MS, true);
             continue;
         }
 
-        if (av_read_frame(player_state->format_context, packet) < 0) {
+        int64_t trace = trace_begin();
+        int64_t read_begin = stats_begin();
+        int read_ret = av_read_frame(player_state->format_context, packet);
+        stats_end(STATS_DEMUX, read_begin);
+        if (read_ret < 0) {
+            trace_end("demux", trace, NAN);
             if (player_state->format_context->pb->error == 0) {
-                SDL_Delay(100);
+                // EOF. An empty packet tells each decoder to drain the frames it still holds, once per seek
+                // generation so a seek that lands at the end again drains again.
+                int serial = atomic_load(&video_queue->serial);
+                if (serial != drained_serial) {
+                    av_packet_unref(packet);
+                    packet_queue_put(video_queue, packet);
+                    packet_queue_put(audio_queue, packet);
+                    drained_serial = serial;
+                    log_info("End of stream, sent drain packets for serial %d", serial);
+                }
+                // Nothing more to do until a seek
+                wait_for_read_wakeup(player_state, EOF_WAIT_TIMEOUT_MS, false);
                 continue;
             } else {
                 break;
             }
         }
         log_debug("Read packet: stream_index=%d, size=%d", packet->stream_index, packet->size);
+        trace_end("demux", trace, packet_seconds(player_state->format_context, packet));
 
         if (packet->stream_index == player_state->video_state->stream_index) {
-            packet_queue_put(player_state->video_packet_queue, packet);
+            packet_queue_put(video_queue, packet);
+            trace_counter("video_queue_s", packet_queue_duration(video_queue));
             log_info("Added video packet to video queue");
         } else if (packet->stream_index == player_state->audio_state->stream_index) {
-            packet_queue_put(player_state->audio_packet_queue, packet);
+            packet_queue_put(audio_queue, packet);
+            trace_counter("audio_queue_s", packet_queue_duration(audio_queue));
             log_info("Added audio packet to audio queue");
         }
         av_packet_unref(packet);
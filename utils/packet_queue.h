@@ -6,22 +6,60 @@
 #define PACKET_QUEUE_H
 
 #include <SDL_mutex.h>
+#include <SDL_thread.h>
 #include <libavcodec/avcodec.h>
-#include <libavutil/fifo.h>
+#include <stdatomic.h>
+#include "pool.h"
+#include "spsc_ring.h"
 
+#define PACKET_QUEUE_CAPACITY 16384
+
+/** Lets consumers wake the demux thread once they drain below the low-water mark. A semaphore rather than a condition
+ * so the audio callback never has to take a mutex to post it. **/
+typedef struct ReadWakeup {
+    SDL_sem *sem;
+    atomic_int waiting; // demux thread is asleep on sem
+} ReadWakeup;
+
+typedef struct QueuedPacket {
+    AVPacket *packet;
+    int serial; // queue serial when the packet was put
+} QueuedPacket;
+
+/** Each queue has exactly one producer (packet_queueing_thread) and one consumer (video thread / audio callback), so
+ * packets go through a lock-free ring. The mutex and conditions are only touched when one side has to sleep. **/
 typedef struct PacketQueue {
     char *name;
-    AVFifo *packet_fifo;
-    int nb_packets;
-    int size; // total size of packets in bytes
+    SpscRing packet_ring; // holds QueuedPacket
+    ObjectPool packet_pool; // consumer returns packets here, producer borrows them back
+    atomic_int nb_packets;
+    atomic_int size; // total size of packets in bytes
+    AVRational time_base;
+    atomic_int_fast64_t duration; // sum of packet durations in time_base
+    atomic_int_fast64_t last_put_pts;
+    atomic_int_fast64_t last_get_pts;
+
+    ReadWakeup *read_wakeup;
+    double low_water_duration; // seconds
+    atomic_int serial; // seek generation, bumped by every flush
+    atomic_int abort_request;
+
+    atomic_int consumer_waiting;
+    atomic_int producer_waiting;
     SDL_mutex *mutex;
-    SDL_cond *cond;
+    SDL_cond *cond; // signalled when a packet arrives
+    SDL_cond *space_cond; // signalled when a full ring gets space back
 } PacketQueue;
 
-int packet_queue_init(PacketQueue *queue, char *name);
+int packet_queue_init(PacketQueue *queue, char *name, AVRational time_base);
+void packet_queue_set_read_wakeup(PacketQueue *queue, ReadWakeup *read_wakeup, double low_water_duration);
+double packet_queue_duration(PacketQueue *queue);
 void packet_queue_destroy(PacketQueue *queue);
 void packet_queue_flush(PacketQueue *queue);
+void packet_queue_abort(PacketQueue *queue);
+// Takes over the packet's data, the caller is left with a blank packet
 int packet_queue_put(PacketQueue *queue, AVPacket *packet);
-int packet_queue_get(PacketQueue *queue, AVPacket *packet, int block);
+// serial (optional) receives the seek generation the packet belongs to
+int packet_queue_get(PacketQueue *queue, AVPacket *packet, int block, int *serial);
 int packet_queueing_thread(void *userdata);
 #endif //PACKET_QUEUE_H
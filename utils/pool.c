@@ -0,0 +1,128 @@
+//
+// Created by Deshy on 2025/06/04.
+//
+#include "pool.h"
+
+#include "../libs/microlog/microlog.h"
+
+static void *packet_alloc(void) {
+    return av_packet_alloc();
+}
+
+static void packet_reset(void *object) {
+    av_packet_unref(object);
+}
+
+static void packet_free(void *object) {
+    AVPacket *packet = object;
+    av_packet_free(&packet);
+}
+
+static void *frame_alloc(void) {
+    return av_frame_alloc();
+}
+
+static void frame_reset(void *object) {
+    av_frame_unref(object);
+}
+
+static void frame_free(void *object) {
+    AVFrame *frame = object;
+    av_frame_free(&frame);
+}
+
+static int object_pool_init(ObjectPool *pool, const char *name, size_t capacity) {
+    pool->name = name;
+    atomic_init(&pool->hits, 0);
+    atomic_init(&pool->misses, 0);
+    atomic_init(&pool->outstanding, 0);
+    atomic_init(&pool->peak_outstanding, 0);
+
+    if (spsc_ring_init(&pool->free_ring, capacity, sizeof(void *)) < 0) {
+        log_error("[%s] Could not create pool free list", name);
+        return -1;
+    }
+    log_info("[%s] Pool initialized with %zu slots", name, pool->free_ring.capacity);
+    return 0;
+}
+
+int packet_pool_init(ObjectPool *pool, const char *name, size_t capacity) {
+    pool->alloc_object = packet_alloc;
+    pool->reset_object = packet_reset;
+    pool->free_object = packet_free;
+    return object_pool_init(pool, name, capacity);
+}
+
+int frame_pool_init(ObjectPool *pool, const char *name, size_t capacity) {
+    pool->alloc_object = frame_alloc;
+    pool->reset_object = frame_reset;
+    pool->free_object = frame_free;
+    return object_pool_init(pool, name, capacity);
+}
+
+void *object_pool_get(ObjectPool *pool) {
+    void *object;
+
+    if (spsc_ring_pop(&pool->free_ring, &object)) {
+        atomic_fetch_add_explicit(&pool->hits, 1, memory_order_relaxed);
+    } else {
+        object = pool->alloc_object();
+        if (!object) {
+            log_error("[%s] Pool allocation failed", pool->name);
+            return NULL;
+        }
+        atomic_fetch_add_explicit(&pool->misses, 1, memory_order_relaxed);
+    }
+
+    int outstanding = atomic_fetch_add_explicit(&pool->outstanding, 1, memory_order_relaxed) + 1;
+    int peak = atomic_load_explicit(&pool->peak_outstanding, memory_order_relaxed);
+    while (outstanding > peak &&
+           !atomic_compare_exchange_weak_explicit(&pool->peak_outstanding, &peak, outstanding,
+                                                  memory_order_relaxed, memory_order_relaxed)) {
+    }
+    return object;
+}
+
+void object_pool_put(ObjectPool *pool, void *object) {
+    if (!object) {
+        return;
+    }
+    pool->reset_object(object);
+    atomic_fetch_sub_explicit(&pool->outstanding, 1, memory_order_relaxed);
+
+    if (!spsc_ring_push(&pool->free_ring, &object)) {
+        // Free list is full, more objects are out than we ever expect to recycle
+        pool->free_object(object);
+    }
+}
+
+void object_pool_get_stats(ObjectPool *pool, PoolStats *stats) {
+    stats->hits = atomic_load_explicit(&pool->hits, memory_order_relaxed);
+    stats->misses = atomic_load_explicit(&pool->misses, memory_order_relaxed);
+    stats->outstanding = atomic_load_explicit(&pool->outstanding, memory_order_relaxed);
+    stats->peak_outstanding = atomic_load_explicit(&pool->peak_outstanding, memory_order_relaxed);
+}
+
+void object_pool_log_stats(ObjectPool *pool) {
+    PoolStats stats;
+    object_pool_get_stats(pool, &stats);
+    log_info("[%s] Pool stats: hits=%llu, misses=%llu, outstanding=%d, peak=%d",
+             pool->name,
+             (unsigned long long) stats.hits,
+             (unsigned long long) stats.misses,
+             stats.outstanding,
+             stats.peak_outstanding);
+}
+
+void object_pool_destroy(ObjectPool *pool) {
+    void *object;
+
+    if (!pool->free_ring.buffer) {
+        return;
+    }
+    object_pool_log_stats(pool);
+    while (spsc_ring_pop(&pool->free_ring, &object)) {
+        pool->free_object(object);
+    }
+    spsc_ring_destroy(&pool->free_ring);
+}
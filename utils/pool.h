@@ -0,0 +1,49 @@
+//
+// Created by Deshy on 2025/06/04.
+//
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <libavcodec/avcodec.h>
+#include "spsc_ring.h"
+
+typedef struct PoolStats {
+    uint64_t hits; // served from the free list
+    uint64_t misses; // had to hit the heap
+    int outstanding;
+    int peak_outstanding;
+} PoolStats;
+
+/** Recycles AVPackets/AVFrames so the playback hot path does no allocation once it has warmed up. One thread borrows
+ * and one thread returns (possibly the same one), which lets the free list be an SpscRing. **/
+typedef struct ObjectPool {
+    const char *name;
+    SpscRing free_ring;
+
+    void *(*alloc_object)(void);
+    void (*reset_object)(void *object);
+    void (*free_object)(void *object);
+
+    atomic_uint_fast64_t hits;
+    atomic_uint_fast64_t misses;
+    atomic_int outstanding;
+    atomic_int peak_outstanding;
+} ObjectPool;
+
+int packet_pool_init(ObjectPool *pool, const char *name, size_t capacity);
+
+int frame_pool_init(ObjectPool *pool, const char *name, size_t capacity);
+
+void *object_pool_get(ObjectPool *pool);
+
+void object_pool_put(ObjectPool *pool, void *object);
+
+void object_pool_get_stats(ObjectPool *pool, PoolStats *stats);
+
+void object_pool_log_stats(ObjectPool *pool);
+
+void object_pool_destroy(ObjectPool *pool);
+#endif //POOL_H
@@ -0,0 +1,454 @@
+//
+// Created by Deshy on 2025/06/17.
+//
+#include "readahead_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libavutil/common.h>
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+#include "../libs/microlog/microlog.h"
+#include "trace.h"
+
+#define SLOT_COUNT (READAHEAD_MAX_DEPTH + 1)
+
+static int expected_length(ReadAheadIO *io, int64_t block) {
+    return (int) FFMIN((int64_t) READAHEAD_BLOCK_SIZE, io->size - block * READAHEAD_BLOCK_SIZE);
+}
+
+// pread until length bytes are in, starting after the done bytes a previous read already got
+static int read_fully(int fd, uint8_t *buffer, int length, int64_t offset, int done) {
+    while (done < length) {
+        ssize_t ret = pread(fd, buffer + done, length - done, offset + done);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0) {
+            return AVERROR(errno);
+        }
+        if (ret == 0) {
+            break; // file got shorter under us
+        }
+        done += (int) ret;
+    }
+    return done;
+}
+
+// Publishes a finished read, mutex held
+static void complete_slot(ReadAheadIO *io, ReadSlot *slot, int result) {
+    int64_t latency = av_gettime_relative() - slot->submit_us;
+
+    if (result < 0) {
+        slot->state = READ_SLOT_FAILED;
+        slot->error = result;
+        log_warn("Read-ahead of block %lld failed: %s", (long long) slot->block, av_err2str(result));
+    } else {
+        slot->state = READ_SLOT_READY;
+        slot->length = result;
+        io->stats.reads++;
+        io->stats.bytes_read += result;
+        io->stats.latency_total_us += latency;
+        io->stats.latency_max_us = FFMAX(io->stats.latency_max_us, latency);
+    }
+    io->in_flight--;
+    SDL_CondBroadcast(io->done_cond);
+}
+
+#ifdef HAVE_LIBURING
+// Takes one completion off the ring, mutex not held
+static void handle_completion(ReadAheadIO *io, struct io_uring_cqe *cqe) {
+    ReadSlot *slot = io_uring_cqe_get_data(cqe);
+    int result = cqe->res;
+    io_uring_cqe_seen(&io->ring, cqe);
+
+    // Regular files only come back short at the end, but finish the block synchronously if one doesn't
+    int expected = expected_length(io, slot->block);
+    if (result >= 0 && result < expected) {
+        result = read_fully(io->fd, slot->buffer, expected, slot->block * READAHEAD_BLOCK_SIZE, result);
+    }
+
+    SDL_LockMutex(io->mutex);
+    complete_slot(io, slot, result);
+    SDL_UnlockMutex(io->mutex);
+}
+
+static void reap_completions(ReadAheadIO *io) {
+    struct io_uring_cqe *cqe;
+    while (io_uring_peek_cqe(&io->ring, &cqe) == 0) {
+        handle_completion(io, cqe);
+    }
+}
+#endif
+
+// Starts reading slot->block, mutex held
+static void submit_slot(ReadAheadIO *io, ReadSlot *slot) {
+    slot->state = READ_SLOT_IN_FLIGHT;
+    slot->submit_us = av_gettime_relative();
+    io->in_flight++;
+
+    if (!slot->buffer) {
+        slot->buffer = av_malloc(READAHEAD_BLOCK_SIZE);
+        if (!slot->buffer) {
+            complete_slot(io, slot, AVERROR(ENOMEM));
+            return;
+        }
+    }
+
+#ifdef HAVE_LIBURING
+    if (io->use_uring) {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+        if (!sqe) {
+            // The ring is sized for every slot, so this can't really happen
+            complete_slot(io, slot, AVERROR(EAGAIN));
+            return;
+        }
+        io_uring_prep_read(sqe, io->fd, slot->buffer, expected_length(io, slot->block),
+                           slot->block * READAHEAD_BLOCK_SIZE);
+        io_uring_sqe_set_data(sqe, slot);
+        io_uring_submit(&io->ring);
+        return;
+    }
+#endif
+
+    io->request_queue[(io->request_head + io->request_count) % SLOT_COUNT] = (int) (slot - io->slots);
+    io->request_count++;
+    SDL_CondSignal(io->request_cond);
+}
+
+static ReadSlot *find_slot(ReadAheadIO *io, int64_t block) {
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        if (io->slots[i].state != READ_SLOT_EMPTY && io->slots[i].block == block) {
+            return &io->slots[i];
+        }
+    }
+    return NULL;
+}
+
+// A slot that isn't reading and holds nothing the window still needs
+static ReadSlot *free_slot(ReadAheadIO *io, int64_t current_block) {
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        ReadSlot *slot = &io->slots[i];
+        if (slot->state == READ_SLOT_EMPTY || slot->state == READ_SLOT_FAILED ||
+            (slot->state == READ_SLOT_READY &&
+             (slot->block < current_block || slot->block > current_block + io->depth))) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// Makes sure current_block and the depth blocks after it are read or being read, mutex held
+static void fill_window(ReadAheadIO *io, int64_t current_block) {
+    for (int64_t block = current_block; block <= current_block + io->depth; block++) {
+        if (block * READAHEAD_BLOCK_SIZE >= io->size) {
+            break;
+        }
+        if (find_slot(io, block)) {
+            continue;
+        }
+        ReadSlot *slot = free_slot(io, current_block);
+        if (!slot) {
+            break; // everything is in flight, the rest is queued on the next read
+        }
+        slot->block = block;
+        slot->length = 0;
+        slot->error = 0;
+        submit_slot(io, slot);
+    }
+}
+
+// Blocks until at least one read completes, mutex held
+static void wait_for_completion(ReadAheadIO *io) {
+#ifdef HAVE_LIBURING
+    if (io->use_uring) {
+        struct io_uring_cqe *cqe;
+        SDL_UnlockMutex(io->mutex);
+        if (io_uring_wait_cqe(&io->ring, &cqe) == 0) {
+            handle_completion(io, cqe);
+        }
+        SDL_LockMutex(io->mutex);
+        return;
+    }
+#endif
+    SDL_CondWait(io->done_cond, io->mutex);
+}
+
+// Sizes the window so READAHEAD_TARGET_SECONDS of what the demuxer consumes, plus one read latency, stay buffered
+static void adapt_depth(ReadAheadIO *io) {
+    int64_t now = av_gettime_relative();
+    if (now - io->adapt_us < READAHEAD_ADAPT_INTERVAL_US) {
+        return;
+    }
+
+    double bytes_per_second = (double) (io->stats.bytes_consumed - io->adapt_bytes) * 1000000.0 /
+                              (double) (now - io->adapt_us);
+    SDL_LockMutex(io->mutex);
+    double latency = io->stats.reads ? (double) io->stats.latency_total_us / io->stats.reads / 1000000.0 : 0;
+    SDL_UnlockMutex(io->mutex);
+    int depth = (int) ceil(bytes_per_second * (READAHEAD_TARGET_SECONDS + latency) / READAHEAD_BLOCK_SIZE);
+    depth = av_clip(depth, READAHEAD_MIN_DEPTH, READAHEAD_MAX_DEPTH);
+
+    if (depth != io->depth) {
+        log_debug("Read-ahead depth %d -> %d (%.2f MB/s consumed)", io->depth, depth, bytes_per_second / 1000000.0);
+        io->depth = depth;
+    }
+    io->stats.depth_min = FFMIN(io->stats.depth_min, depth);
+    io->stats.depth_max = FFMAX(io->stats.depth_max, depth);
+    trace_counter("readahead_depth", depth);
+    io->adapt_us = now;
+    io->adapt_bytes = io->stats.bytes_consumed;
+}
+
+static int readahead_read(void *opaque, uint8_t *buf, int buf_size) {
+    ReadAheadIO *io = (ReadAheadIO *) opaque;
+    ReadSlot *slot;
+
+    if (io->pos >= io->size) {
+        return AVERROR_EOF;
+    }
+    int64_t block = io->pos / READAHEAD_BLOCK_SIZE;
+
+#ifdef HAVE_LIBURING
+    if (io->use_uring) {
+        reap_completions(io);
+    }
+#endif
+
+    SDL_LockMutex(io->mutex);
+    fill_window(io, block);
+    while (!(slot = find_slot(io, block))) {
+        // Right after a seek every slot can still be busy with reads for the old position
+        wait_for_completion(io);
+        fill_window(io, block);
+    }
+
+    if (slot->state == READ_SLOT_IN_FLIGHT) {
+        int64_t stall_begin = av_gettime_relative();
+        while (slot->state == READ_SLOT_IN_FLIGHT) {
+            wait_for_completion(io);
+        }
+        io->stats.stalls++;
+        io->stats.stall_total_us += av_gettime_relative() - stall_begin;
+    }
+
+    if (slot->state == READ_SLOT_FAILED) {
+        int error = slot->error;
+        slot->state = READ_SLOT_EMPTY; // try again on the next call
+        SDL_UnlockMutex(io->mutex);
+        return error;
+    }
+    SDL_UnlockMutex(io->mutex);
+
+    // Ready slots are only reused from this thread, so the copy doesn't need the lock
+    int offset = (int) (io->pos - block * READAHEAD_BLOCK_SIZE);
+    int size = FFMIN(buf_size, slot->length - offset);
+    if (size <= 0) {
+        return AVERROR_EOF;
+    }
+    memcpy(buf, slot->buffer + offset, size);
+    io->pos += size;
+    io->stats.bytes_consumed += size;
+    adapt_depth(io);
+    return size;
+}
+
+static int64_t readahead_seek(void *opaque, int64_t offset, int whence) {
+    ReadAheadIO *io = (ReadAheadIO *) opaque;
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+        case AVSEEK_SIZE:
+            return io->size;
+        case SEEK_SET:
+            pos = offset;
+            break;
+        case SEEK_CUR:
+            pos = io->pos + offset;
+            break;
+        case SEEK_END:
+            pos = io->size + offset;
+            break;
+        default:
+            return AVERROR(EINVAL);
+    }
+    if (pos < 0 || pos > io->size) {
+        return AVERROR(EINVAL);
+    }
+    // Blocks are keyed by offset, whatever is buffered around the new position is reused as is
+    io->pos = pos;
+    return pos;
+}
+
+static int readahead_worker(void *userdata) {
+    ReadAheadIO *io = (ReadAheadIO *) userdata;
+
+    SDL_LockMutex(io->mutex);
+    while (true) {
+        while (!io->request_count && !io->abort_request) {
+            SDL_CondWait(io->request_cond, io->mutex);
+        }
+        if (io->abort_request) {
+            break;
+        }
+
+        ReadSlot *slot = &io->slots[io->request_queue[io->request_head]];
+        io->request_head = (io->request_head + 1) % SLOT_COUNT;
+        io->request_count--;
+        int64_t offset = slot->block * READAHEAD_BLOCK_SIZE;
+        int expected = expected_length(io, slot->block);
+        SDL_UnlockMutex(io->mutex);
+
+        int result = read_fully(io->fd, slot->buffer, expected, offset, 0);
+
+        SDL_LockMutex(io->mutex);
+        complete_slot(io, slot, result);
+    }
+    SDL_UnlockMutex(io->mutex);
+    return 0;
+}
+
+static int start_workers(ReadAheadIO *io) {
+    io->request_cond = SDL_CreateCond();
+    if (!io->request_cond) {
+        return -1;
+    }
+    for (int i = 0; i < READAHEAD_WORKERS; i++) {
+        io->workers[i] = SDL_CreateThread(readahead_worker, "read-ahead worker", io);
+        if (!io->workers[i]) {
+            log_error("Could not create read-ahead worker: %s", SDL_GetError());
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int readahead_io_open(ReadAheadIO *io, const char *path) {
+    struct stat file_stat;
+
+    memset(io, 0, sizeof(ReadAheadIO));
+    io->fd = open(path, O_RDONLY);
+    if (io->fd < 0) {
+        log_error("Could not open %s for read-ahead: %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(io->fd, &file_stat) < 0 || !S_ISREG(file_stat.st_mode)) {
+        log_warn("%s is not a regular file, no read-ahead", path);
+        goto fail;
+    }
+    io->size = file_stat.st_size;
+    io->depth = READAHEAD_MIN_DEPTH * 2;
+    io->stats.depth_min = io->depth;
+    io->stats.depth_max = io->depth;
+    io->start_us = av_gettime_relative();
+    io->adapt_us = io->start_us;
+
+    io->mutex = SDL_CreateMutex();
+    io->done_cond = SDL_CreateCond();
+    if (!io->mutex || !io->done_cond) {
+        goto fail;
+    }
+
+#ifdef HAVE_LIBURING
+    int ret = io_uring_queue_init(SLOT_COUNT, &io->ring, 0);
+    if (ret == 0) {
+        io->use_uring = 1;
+    } else {
+        log_warn("io_uring unavailable (%s), reading ahead with pread threads", strerror(-ret));
+    }
+#endif
+    if (!io->use_uring && start_workers(io) < 0) {
+        goto fail;
+    }
+
+    uint8_t *buffer = av_malloc(READAHEAD_AVIO_BUFFER_SIZE);
+    if (!buffer) {
+        goto fail;
+    }
+    io->avio = avio_alloc_context(buffer, READAHEAD_AVIO_BUFFER_SIZE, 0, io, readahead_read, NULL, readahead_seek);
+    if (!io->avio) {
+        av_free(buffer);
+        goto fail;
+    }
+    // Packet-sized reads are copied straight out of the block into the packet
+    io->avio->direct = 1;
+    log_info("Reading %s with %s read-ahead, %d KiB blocks", path, io->use_uring ? "io_uring" : "pread",
+             READAHEAD_BLOCK_SIZE / 1024);
+    return 0;
+
+fail:
+    readahead_io_close(io);
+    return -1;
+}
+
+void readahead_io_log_stats(ReadAheadIO *io) {
+    ReadAheadStats *stats = &io->stats;
+    double seconds = (double) (av_gettime_relative() - io->start_us) / 1000000.0;
+
+    log_info("Read-ahead stats: %lld reads, %.1f MB read (%.2f MB/s), latency avg %.2f ms max %.2f ms, "
+             "%lld stalls (%.1f ms waited), depth %d-%d",
+             (long long) stats->reads, stats->bytes_read / 1000000.0,
+             seconds > 0 ? stats->bytes_read / 1000000.0 / seconds : 0.0,
+             stats->reads ? stats->latency_total_us / 1000.0 / stats->reads : 0.0,
+             stats->latency_max_us / 1000.0, (long long) stats->stalls, stats->stall_total_us / 1000.0,
+             stats->depth_min, stats->depth_max);
+}
+
+void readahead_io_close(ReadAheadIO *io) {
+    if (io->mutex) {
+        readahead_io_log_stats(io);
+    }
+
+    for (int i = 0; i < READAHEAD_WORKERS; i++) {
+        if (!io->workers[i]) {
+            continue;
+        }
+        SDL_LockMutex(io->mutex);
+        io->abort_request = 1;
+        SDL_CondBroadcast(io->request_cond);
+        SDL_UnlockMutex(io->mutex);
+        SDL_WaitThread(io->workers[i], NULL);
+        io->workers[i] = NULL;
+    }
+#ifdef HAVE_LIBURING
+    if (io->use_uring) {
+        // The kernel may still be writing into the buffers
+        SDL_LockMutex(io->mutex);
+        while (io->in_flight > 0) {
+            wait_for_completion(io);
+        }
+        SDL_UnlockMutex(io->mutex);
+        io_uring_queue_exit(&io->ring);
+        io->use_uring = 0;
+    }
+#endif
+
+    for (int i = 0; i < SLOT_COUNT; i++) {
+        av_freep(&io->slots[i].buffer);
+    }
+    if (io->avio) {
+        av_freep(&io->avio->buffer);
+        avio_context_free(&io->avio);
+    }
+    if (io->request_cond) {
+        SDL_DestroyCond(io->request_cond);
+        io->request_cond = NULL;
+    }
+    if (io->done_cond) {
+        SDL_DestroyCond(io->done_cond);
+        io->done_cond = NULL;
+    }
+    if (io->mutex) {
+        SDL_DestroyMutex(io->mutex);
+        io->mutex = NULL;
+    }
+    if (io->fd >= 0) {
+        close(io->fd);
+    }
+    io->fd = -1;
+}
@@ -0,0 +1,94 @@
+//
+// Created by Deshy on 2025/06/17.
+//
+
+#ifndef READAHEAD_IO_H
+#define READAHEAD_IO_H
+
+#include <stdint.h>
+#include <SDL_mutex.h>
+#include <SDL_thread.h>
+#include <libavformat/avio.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define READAHEAD_BLOCK_SIZE (1024 * 1024)
+#define READAHEAD_MIN_DEPTH 2
+#define READAHEAD_MAX_DEPTH 32 // blocks in flight or buffered ahead of the demuxer
+#define READAHEAD_TARGET_SECONDS 2.0 // media time the read-ahead tries to keep buffered
+#define READAHEAD_ADAPT_INTERVAL_US 500000
+#define READAHEAD_WORKERS 4 // pread threads when io_uring isn't available
+#define READAHEAD_AVIO_BUFFER_SIZE 32768
+
+typedef enum ReadSlotState {
+    READ_SLOT_EMPTY,
+    READ_SLOT_IN_FLIGHT,
+    READ_SLOT_READY,
+    READ_SLOT_FAILED,
+} ReadSlotState;
+
+typedef struct ReadSlot {
+    int64_t block; // block index, offset is block * READAHEAD_BLOCK_SIZE
+    ReadSlotState state;
+    uint8_t *buffer;
+    int length; // bytes read, less than a block only at the end of the file
+    int error;
+    int64_t submit_us;
+} ReadSlot;
+
+typedef struct ReadAheadStats {
+    int64_t reads; // completed block reads
+    int64_t bytes_read;
+    int64_t latency_total_us;
+    int64_t latency_max_us;
+    int64_t stalls; // demuxer had to wait for a block
+    int64_t stall_total_us;
+    int64_t bytes_consumed; // handed to the demuxer
+    int depth_min;
+    int depth_max;
+} ReadAheadStats;
+
+/** AVIOContext that keeps several large reads in flight ahead of the demux position, so a slow disk or network
+ * filesystem is waited on by the kernel (io_uring) or a pool of pread threads instead of av_read_frame(). The depth
+ * follows the bitrate the demuxer actually consumes so that about READAHEAD_TARGET_SECONDS stay buffered. **/
+typedef struct ReadAheadIO {
+    int fd;
+    int64_t size;
+    int64_t pos; // demux read position
+    int depth; // blocks kept ahead of pos
+    AVIOContext *avio;
+
+    ReadSlot slots[READAHEAD_MAX_DEPTH + 1]; // +1 for the block being consumed
+    int in_flight;
+    SDL_mutex *mutex; // guards slots, in_flight and stats against the workers
+    SDL_cond *done_cond;
+    ReadAheadStats stats;
+
+    int64_t start_us;
+    int64_t adapt_us; // start of the current bitrate window
+    int64_t adapt_bytes; // bytes_consumed at adapt_us
+
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    int use_uring;
+
+    // pread fallback
+    SDL_Thread *workers[READAHEAD_WORKERS];
+    int request_queue[READAHEAD_MAX_DEPTH + 1]; // slot indices waiting for a worker
+    int request_head;
+    int request_count;
+    SDL_cond *request_cond;
+    int abort_request;
+} ReadAheadIO;
+
+// Opens path and sets up io->avio for AVFormatContext.pb (remember AVFMT_FLAG_CUSTOM_IO)
+int readahead_io_open(ReadAheadIO *io, const char *path);
+
+void readahead_io_log_stats(ReadAheadIO *io);
+
+// Call after avformat_close_input(), waits for reads still in flight
+void readahead_io_close(ReadAheadIO *io);
+#endif //READAHEAD_IO_H
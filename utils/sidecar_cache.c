@@ -0,0 +1,409 @@
+//
+// Created by Deshy on 2025/06/15.
+//
+#include "sidecar_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../libs/microlog/microlog.h"
+
+#define ALIGN8(x) (((x) + 7) & ~(size_t) 7)
+
+// Start of the cache file, followed by the media path, the streams with their extradata and the keyframes
+typedef struct SidecarHeader {
+    uint32_t magic;
+    uint32_t version;
+    int64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t duration;
+    int64_t start_time;
+    int64_t bit_rate;
+    int32_t nb_streams;
+    int32_t video_stream;
+    int32_t audio_stream;
+    uint32_t path_size;
+    uint32_t keyframe_count;
+    uint32_t reserved;
+} SidecarHeader;
+
+// FNV-1a, only has to spread paths over file names, the full path is checked on load
+static uint64_t hash_path(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const unsigned char *c = (const unsigned char *) path; *c; c++) {
+        hash = (hash ^ *c) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// mkdir -p for the cache directory
+static int make_dirs(char *path) {
+    for (char *c = path + 1; *c; c++) {
+        if (*c != '/') {
+            continue;
+        }
+        *c = '\0';
+        int ret = mkdir(path, 0755);
+        *c = '/';
+        if (ret < 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return mkdir(path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+static char *cache_path_for(const char *media_path) {
+    char dir[PATH_MAX];
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (xdg && xdg[0]) {
+        snprintf(dir, sizeof(dir), "%s/not_vlc", xdg);
+    } else if (home && home[0]) {
+        snprintf(dir, sizeof(dir), "%s/.cache/not_vlc", home);
+    } else {
+        return NULL;
+    }
+    if (make_dirs(dir) < 0) {
+        log_warn("Could not create cache directory %s: %s", dir, strerror(errno));
+        return NULL;
+    }
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%016llx.idx", dir, (unsigned long long) hash_path(media_path));
+    return av_strdup(path);
+}
+
+// Walks the mapped file, every offset is checked against the mapping so a truncated or corrupt file is just a miss
+static int parse_mapping(SidecarCache *cache) {
+    const uint8_t *data = cache->mapping;
+    size_t size = cache->mapping_size;
+    size_t offset = 0;
+
+    if (size < sizeof(SidecarHeader)) {
+        return -1;
+    }
+    const SidecarHeader *header = (const SidecarHeader *) data;
+    if (header->magic != SIDECAR_CACHE_MAGIC || header->version != SIDECAR_CACHE_VERSION) {
+        log_info("Cache entry has an old format, rebuilding");
+        return -1;
+    }
+    if (header->file_size != cache->file_size || header->mtime_sec != cache->mtime_sec ||
+        header->mtime_nsec != cache->mtime_nsec) {
+        log_info("Cache entry is stale, the file changed");
+        return -1;
+    }
+    if (header->nb_streams < 0 || header->nb_streams > SIDECAR_CACHE_MAX_STREAMS) {
+        return -1;
+    }
+    offset = sizeof(SidecarHeader);
+
+    if (header->path_size != strlen(cache->media_path) || offset + header->path_size > size ||
+        memcmp(data + offset, cache->media_path, header->path_size) != 0) {
+        return -1; // another file with the same hash
+    }
+    offset = ALIGN8(offset + header->path_size);
+
+    for (int i = 0; i < header->nb_streams; i++) {
+        if (offset + sizeof(SidecarStream) > size) {
+            return -1;
+        }
+        cache->streams[i] = (const SidecarStream *) (data + offset);
+        offset += sizeof(SidecarStream);
+        if (offset + cache->streams[i]->extradata_size > size) {
+            return -1;
+        }
+        cache->extradata[i] = cache->streams[i]->extradata_size ? data + offset : NULL;
+        offset = ALIGN8(offset + cache->streams[i]->extradata_size);
+    }
+
+    if (offset + (size_t) header->keyframe_count * sizeof(KeyframeEntry) > size) {
+        return -1;
+    }
+    cache->keyframes = header->keyframe_count ? (const KeyframeEntry *) (data + offset) : NULL;
+    cache->keyframe_count = (int) header->keyframe_count;
+
+    cache->duration = header->duration;
+    cache->start_time = header->start_time;
+    cache->bit_rate = header->bit_rate;
+    cache->nb_streams = header->nb_streams;
+    cache->video_stream = header->video_stream;
+    cache->audio_stream = header->audio_stream;
+    return 0;
+}
+
+int sidecar_cache_open(SidecarCache *cache, const char *url) {
+    struct stat media_stat;
+    char resolved[PATH_MAX];
+
+    memset(cache, 0, sizeof(SidecarCache));
+    cache->video_stream = -1;
+    cache->audio_stream = -1;
+
+    // Only plain local files have a size and mtime to key on
+    if (strstr(url, "://") || !realpath(url, resolved) || stat(resolved, &media_stat) < 0 ||
+        !S_ISREG(media_stat.st_mode)) {
+        return -1;
+    }
+    cache->media_path = av_strdup(resolved);
+    cache->cache_path = cache_path_for(resolved);
+    if (!cache->media_path || !cache->cache_path) {
+        sidecar_cache_close(cache);
+        return -1;
+    }
+    cache->file_size = media_stat.st_size;
+#ifdef __APPLE__
+    cache->mtime_sec = media_stat.st_mtimespec.tv_sec;
+    cache->mtime_nsec = media_stat.st_mtimespec.tv_nsec;
+#else
+    cache->mtime_sec = media_stat.st_mtim.tv_sec;
+    cache->mtime_nsec = media_stat.st_mtim.tv_nsec;
+#endif
+
+    int fd = open(cache->cache_path, O_RDONLY);
+    if (fd < 0) {
+        log_info("No cache entry for %s", resolved);
+        return 0;
+    }
+    struct stat cache_stat;
+    if (fstat(fd, &cache_stat) == 0 && cache_stat.st_size > 0) {
+        void *mapping = mmap(NULL, cache_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            cache->mapping = mapping;
+            cache->mapping_size = cache_stat.st_size;
+        }
+    }
+    close(fd);
+
+    if (!cache->mapping || parse_mapping(cache) < 0) {
+        sidecar_cache_unmap(cache);
+        return 0;
+    }
+    cache->hit = 1;
+    log_info("Cache hit for %s: %d streams, %d keyframes", resolved, cache->nb_streams, cache->keyframe_count);
+    return 0;
+}
+
+static void apply_stream(AVStream *stream, const SidecarStream *cached, const uint8_t *extradata) {
+    AVCodecParameters *par = stream->codecpar;
+
+    par->codec_type = cached->codec_type;
+    par->codec_tag = cached->codec_tag;
+    par->format = cached->format;
+    par->bit_rate = cached->bit_rate;
+    par->bits_per_coded_sample = cached->bits_per_coded_sample;
+    par->bits_per_raw_sample = cached->bits_per_raw_sample;
+    par->profile = cached->profile;
+    par->level = cached->level;
+    par->width = cached->width;
+    par->height = cached->height;
+    par->sample_aspect_ratio = av_make_q(cached->sample_aspect_ratio_num, cached->sample_aspect_ratio_den);
+    par->field_order = cached->field_order;
+    par->color_range = cached->color_range;
+    par->color_primaries = cached->color_primaries;
+    par->color_trc = cached->color_trc;
+    par->color_space = cached->color_space;
+    par->chroma_location = cached->chroma_location;
+    par->video_delay = cached->video_delay;
+    par->sample_rate = cached->sample_rate;
+    par->block_align = cached->block_align;
+    par->frame_size = cached->frame_size;
+    par->initial_padding = cached->initial_padding;
+    par->trailing_padding = cached->trailing_padding;
+    par->seek_preroll = cached->seek_preroll;
+
+    if (cached->nb_channels > 0) {
+        av_channel_layout_uninit(&par->ch_layout);
+        if (cached->channel_order == AV_CHANNEL_ORDER_NATIVE) {
+            av_channel_layout_from_mask(&par->ch_layout, cached->channel_mask);
+        } else {
+            av_channel_layout_default(&par->ch_layout, cached->nb_channels);
+        }
+    }
+
+    if (extradata && !par->extradata) {
+        par->extradata = av_mallocz(cached->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (par->extradata) {
+            memcpy(par->extradata, extradata, cached->extradata_size);
+            par->extradata_size = (int) cached->extradata_size;
+        }
+    }
+
+    stream->avg_frame_rate = av_make_q(cached->avg_frame_rate_num, cached->avg_frame_rate_den);
+    stream->r_frame_rate = av_make_q(cached->r_frame_rate_num, cached->r_frame_rate_den);
+    if (stream->start_time == AV_NOPTS_VALUE) {
+        stream->start_time = cached->start_time;
+    }
+    if (stream->duration == AV_NOPTS_VALUE) {
+        stream->duration = cached->duration;
+    }
+}
+
+int sidecar_cache_apply(SidecarCache *cache, AVFormatContext *format_context) {
+    if (!cache->hit || format_context->nb_streams != cache->nb_streams) {
+        return -1;
+    }
+
+    // The demuxer has to agree with the entry on every stream before anything is touched
+    for (int i = 0; i < cache->nb_streams; i++) {
+        AVStream *stream = format_context->streams[i];
+        if (stream->codecpar->codec_id != cache->streams[i]->codec_id ||
+            stream->time_base.num != cache->streams[i]->time_base_num ||
+            stream->time_base.den != cache->streams[i]->time_base_den) {
+            log_info("Stream %d doesn't match the cache entry, probing", i);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < cache->nb_streams; i++) {
+        apply_stream(format_context->streams[i], cache->streams[i], cache->extradata[i]);
+    }
+    format_context->duration = cache->duration;
+    format_context->start_time = cache->start_time;
+    format_context->bit_rate = cache->bit_rate;
+    return 0;
+}
+
+void sidecar_cache_unmap(SidecarCache *cache) {
+    if (cache->mapping) {
+        munmap(cache->mapping, cache->mapping_size);
+    }
+    cache->mapping = NULL;
+    cache->mapping_size = 0;
+    memset(cache->streams, 0, sizeof(cache->streams));
+    memset(cache->extradata, 0, sizeof(cache->extradata));
+    cache->keyframes = NULL;
+}
+
+static void fill_stream(SidecarStream *cached, const AVStream *stream) {
+    const AVCodecParameters *par = stream->codecpar;
+
+    memset(cached, 0, sizeof(SidecarStream));
+    cached->codec_type = par->codec_type;
+    cached->codec_id = par->codec_id;
+    cached->codec_tag = par->codec_tag;
+    cached->format = par->format;
+    cached->bit_rate = par->bit_rate;
+    cached->bits_per_coded_sample = par->bits_per_coded_sample;
+    cached->bits_per_raw_sample = par->bits_per_raw_sample;
+    cached->profile = par->profile;
+    cached->level = par->level;
+    cached->width = par->width;
+    cached->height = par->height;
+    cached->sample_aspect_ratio_num = par->sample_aspect_ratio.num;
+    cached->sample_aspect_ratio_den = par->sample_aspect_ratio.den;
+    cached->field_order = par->field_order;
+    cached->color_range = par->color_range;
+    cached->color_primaries = par->color_primaries;
+    cached->color_trc = par->color_trc;
+    cached->color_space = par->color_space;
+    cached->chroma_location = par->chroma_location;
+    cached->video_delay = par->video_delay;
+    cached->channel_order = par->ch_layout.order;
+    cached->nb_channels = par->ch_layout.nb_channels;
+    cached->channel_mask = par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0;
+    cached->sample_rate = par->sample_rate;
+    cached->block_align = par->block_align;
+    cached->frame_size = par->frame_size;
+    cached->initial_padding = par->initial_padding;
+    cached->trailing_padding = par->trailing_padding;
+    cached->seek_preroll = par->seek_preroll;
+    cached->time_base_num = stream->time_base.num;
+    cached->time_base_den = stream->time_base.den;
+    cached->avg_frame_rate_num = stream->avg_frame_rate.num;
+    cached->avg_frame_rate_den = stream->avg_frame_rate.den;
+    cached->r_frame_rate_num = stream->r_frame_rate.num;
+    cached->r_frame_rate_den = stream->r_frame_rate.den;
+    cached->start_time = stream->start_time;
+    cached->duration = stream->duration;
+    cached->extradata_size = par->extradata_size > 0 ? (uint32_t) par->extradata_size : 0;
+}
+
+static int write_padded(FILE *out, const void *data, size_t size) {
+    static const uint8_t padding[8] = {0};
+    if (size && fwrite(data, 1, size, out) != size) {
+        return -1;
+    }
+    size_t pad = ALIGN8(size) - size;
+    return pad && fwrite(padding, 1, pad, out) != pad ? -1 : 0;
+}
+
+int sidecar_cache_write(SidecarCache *cache, AVFormatContext *format_context, int video_stream, int audio_stream,
+                        KeyframeIndex *keyframe_index) {
+    if (!cache->cache_path || format_context->nb_streams > SIDECAR_CACHE_MAX_STREAMS) {
+        return -1;
+    }
+
+    // Keyframes are only worth storing once the index is complete
+    int keyframe_count = 0;
+    if (keyframe_index && atomic_load_explicit(&keyframe_index->complete, memory_order_acquire) &&
+        keyframe_index->stream_index == video_stream) {
+        keyframe_count = keyframe_index->count;
+    }
+
+    SidecarHeader header = {
+        .magic = SIDECAR_CACHE_MAGIC,
+        .version = SIDECAR_CACHE_VERSION,
+        .file_size = cache->file_size,
+        .mtime_sec = cache->mtime_sec,
+        .mtime_nsec = cache->mtime_nsec,
+        .duration = format_context->duration,
+        .start_time = format_context->start_time,
+        .bit_rate = format_context->bit_rate,
+        .nb_streams = (int32_t) format_context->nb_streams,
+        .video_stream = video_stream,
+        .audio_stream = audio_stream,
+        .path_size = (uint32_t) strlen(cache->media_path),
+        .keyframe_count = (uint32_t) keyframe_count,
+    };
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", cache->cache_path, (int) getpid());
+    FILE *out = fopen(temp_path, "wb");
+    if (!out) {
+        log_warn("Could not write cache entry %s: %s", temp_path, strerror(errno));
+        return -1;
+    }
+
+    int ret = write_padded(out, &header, sizeof(header));
+    if (ret == 0) {
+        ret = write_padded(out, cache->media_path, header.path_size);
+    }
+    for (int i = 0; ret == 0 && i < header.nb_streams; i++) {
+        SidecarStream cached;
+        fill_stream(&cached, format_context->streams[i]);
+        ret = write_padded(out, &cached, sizeof(cached));
+        if (ret == 0) {
+            ret = write_padded(out, format_context->streams[i]->codecpar->extradata, cached.extradata_size);
+        }
+    }
+    if (ret == 0 && keyframe_count) {
+        ret = write_padded(out, keyframe_index->entries, keyframe_count * sizeof(KeyframeEntry));
+    }
+    if (fclose(out) != 0) {
+        ret = -1;
+    }
+
+    if (ret < 0 || rename(temp_path, cache->cache_path) < 0) {
+        log_warn("Could not write cache entry %s", cache->cache_path);
+        unlink(temp_path);
+        return -1;
+    }
+    log_info("Wrote cache entry %s: %d streams, %d keyframes", cache->cache_path, header.nb_streams, keyframe_count);
+    return 0;
+}
+
+void sidecar_cache_close(SidecarCache *cache) {
+    sidecar_cache_unmap(cache);
+    av_freep(&cache->media_path);
+    av_freep(&cache->cache_path);
+    cache->hit = 0;
+}
@@ -0,0 +1,104 @@
+//
+// Created by Deshy on 2025/06/15.
+//
+
+#ifndef SIDECAR_CACHE_H
+#define SIDECAR_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <libavformat/avformat.h>
+#include "keyframe_index.h"
+
+#define SIDECAR_CACHE_MAGIC 0x434c564e // "NVLC"
+#define SIDECAR_CACHE_VERSION 1
+#define SIDECAR_CACHE_MAX_STREAMS 64
+
+/** On-disk record of one stream, everything avformat_find_stream_info() would have filled in. Fixed width fields
+ * only, so the file can be read in place from the mapping. **/
+typedef struct SidecarStream {
+    int32_t codec_type;
+    int32_t codec_id;
+    uint32_t codec_tag;
+    int32_t format;
+    int64_t bit_rate;
+    int32_t bits_per_coded_sample;
+    int32_t bits_per_raw_sample;
+    int32_t profile;
+    int32_t level;
+    int32_t width;
+    int32_t height;
+    int32_t sample_aspect_ratio_num;
+    int32_t sample_aspect_ratio_den;
+    int32_t field_order;
+    int32_t color_range;
+    int32_t color_primaries;
+    int32_t color_trc;
+    int32_t color_space;
+    int32_t chroma_location;
+    int32_t video_delay;
+    int32_t channel_order;
+    int32_t nb_channels;
+    int32_t sample_rate;
+    uint64_t channel_mask;
+    int32_t block_align;
+    int32_t frame_size;
+    int32_t initial_padding;
+    int32_t trailing_padding;
+    int32_t seek_preroll;
+    int32_t time_base_num;
+    int32_t time_base_den;
+    int32_t avg_frame_rate_num;
+    int32_t avg_frame_rate_den;
+    int32_t r_frame_rate_num;
+    int32_t r_frame_rate_den;
+    int64_t start_time;
+    int64_t duration;
+    uint32_t extradata_size; // extradata follows the record, padded to 8 bytes
+    uint32_t reserved;
+} SidecarStream;
+
+/** Stream info and keyframe index of a media file we opened before, kept in ~/.cache/not_vlc (or $XDG_CACHE_HOME)
+ * under a hash of the file's absolute path. An entry is only used when the path, size and mtime all still match,
+ * anything else counts as stale and is rewritten when the player exits. **/
+typedef struct SidecarCache {
+    char *media_path; // absolute path, NULL when the url isn't a local file
+    char *cache_path;
+    int64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+
+    // Mapped cache file, only valid between sidecar_cache_open() and sidecar_cache_unmap()
+    uint8_t *mapping;
+    size_t mapping_size;
+
+    int hit; // a fresh entry was found
+    int64_t duration;
+    int64_t start_time;
+    int64_t bit_rate;
+    int nb_streams;
+    const SidecarStream *streams[SIDECAR_CACHE_MAX_STREAMS];
+    const uint8_t *extradata[SIDECAR_CACHE_MAX_STREAMS];
+    int video_stream; // stream selection, -1 when unknown
+    int audio_stream;
+    const KeyframeEntry *keyframes;
+    int keyframe_count;
+} SidecarCache;
+
+/** Maps and validates the cache entry for url. Returns 0 whether or not an entry was found (see hit), -1 when the
+ * url can't be cached, e.g. a network stream. **/
+int sidecar_cache_open(SidecarCache *cache, const char *url);
+
+/** Fills the streams of a freshly opened format context from the entry. Returns 0 when every stream was restored and
+ * avformat_find_stream_info() can be skipped, -1 when the file has to be probed as usual. **/
+int sidecar_cache_apply(SidecarCache *cache, AVFormatContext *format_context);
+
+// Drops the mapping once the player has taken what it needs
+void sidecar_cache_unmap(SidecarCache *cache);
+
+// Writes a new entry, through a temporary file renamed into place so readers never see half of it
+int sidecar_cache_write(SidecarCache *cache, AVFormatContext *format_context, int video_stream, int audio_stream,
+                        KeyframeIndex *keyframe_index);
+
+void sidecar_cache_close(SidecarCache *cache);
+#endif //SIDECAR_CACHE_H
@@ -0,0 +1,134 @@
+//
+// Created by Deshy on 2025/06/02.
+//
+#include "spsc_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "../libs/microlog/microlog.h"
+
+static size_t round_up_pow2(size_t value) {
+    size_t pow2 = 1;
+    while (pow2 < value) {
+        pow2 <<= 1;
+    }
+    return pow2;
+}
+
+int spsc_ring_init(SpscRing *ring, size_t capacity, size_t element_size) {
+    memset(ring, 0, sizeof(SpscRing));
+    ring->capacity = round_up_pow2(capacity);
+    ring->mask = ring->capacity - 1;
+    ring->element_size = element_size;
+    ring->buffer = calloc(ring->capacity, element_size);
+    if (!ring->buffer) {
+        log_error("Could not allocate ring buffer of %zu elements", ring->capacity);
+        return -1;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void spsc_ring_destroy(SpscRing *ring) {
+    free(ring->buffer);
+    ring->buffer = NULL;
+}
+
+bool spsc_ring_push(SpscRing *ring, const void *element) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (tail - ring->cached_head == ring->capacity) {
+        // Only go to the shared head when our cached copy says we're full
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - ring->cached_head == ring->capacity) {
+            return false;
+        }
+    }
+
+    memcpy(ring->buffer + (tail & ring->mask) * ring->element_size, element, ring->element_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool spsc_ring_pop(SpscRing *ring, void *element) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    if (head == ring->cached_tail) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head == ring->cached_tail) {
+            return false;
+        }
+    }
+
+    memcpy(element, ring->buffer + (head & ring->mask) * ring->element_size, ring->element_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+size_t spsc_ring_write(SpscRing *ring, const void *elements, size_t count) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t free_slots = ring->capacity - (tail - ring->cached_head);
+
+    if (free_slots < count) {
+        ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        free_slots = ring->capacity - (tail - ring->cached_head);
+    }
+    if (count > free_slots) {
+        count = free_slots;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // At most two copies, the second one when the span wraps around the end of the buffer
+    size_t offset = tail & ring->mask;
+    size_t first = count < ring->capacity - offset ? count : ring->capacity - offset;
+    memcpy(ring->buffer + offset * ring->element_size, elements, first * ring->element_size);
+    memcpy(ring->buffer, (const uint8_t *) elements + first * ring->element_size,
+           (count - first) * ring->element_size);
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+    return count;
+}
+
+size_t spsc_ring_read(SpscRing *ring, void *elements, size_t count) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t available = ring->cached_tail - head;
+
+    if (available < count) {
+        ring->cached_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        available = ring->cached_tail - head;
+    }
+    if (count > available) {
+        count = available;
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    if (elements) {
+        size_t offset = head & ring->mask;
+        size_t first = count < ring->capacity - offset ? count : ring->capacity - offset;
+        memcpy(elements, ring->buffer + offset * ring->element_size, first * ring->element_size);
+        memcpy((uint8_t *) elements + first * ring->element_size, ring->buffer,
+               (count - first) * ring->element_size);
+    }
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+size_t spsc_ring_size(SpscRing *ring) {
+    // head first: tail only moves forward, so this can never come out negative
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return tail - head;
+}
+
+size_t spsc_ring_read_index(SpscRing *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+size_t spsc_ring_write_index(SpscRing *ring) {
+    return atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
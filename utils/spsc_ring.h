@@ -0,0 +1,53 @@
+//
+// Created by Deshy on 2025/06/02.
+//
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPSC_RING_CACHE_LINE 64
+
+/** Bounded single-producer/single-consumer ring of fixed size elements. push is only ever called from the producer
+ * thread and pop from the consumer thread, so neither side takes a lock. Each index lives on its own cache line so
+ * the two threads don't keep stealing the line from each other. **/
+typedef struct SpscRing {
+    uint8_t *buffer;
+    size_t capacity; // always a power of two
+    size_t mask;
+    size_t element_size;
+
+    char pad0[SPSC_RING_CACHE_LINE];
+    atomic_size_t head; // next slot to read, owned by the consumer
+    size_t cached_tail; // consumer's last view of tail
+    char pad1[SPSC_RING_CACHE_LINE];
+    atomic_size_t tail; // next slot to write, owned by the producer
+    size_t cached_head; // producer's last view of head
+    char pad2[SPSC_RING_CACHE_LINE];
+} SpscRing;
+
+int spsc_ring_init(SpscRing *ring, size_t capacity, size_t element_size);
+
+void spsc_ring_destroy(SpscRing *ring);
+
+bool spsc_ring_push(SpscRing *ring, const void *element);
+
+bool spsc_ring_pop(SpscRing *ring, void *element);
+
+size_t spsc_ring_size(SpscRing *ring);
+
+// Bulk variants for streams of bytes/samples. Copy as many elements as fit (or are available) and return how many,
+// read with a NULL destination just drops them.
+size_t spsc_ring_write(SpscRing *ring, const void *elements, size_t count);
+
+size_t spsc_ring_read(SpscRing *ring, void *elements, size_t count);
+
+// Absolute (never wrapping back) positions, used to mark a point in the stream
+size_t spsc_ring_read_index(SpscRing *ring);
+
+size_t spsc_ring_write_index(SpscRing *ring);
+#endif //SPSC_RING_H
@@ -0,0 +1,142 @@
+//
+// Created by Deshy on 2025/06/12.
+//
+#include "stats.h"
+
+#include <sys/resource.h>
+#include <libavutil/time.h>
+
+PipelineStats pipeline_stats;
+
+static const char *stage_names[STATS_STAGE_COUNT] = {
+    "demux",
+    "video_decode",
+    "audio_decode",
+    "resample",
+    "downmix",
+    "sws",
+    "upload",
+};
+
+void stats_reset(void) {
+    for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+        atomic_init(&pipeline_stats.stages[i].calls, 0);
+        atomic_init(&pipeline_stats.stages[i].total_us, 0);
+    }
+    atomic_init(&pipeline_stats.video_frames, 0);
+    atomic_init(&pipeline_stats.audio_frames, 0);
+    atomic_init(&pipeline_stats.audio_passthrough_frames, 0);
+    pipeline_stats.occupancy_samples = 0;
+    pipeline_stats.audio_queue_seconds_sum = 0;
+    pipeline_stats.audio_queue_seconds_max = 0;
+    pipeline_stats.video_queue_seconds_sum = 0;
+    pipeline_stats.video_queue_seconds_max = 0;
+    pipeline_stats.picture_queue_sum = 0;
+    pipeline_stats.picture_queue_max = 0;
+    pipeline_stats.pcm_ring_bytes_sum = 0;
+    pipeline_stats.pcm_ring_bytes_max = 0;
+    pipeline_stats.start_us = av_gettime_relative();
+    pipeline_stats.end_us = 0;
+}
+
+int64_t stats_begin(void) {
+    return av_gettime_relative();
+}
+
+void stats_end(StatsStage stage, int64_t begin_us) {
+    StageTimer *timer = &pipeline_stats.stages[stage];
+    atomic_fetch_add_explicit(&timer->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&timer->total_us, av_gettime_relative() - begin_us, memory_order_relaxed);
+}
+
+void stats_sample_queues(double audio_queue_seconds, double video_queue_seconds, int pictures, int64_t pcm_ring_bytes) {
+    pipeline_stats.occupancy_samples++;
+    pipeline_stats.audio_queue_seconds_sum += audio_queue_seconds;
+    pipeline_stats.video_queue_seconds_sum += video_queue_seconds;
+    pipeline_stats.picture_queue_sum += pictures;
+    pipeline_stats.pcm_ring_bytes_sum += pcm_ring_bytes;
+    if (audio_queue_seconds > pipeline_stats.audio_queue_seconds_max) {
+        pipeline_stats.audio_queue_seconds_max = audio_queue_seconds;
+    }
+    if (video_queue_seconds > pipeline_stats.video_queue_seconds_max) {
+        pipeline_stats.video_queue_seconds_max = video_queue_seconds;
+    }
+    if (pictures > pipeline_stats.picture_queue_max) {
+        pipeline_stats.picture_queue_max = pictures;
+    }
+    if (pcm_ring_bytes > pipeline_stats.pcm_ring_bytes_max) {
+        pipeline_stats.pcm_ring_bytes_max = pcm_ring_bytes;
+    }
+}
+
+void stats_stop(void) {
+    pipeline_stats.end_us = av_gettime_relative();
+}
+
+long stats_peak_rss_kb(void) {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) < 0) {
+        return -1;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024; // bytes on macOS
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+static void write_json_string(FILE *out, const char *value) {
+    fputc('"', out);
+    for (const char *c = value; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fputc('\\', out);
+            fputc(*c, out);
+        } else if ((unsigned char) *c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+int stats_write_json(FILE *out, const char *url, double rate, int64_t frames_dropped, int64_t audio_underruns) {
+    int64_t end_us = pipeline_stats.end_us ? pipeline_stats.end_us : av_gettime_relative();
+    double wall_seconds = (double) (end_us - pipeline_stats.start_us) / 1000000.0;
+    int64_t video_frames = atomic_load(&pipeline_stats.video_frames);
+    int64_t samples = pipeline_stats.occupancy_samples ? pipeline_stats.occupancy_samples : 1;
+
+    fprintf(out, "{\"file\":");
+    write_json_string(out, url);
+    fprintf(out, ",\"mode\":\"%s\",\"rate\":%.3f", rate > 0 ? "fixed" : "fast", rate);
+    fprintf(out, ",\"wall_seconds\":%.3f", wall_seconds);
+    fprintf(out, ",\"video_frames\":%lld,\"video_fps\":%.2f,\"video_frames_dropped\":%lld",
+            (long long) video_frames, wall_seconds > 0 ? video_frames / wall_seconds : 0.0, (long long) frames_dropped);
+    fprintf(out, ",\"audio_frames\":%lld,\"audio_passthrough_frames\":%lld,\"audio_underruns\":%lld",
+            (long long) atomic_load(&pipeline_stats.audio_frames),
+            (long long) atomic_load(&pipeline_stats.audio_passthrough_frames), (long long) audio_underruns);
+
+    fprintf(out, ",\"stages\":{");
+    for (int i = 0; i < STATS_STAGE_COUNT; i++) {
+        int64_t calls = atomic_load(&pipeline_stats.stages[i].calls);
+        int64_t total_us = atomic_load(&pipeline_stats.stages[i].total_us);
+        fprintf(out, "%s\"%s\":{\"calls\":%lld,\"total_ms\":%.3f,\"avg_us\":%.2f}",
+                i ? "," : "", stage_names[i], (long long) calls, total_us / 1000.0,
+                calls ? (double) total_us / calls : 0.0);
+    }
+    fprintf(out, "}");
+
+    fprintf(out, ",\"queues\":{\"samples\":%lld", (long long) pipeline_stats.occupancy_samples);
+    fprintf(out, ",\"audio_packets_avg_s\":%.3f,\"audio_packets_max_s\":%.3f",
+            pipeline_stats.audio_queue_seconds_sum / samples, pipeline_stats.audio_queue_seconds_max);
+    fprintf(out, ",\"video_packets_avg_s\":%.3f,\"video_packets_max_s\":%.3f",
+            pipeline_stats.video_queue_seconds_sum / samples, pipeline_stats.video_queue_seconds_max);
+    fprintf(out, ",\"pictures_avg\":%.2f,\"pictures_max\":%d",
+            (double) pipeline_stats.picture_queue_sum / samples, pipeline_stats.picture_queue_max);
+    fprintf(out, ",\"pcm_ring_avg_bytes\":%lld,\"pcm_ring_max_bytes\":%lld}",
+            (long long) (pipeline_stats.pcm_ring_bytes_sum / samples), (long long) pipeline_stats.pcm_ring_bytes_max);
+
+    fprintf(out, ",\"peak_rss_kb\":%ld}\n", stats_peak_rss_kb());
+    return ferror(out) ? -1 : 0;
+}
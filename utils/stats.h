@@ -0,0 +1,67 @@
+//
+// Created by Deshy on 2025/06/12.
+//
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+typedef enum StatsStage {
+    STATS_DEMUX,
+    STATS_VIDEO_DECODE,
+    STATS_AUDIO_DECODE,
+    STATS_RESAMPLE,
+    STATS_DOWNMIX,
+    STATS_SWS,
+    STATS_UPLOAD,
+    STATS_STAGE_COUNT
+} StatsStage;
+
+typedef struct StageTimer {
+    atomic_int_fast64_t calls;
+    atomic_int_fast64_t total_us;
+} StageTimer;
+
+/** Pipeline counters for benchmark runs. Stage timers are bumped by whichever thread runs the stage, queue occupancy is
+ * sampled by the headless sink loop only. **/
+typedef struct PipelineStats {
+    StageTimer stages[STATS_STAGE_COUNT];
+    atomic_int_fast64_t video_frames; // pictures that reached the video sink
+    atomic_int_fast64_t audio_frames; // decoded audio frames
+    atomic_int_fast64_t audio_passthrough_frames; // of those, already in the format and rate swr would produce
+
+    int64_t occupancy_samples;
+    double audio_queue_seconds_sum;
+    double audio_queue_seconds_max;
+    double video_queue_seconds_sum;
+    double video_queue_seconds_max;
+    int64_t picture_queue_sum;
+    int picture_queue_max;
+    int64_t pcm_ring_bytes_sum;
+    int64_t pcm_ring_bytes_max;
+
+    int64_t start_us;
+    int64_t end_us;
+} PipelineStats;
+
+extern PipelineStats pipeline_stats;
+
+void stats_reset(void);
+
+// Timestamp to hand back to stats_end()
+int64_t stats_begin(void);
+
+void stats_end(StatsStage stage, int64_t begin_us);
+
+void stats_sample_queues(double audio_queue_seconds, double video_queue_seconds, int pictures, int64_t pcm_ring_bytes);
+
+void stats_stop(void);
+
+// Peak resident set size of the process in kilobytes
+long stats_peak_rss_kb(void);
+
+int stats_write_json(FILE *out, const char *url, double rate, int64_t frames_dropped, int64_t audio_underruns);
+#endif //STATS_H
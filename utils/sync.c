@@ -10,7 +10,6 @@
 #define AV_NOSYNC_THRESHOLD 1.0
 
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
-#define AUDIO_DIFF_AVG_NB 20
 
 
 SyncState *sync_state = NULL;
@@ -20,40 +19,28 @@ int sync_reset_clock(double clock) {
         log_error("Failed to resest clocks");
         return -1;
     }
-    sync_state->audio_clock = clock;
-    sync_state->video_clock = clock;
+    clock_set(&sync_state->external_clock, clock, 0);
 
     return 0;
 }
 
-double get_external_clock() {
-    return av_gettime() / 1000000.0;
+void sync_set_paused(int paused) {
+    clock_set_paused(&sync_state->audio_clock, paused);
+    clock_set_paused(&sync_state->video_clock, paused);
+    clock_set_paused(&sync_state->external_clock, paused);
 }
 
-/** takes time to move all the data from audio packet to buffer which means that the value in the audio clock could be
- * too far ahead **/
-double get_audio_clock(AudioState *audio_state) {
-    double pts = sync_state->audio_clock;
-    int hw_buf_size = audio_state->buffer_size - audio_state->buffer_index;
-    int bytes_per_second = audio_state->stream->codecpar->sample_rate *
-                           audio_state->codec_context->ch_layout.nb_channels * 2;
-
-    double adjustment = (double) hw_buf_size / bytes_per_second;
-    double adjusted_pts = pts - adjustment;
-
-    log_debug("Audio clock: pts=%.3f, buf_size=%d, adj=%.3f, final=%.3f",
-              pts, hw_buf_size, adjustment, adjusted_pts);
-
-    return adjusted_pts;
+double get_external_clock() {
+    return clock_get(&sync_state->external_clock);
 }
 
-double get_video_clock(VideoState *video_state) {
-    if (video_state->video_current_pts_time == 0) {
-        return video_state->video_current_pts;
-    }
+// Published by the callback from the PCM ring's read position, so it already leaves out what is still buffered
+double get_audio_clock() {
+    return clock_get(&sync_state->audio_clock);
+}
 
-    return video_state->video_current_pts +
-           (av_gettime() - video_state->video_current_pts_time) / 1000000.0;
+double get_video_clock() {
+    return clock_get(&sync_state->video_clock);
 }
 
 double get_master_clock() {
@@ -61,9 +48,9 @@ double get_master_clock() {
 
     switch (sync_state->av_sync_type) {
         case AV_SYNC_AUDIO_MASTER:
-            return get_audio_clock(sync_state->player_state->audio_state);
+            return get_audio_clock();
         case AV_SYNC_VIDEO_MASTER:
-            return get_video_clock(sync_state->player_state->video_state);
+            return get_video_clock();
 
         default:
             return get_external_clock();
@@ -76,78 +63,55 @@ double synchronize_video(VideoState *video_state, AVFrame *frame, double present
 
     if (presentation_time_stamp != 0) {
         log_info("Synchronizing video: presentation_time_stamp=%f", presentation_time_stamp);
-        sync_state->video_clock = presentation_time_stamp;
+        video_state->predicted_pts = presentation_time_stamp;
     } else {
-        presentation_time_stamp = sync_state->video_clock;
-        log_info("No presentation_time_stamp, using video clock: %f", sync_state->video_clock);
+        presentation_time_stamp = video_state->predicted_pts;
+        log_info("No presentation_time_stamp, using predicted pts: %f", video_state->predicted_pts);
     }
 
     frame_delay = av_q2d(video_state->stream->time_base); // duration of a frame in seconds
     frame_delay += frame->repeat_pict * (frame_delay * 0.5); //if frame was repeated
     log_info("Frame delay: %f", frame_delay);
-    sync_state->video_clock += frame_delay;
-    log_info("Updated video clock: %f", sync_state->video_clock);
+    video_state->predicted_pts += frame_delay;
+    log_info("Updated predicted pts: %f", video_state->predicted_pts);
     return presentation_time_stamp;
 }
 
-int synchronize_audio(AudioState *audio_state, short *samples, int samples_size, double presentation_time_stamp) {
-    int n = 2 * audio_state->codec_context->ch_layout.nb_channels;
-    double ref_clock;
-
-    if (sync_state->av_sync_type != AV_SYNC_AUDIO_MASTER) {
-        double diff;
-        double avg_diff;
-        int wanted_size;
-        int min_size;
-        int max_size;
-
-        ref_clock = get_master_clock();
-        diff = get_audio_clock(audio_state) - ref_clock;
-
-        if (diff < AV_NOSYNC_THRESHOLD) {
-            audio_state->audio_diff_cum = diff + audio_state->audio_diff_avg_coef * audio_state->audio_diff_cum;
-
-            if (audio_state->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
-                audio_state->audio_diff_avg_count++;
-            } else {
-                avg_diff = audio_state->audio_diff_cum * (1.0 - audio_state->audio_diff_avg_coef);
-
-                if (fabs(avg_diff) >= audio_state->audio_diff_threshold) {
-                }
-                wanted_size = samples_size + (int) (diff * audio_state->stream->codecpar->sample_rate * n);
-                min_size = samples_size * ((100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100);
-
-                if (wanted_size < min_size) {
-                    wanted_size = min_size;
-                } else if (wanted_size > max_size) {
-                    wanted_size = max_size;
-                }
-
-                if (wanted_size < samples_size) {
-                    samples_size = wanted_size;
-                } else if (wanted_size > samples_size) {
-                    uint8_t *samples_end;
-                    uint8_t *q;
-                    int nb;
-
-                    nb = (samples_size - wanted_size);
-                    samples_end = (uint8_t *) samples + samples_size - n;
-                    q = samples_end + n;
-                    while (nb > 0) {
-                        memcpy(q, samples_end, n);
-                        q += n;
-                        nb -= n;
-                    }
-                    samples_size = wanted_size;
-                }
-            }
-        } else {
-            // differnce  is too big, we don't want to use it
-            audio_state->audio_diff_avg_count = 0;
-            audio_state->audio_diff_cum = 0;
-        }
+/** How many samples the next frame of nb_samples should come out as so the audio drifts back to the master clock.
+ * The difference is averaged over the last AUDIO_DIFF_AVG_NB frames, so a single late callback doesn't stretch
+ * anything, and only acted on once the average is more than a device buffer off. The stretch is bounded to
+ * SAMPLE_CORRECTION_PERCENT_MAX of the frame, and swr spreads it over the whole frame instead of dropping or
+ * repeating samples. **/
+int synchronize_audio(AudioState *audio_state, int nb_samples) {
+    if (sync_state->av_sync_type == AV_SYNC_AUDIO_MASTER) {
+        return nb_samples;
     }
-    return samples_size;
+
+    double diff = get_audio_clock() - get_master_clock();
+    if (isnan(diff) || fabs(diff) >= AV_NOSYNC_THRESHOLD) {
+        // No clock of the current serial yet, or too far off to be fixed by stretching: start the average over
+        audio_state->audio_diff_avg_count = 0;
+        audio_state->audio_diff_cum = 0;
+        return nb_samples;
+    }
+
+    audio_state->audio_diff_cum = diff + audio_state->audio_diff_avg_coef * audio_state->audio_diff_cum;
+    if (audio_state->audio_diff_avg_count < AUDIO_DIFF_AVG_NB) {
+        // Not enough frames for a meaningful average
+        audio_state->audio_diff_avg_count++;
+        return nb_samples;
+    }
+
+    double avg_diff = audio_state->audio_diff_cum * (1.0 - audio_state->audio_diff_avg_coef);
+    if (fabs(avg_diff) < audio_state->audio_diff_threshold) {
+        return nb_samples;
+    }
+
+    // Audio ahead of the master plays more samples for the frame, behind plays fewer
+    int wanted_nb_samples = nb_samples + (int) (diff * audio_state->codec_context->sample_rate);
+    int min_nb_samples = nb_samples * (100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100;
+    int max_nb_samples = nb_samples * (100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100;
+    return av_clip(wanted_nb_samples, min_nb_samples, max_nb_samples);
 }
 
 void sync_init(int sync_type, PlayerState *player_state) {
@@ -155,6 +119,9 @@ void sync_init(int sync_type, PlayerState *player_state) {
         sync_state = malloc(sizeof(SyncState));
         sync_state->av_sync_type = sync_type;
         sync_state->player_state = player_state;
+        clock_init(&sync_state->audio_clock, &player_state->audio_packet_queue->serial);
+        clock_init(&sync_state->video_clock, &player_state->video_packet_queue->serial);
+        clock_init(&sync_state->external_clock, NULL);
     }
 }
 
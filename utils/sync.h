@@ -5,7 +5,9 @@
 #ifndef SYNC_H
 #define SYNC_H
 #include <stdint.h>
+#include "clock.h"
 #define DEFAULT_AV_SYNC_TYPE AV_SYNC_AUDIO_MASTER
+#define AUDIO_DIFF_AVG_NB 20 // frames the audio-master difference is averaged over
 
 // type declarations
 typedef struct AudioState AudioState;
@@ -19,8 +21,9 @@ enum {
 
 typedef struct SyncState {
     int av_sync_type;
-    double audio_clock; // clock for audio
-    double video_clock;
+    Clock audio_clock; // set by the audio callback: the next sample to leave the PCM ring
+    Clock video_clock; // set by the presenter: the picture on screen
+    Clock external_clock; // follows whichever of the two it drifted too far from
 
     PlayerState *player_state;
 } SyncState;
@@ -31,7 +34,8 @@ void sync_init(int sync_type, PlayerState *player_state);
 
 void sync_cleanup();
 
-int synchronize_audio(AudioState *audio_state, short *samples, int samples_size, double presentation_time_stamp);
+// Samples a frame of nb_samples should be resampled to, nb_samples unless audio is drifting off a video or external master
+int synchronize_audio(AudioState *audio_state, int nb_samples);
 
 double synchronize_video(VideoState *video_state, AVFrame *frame, double presentation_time_stamp);
 
@@ -39,7 +43,13 @@ double get_master_clock();
 
 double get_external_clock();
 
-double get_audio_clock(AudioState *audio_state);
+double get_audio_clock();
 
+double get_video_clock();
+
+// Restarts the external clock at a seek target, audio and video go stale by serial until they have new data
 int sync_reset_clock(double clock);
+
+// Stops or restarts every clock, from the thread that pauses the device
+void sync_set_paused(int paused);
 #endif //SYNC_H
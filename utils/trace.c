@@ -0,0 +1,156 @@
+//
+// Created by Deshy on 2025/06/13.
+//
+#include "trace.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <libavutil/time.h>
+
+#include "../libs/microlog/microlog.h"
+
+atomic_bool trace_enabled = false;
+
+static _Atomic(TraceBuffer *) trace_buffers = NULL; // every thread that ever traced, kept until exit
+static atomic_int trace_next_tid = 1;
+static int64_t trace_start_us;
+static _Thread_local TraceBuffer *thread_buffer = NULL;
+
+void trace_start(void) {
+    trace_start_us = av_gettime_relative();
+    atomic_store(&trace_enabled, true);
+    log_info("Tracing started, %d events kept per thread", TRACE_BUFFER_EVENTS);
+}
+
+int64_t trace_now(void) {
+    return av_gettime_relative();
+}
+
+// The calling thread's buffer, allocated on its first event
+static TraceBuffer *get_thread_buffer(void) {
+    if (thread_buffer) {
+        return thread_buffer;
+    }
+
+    TraceBuffer *buffer = calloc(1, sizeof(TraceBuffer));
+    if (!buffer) {
+        return NULL;
+    }
+    atomic_init(&buffer->count, 0);
+    buffer->tid = atomic_fetch_add(&trace_next_tid, 1);
+    buffer->thread_name = NULL;
+
+    buffer->next = atomic_load(&trace_buffers);
+    while (!atomic_compare_exchange_weak(&trace_buffers, &buffer->next, buffer)) {
+    }
+    thread_buffer = buffer;
+    return buffer;
+}
+
+void trace_thread_name(const char *name) {
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    TraceBuffer *buffer = get_thread_buffer();
+    if (buffer && !buffer->thread_name) {
+        buffer->thread_name = name;
+    }
+}
+
+static void record(TraceEventType type, const char *name, int64_t begin_us, int64_t duration_us, double value) {
+    TraceBuffer *buffer = get_thread_buffer();
+    if (!buffer) {
+        return;
+    }
+
+    uint_fast64_t index = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    TraceEvent *event = &buffer->events[index % TRACE_BUFFER_EVENTS];
+    event->name = name;
+    event->begin_us = begin_us;
+    event->duration_us = duration_us;
+    event->value = value;
+    event->type = type;
+    atomic_store_explicit(&buffer->count, index + 1, memory_order_release);
+}
+
+void trace_end(const char *name, int64_t begin_us, double pts) {
+    if (!begin_us || !atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    record(TRACE_SPAN, name, begin_us, trace_now() - begin_us, pts);
+}
+
+void trace_counter(const char *name, double value) {
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    record(TRACE_COUNTER, name, trace_now(), 0, value);
+}
+
+void trace_instant(const char *name, double pts) {
+    if (!atomic_load_explicit(&trace_enabled, memory_order_relaxed)) {
+        return;
+    }
+    record(TRACE_INSTANT, name, trace_now(), 0, pts);
+}
+
+static void write_event(FILE *out, const TraceBuffer *buffer, const TraceEvent *event, bool *first) {
+    double ts = (double) (event->begin_us - trace_start_us);
+
+    fprintf(out, "%s\n", *first ? "" : ",");
+    *first = false;
+    switch (event->type) {
+        case TRACE_SPAN:
+            fprintf(out, "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%lld,\"pid\":1,\"tid\":%d",
+                    event->name, ts, (long long) event->duration_us, buffer->tid);
+            break;
+        case TRACE_COUNTER:
+            fprintf(out, "{\"name\":\"%s\",\"ph\":\"C\",\"ts\":%.0f,\"pid\":1,\"tid\":%d,\"args\":{\"value\":%.6f}}",
+                    event->name, ts, buffer->tid, event->value);
+            return;
+        case TRACE_INSTANT:
+            fprintf(out, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.0f,\"pid\":1,\"tid\":%d",
+                    event->name, ts, buffer->tid);
+            break;
+    }
+    if (isnan(event->value)) {
+        fprintf(out, "}");
+    } else {
+        fprintf(out, ",\"args\":{\"pts\":%.6f}}", event->value);
+    }
+}
+
+int trace_write_json(const char *path) {
+    // Writers check the flag before every event, give any event in flight a moment to land
+    atomic_store(&trace_enabled, false);
+    av_usleep(1000);
+
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        log_error("Could not open trace file %s", path);
+        return -1;
+    }
+
+    bool first = true;
+    long long written = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+    for (TraceBuffer *buffer = atomic_load(&trace_buffers); buffer; buffer = buffer->next) {
+        uint_fast64_t count = atomic_load_explicit(&buffer->count, memory_order_acquire);
+        uint_fast64_t oldest = count > TRACE_BUFFER_EVENTS ? count - TRACE_BUFFER_EVENTS : 0;
+
+        fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                first ? "" : ",", buffer->tid, buffer->thread_name ? buffer->thread_name : "unnamed");
+        first = false;
+        for (uint_fast64_t i = oldest; i < count; i++) {
+            write_event(out, buffer, &buffer->events[i % TRACE_BUFFER_EVENTS], &first);
+            written++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    int ret = ferror(out) ? -1 : 0;
+    fclose(out);
+    log_info("Wrote %lld trace events to %s", written, path);
+    return ret;
+}
@@ -0,0 +1,61 @@
+//
+// Created by Deshy on 2025/06/13.
+//
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TRACE_BUFFER_EVENTS 65536 // per thread, oldest events are overwritten
+
+typedef enum TraceEventType {
+    TRACE_SPAN,
+    TRACE_COUNTER,
+    TRACE_INSTANT,
+} TraceEventType;
+
+typedef struct TraceEvent {
+    const char *name; // string literal
+    int64_t begin_us;
+    int64_t duration_us;
+    double value; // frame pts in seconds for spans and instants (NAN if unknown), the value for counters
+    TraceEventType type;
+} TraceEvent;
+
+/** Flight recorder for one thread. Only the owning thread writes, the buffers are read once recording has stopped. **/
+typedef struct TraceBuffer {
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+    atomic_uint_fast64_t count; // events ever written, the newest TRACE_BUFFER_EVENTS are kept
+    const char *thread_name;
+    int tid;
+    struct TraceBuffer *next;
+} TraceBuffer;
+
+extern atomic_bool trace_enabled;
+
+void trace_start(void);
+
+// Names the calling thread in the trace, call once from the thread itself
+void trace_thread_name(const char *name);
+
+// Monotonic microseconds, never 0
+int64_t trace_now(void);
+
+// Start of a span, 0 when tracing is off so trace_end() knows to skip it
+static inline int64_t trace_begin(void) {
+    return atomic_load_explicit(&trace_enabled, memory_order_relaxed) ? trace_now() : 0;
+}
+
+// Records a span from begin_us to now, pts ties it to a frame
+void trace_end(const char *name, int64_t begin_us, double pts);
+
+void trace_counter(const char *name, double value);
+
+void trace_instant(const char *name, double pts);
+
+// Stops recording and writes every thread's events as Chrome trace-event JSON (chrome://tracing, ui.perfetto.dev)
+int trace_write_json(const char *path);
+#endif //TRACE_H
@@ -0,0 +1,319 @@
+//
+// Created by Deshy on 2025/06/18.
+//
+#include "presenter.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL_render.h>
+#include <SDL_video.h>
+#include <libavutil/common.h>
+#include <libavutil/time.h>
+
+#include "video.h"
+#include "../libs/microlog/microlog.h"
+#include "../player/player.h"
+#include "../utils/stats.h"
+#include "../utils/sync.h"
+#include "../utils/trace.h"
+
+/** Master clock at wall time vsync_us, NAN when video is the master and the cadence runs free. The audio clock moves
+ * in steps of a callback's worth of samples, following its offset from the wall clock keeps those steps from shifting
+ * the cadence back and forth. **/
+static double clock_at(Presenter *presenter, int64_t now_us, int64_t vsync_us) {
+    if (sync_state->av_sync_type == AV_SYNC_VIDEO_MASTER) {
+        return NAN;
+    }
+
+    double clock = get_master_clock();
+    if (isnan(clock)) {
+        return NAN;
+    }
+    double offset = clock - now_us / 1000000.0;
+    if (!presenter->clock_valid || fabs(offset - presenter->clock_offset) > PRESENTER_RESYNC_THRESHOLD) {
+        // Seek, pause or a stalled audio device, start over from the clock as it is
+        presenter->clock_offset = offset;
+        presenter->clock_valid = 1;
+    } else {
+        presenter->clock_offset = PRESENTER_CLOCK_SMOOTHING * presenter->clock_offset +
+                                  (1.0 - PRESENTER_CLOCK_SMOOTHING) * offset;
+    }
+    return vsync_us / 1000000.0 + presenter->clock_offset;
+}
+
+// Key press to first picture of the seek on screen, measured at the vblank the picture goes out on
+static void record_seek_latency(Presenter *presenter, VideoPicture *picture, int64_t vsync_us) {
+    VideoState *video_state = presenter->video_state;
+    int64_t issued_us = atomic_load(&video_state->seek_issued_us);
+
+    if (!issued_us || picture->serial != atomic_load(&video_state->seek_serial) ||
+        !atomic_compare_exchange_strong(&video_state->seek_issued_us, &issued_us, 0)) {
+        return;
+    }
+    int64_t latency_us = vsync_us - issued_us;
+    presenter->stats.seeks++;
+    presenter->stats.seek_latency_total_us += latency_us;
+    presenter->stats.seek_latency_max_us = FFMAX(presenter->stats.seek_latency_max_us, latency_us);
+    log_info("Seek latency %.1f ms, key press to first picture at %.3fs", latency_us / 1000.0,
+             picture->presentation_time_stamp);
+    trace_counter("seek_latency_ms", latency_us / 1000.0);
+}
+
+/** Picks the next picture in the queue for the screen and gives it a slot of whole refreshes. Pictures behind it that
+ * the clock has already passed go first: any at all when resyncing, otherwise only ones too late for the cadence to
+ * absorb. The picture stays in the queue until it has been uploaded. **/
+static void show_next_picture(Presenter *presenter, double clock, int resync) {
+    VideoState *video_state = presenter->video_state;
+    double half_vsync = presenter->vsync_period / 2;
+    double late_limit = resync ? clock + half_vsync : clock - PRESENTER_CADENCE_TOLERANCE * presenter->vsync_period;
+    VideoPicture *picture = picture_queue_peek(video_state, 0);
+    VideoPicture *after;
+
+    while (!isnan(clock) && (after = picture_queue_peek(video_state, 1)) && after->serial == picture->serial &&
+           after->presentation_time_stamp <= late_limit) {
+        atomic_fetch_add_explicit(&video_state->frame_stats.dropped_late, 1, memory_order_relaxed);
+        trace_instant("drop_late", picture->presentation_time_stamp);
+        picture_queue_advance(video_state);
+        picture = picture_queue_peek(video_state, 0);
+    }
+
+    // The picture's duration comes from the next one's pts when it has already been decoded
+    after = picture_queue_peek(video_state, 1);
+    double duration = after ? after->presentation_time_stamp - picture->presentation_time_stamp
+                            : presenter->frame_duration;
+    if (duration <= 0 || duration >= 1.0) {
+        duration = presenter->frame_duration;
+    }
+    presenter->frame_duration = duration;
+
+    if (resync) {
+        presenter->cadence_carry = 0;
+        presenter->stats.resyncs++;
+    }
+    double ideal = duration / presenter->vsync_period + presenter->cadence_carry;
+    int vsyncs = FFMAX(1, (int) lround(ideal));
+    presenter->cadence_carry = av_clipd(ideal - vsyncs, -1.0, 1.0);
+
+    if (!isnan(clock)) {
+        double lag = clock - picture->presentation_time_stamp;
+        load_shedder_observe(video_state, lag);
+        if (lag > PRESENTER_CADENCE_TOLERANCE * presenter->vsync_period) {
+            atomic_fetch_add_explicit(&video_state->frame_stats.late, 1, memory_order_relaxed);
+        } else {
+            atomic_fetch_add_explicit(&video_state->frame_stats.on_time, 1, memory_order_relaxed);
+        }
+    }
+
+    presenter->picked = picture;
+    presenter->showing = 1;
+    presenter->serial = picture->serial;
+    presenter->shown_pts = picture->presentation_time_stamp;
+    presenter->vsyncs_left = vsyncs;
+    presenter->stats.pictures++;
+}
+
+// Decides what the present for the vblank at vsync_us shows
+static void pick_picture(Presenter *presenter, int64_t now_us, int64_t vsync_us) {
+    VideoState *video_state = presenter->video_state;
+    PlayerState *player_state = sync_state->player_state;
+    int serial = atomic_load(&video_state->packet_queue->serial);
+    VideoPicture *next;
+
+    // Decoded before a seek, never shown
+    while ((next = picture_queue_peek(video_state, 0)) && next->serial != serial) {
+        video_state->frames_dropped_stale++;
+        picture_queue_advance(video_state);
+    }
+    if (presenter->showing && presenter->serial != serial) {
+        // The old picture stays up until the first one after the seek is due
+        presenter->showing = 0;
+    }
+
+    if (player_state->paused) {
+        // The clock stands still, only the controls get redrawn
+        presenter->clock_valid = 0;
+        return;
+    }
+
+    double clock = clock_at(presenter, now_us, vsync_us);
+    double tolerance = PRESENTER_CADENCE_TOLERANCE * presenter->vsync_period;
+
+    if (!next) {
+        if (presenter->showing && presenter->vsyncs_left > 1) {
+            presenter->vsyncs_left--;
+        } else if (presenter->showing) {
+            presenter->stats.starved++;
+        }
+        return;
+    }
+
+    double error = isnan(clock) ? 0.0 : clock - next->presentation_time_stamp; // > 0, switching now is late
+    if (!presenter->showing || fabs(error) > PRESENTER_RESYNC_THRESHOLD) {
+        // Nothing to keep a cadence with, show the next picture on the vblank nearest its pts
+        if (isnan(clock) || next->presentation_time_stamp <= clock + presenter->vsync_period / 2) {
+            show_next_picture(presenter, clock, 1);
+        }
+    } else if (presenter->vsyncs_left > 1) {
+        if (error > tolerance) {
+            // Behind the clock, cut this picture's slot short
+            presenter->stats.corrections++;
+            show_next_picture(presenter, clock, 0);
+        } else {
+            presenter->vsyncs_left--;
+        }
+    } else if (error < -tolerance) {
+        // Ahead of the clock, hold this picture for one more refresh
+        presenter->stats.corrections++;
+    } else {
+        show_next_picture(presenter, clock, 0);
+    }
+}
+
+static void record_interval(Presenter *presenter, int64_t interval_us) {
+    PresenterStats *stats = &presenter->stats;
+    double interval = interval_us / 1000000.0;
+
+    stats->intervals_us[stats->presents % PRESENTER_INTERVAL_HISTORY] = interval_us;
+    stats->presents++;
+    if (interval > presenter->vsync_period * 1.5) {
+        stats->missed_vsyncs++;
+    }
+    // Only intervals that look like a single vblank tell us the display's real rate
+    if (fabs(interval - presenter->refresh_period) < presenter->refresh_period * 0.25) {
+        presenter->vsync_period = 0.99 * presenter->vsync_period + 0.01 * interval;
+    }
+    trace_counter("present_interval_ms", interval_us / 1000.0);
+}
+
+static int compare_int64(const void *a, const void *b) {
+    int64_t x = *(const int64_t *) a;
+    int64_t y = *(const int64_t *) b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array, in milliseconds
+static double percentile_ms(const int64_t *sorted, int count, double p) {
+    int rank = (int) ceil(p * count) - 1;
+    return sorted[av_clip(rank, 0, count - 1)] / 1000.0;
+}
+
+static void presenter_log_stats(Presenter *presenter) {
+    PresenterStats *stats = &presenter->stats;
+    int count = (int) FFMIN(stats->presents, PRESENTER_INTERVAL_HISTORY);
+
+    log_info("Presenter: %lld vsyncs at %.3f Hz, %lld pictures, %lld starved, %lld cadence corrections, "
+             "%lld resyncs, %lld missed vsyncs",
+             (long long) stats->presents, 1.0 / presenter->vsync_period, (long long) stats->pictures,
+             (long long) stats->starved, (long long) stats->corrections, (long long) stats->resyncs,
+             (long long) stats->missed_vsyncs);
+    if (stats->seeks > 0) {
+        log_info("Seek latency over %lld seeks: avg %.1f ms, max %.1f ms", (long long) stats->seeks,
+                 stats->seek_latency_total_us / 1000.0 / stats->seeks, stats->seek_latency_max_us / 1000.0);
+    }
+    if (count == 0) {
+        return;
+    }
+
+    int64_t *intervals = malloc(2 * count * sizeof(int64_t));
+    if (!intervals) {
+        return;
+    }
+    // Jitter is how far each interval is off the refresh period
+    int64_t *jitter = intervals + count;
+    int64_t period_us = llrint(presenter->vsync_period * 1000000.0);
+    for (int i = 0; i < count; i++) {
+        intervals[i] = stats->intervals_us[i];
+        jitter[i] = llabs(intervals[i] - period_us);
+    }
+    qsort(intervals, count, sizeof(int64_t), compare_int64);
+    qsort(jitter, count, sizeof(int64_t), compare_int64);
+
+    log_info("Present interval over the last %d: p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms; "
+             "jitter p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms",
+             count, percentile_ms(intervals, count, 0.50), percentile_ms(intervals, count, 0.95),
+             percentile_ms(intervals, count, 0.99), intervals[count - 1] / 1000.0,
+             percentile_ms(jitter, count, 0.50), percentile_ms(jitter, count, 0.95),
+             percentile_ms(jitter, count, 0.99), jitter[count - 1] / 1000.0);
+    free(intervals);
+}
+
+int64_t presenter_present(Presenter *presenter) {
+    VideoState *video_state = presenter->video_state;
+    int64_t trace = trace_begin();
+    int64_t now = av_gettime_relative();
+    int64_t period_us = (int64_t) (presenter->vsync_period * 1000000.0);
+
+    // The vblank this present will land on, the first one still ahead of us
+    presenter->vsync_us = presenter->last_present_us + period_us;
+    if (presenter->vsync_us <= now) {
+        presenter->vsync_us += ((now - presenter->vsync_us) / period_us + 1) * period_us;
+    }
+    presenter->picked = NULL;
+    pick_picture(presenter, now, presenter->vsync_us);
+
+    VideoPicture *picture = presenter->picked;
+    if (picture) {
+        video_show_picture(video_state, picture);
+        record_seek_latency(presenter, picture, presenter->vsync_us);
+        atomic_fetch_add_explicit(&pipeline_stats.video_frames, 1, memory_order_relaxed);
+        // The texture has its own copy, the decoder can have the frame back
+        picture_queue_advance(video_state);
+    }
+    video_render(video_state);
+
+    now = av_gettime_relative();
+    if (now - presenter->last_present_us < period_us / 2 && presenter->vsync_us > now) {
+        // Present came straight back, vsync is off or the window isn't visible. The caller keeps the pace.
+        now = presenter->vsync_us;
+    }
+    record_interval(presenter, now - presenter->last_present_us);
+    presenter->last_present_us = now;
+
+    if (atomic_exchange(&presenter->log_request, 0)) {
+        presenter_log_stats(presenter);
+    }
+    trace_end("present", trace, presenter->showing ? presenter->shown_pts : NAN);
+    return now;
+}
+
+int presenter_start(Presenter *presenter, VideoState *video_state) {
+    SDL_Window *window = SDL_RenderGetWindow(video_state->renderer);
+    SDL_DisplayMode mode;
+    int refresh_rate = PRESENTER_DEFAULT_REFRESH_RATE;
+
+    memset(presenter, 0, sizeof(Presenter));
+    presenter->video_state = video_state;
+    atomic_init(&presenter->log_request, 0);
+
+    if (window && SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(window), &mode) == 0 &&
+        mode.refresh_rate > 0) {
+        refresh_rate = mode.refresh_rate;
+    } else {
+        log_warn("Display refresh rate unknown, assuming %d Hz", refresh_rate);
+    }
+    presenter->refresh_period = 1.0 / refresh_rate;
+    presenter->vsync_period = presenter->refresh_period;
+
+    AVRational frame_rate = video_state->stream->avg_frame_rate;
+    presenter->frame_duration = (frame_rate.num && frame_rate.den) ? av_q2d(av_inv_q(frame_rate)) : 40e-3;
+    log_info("Presenting at %d Hz, %.3f refreshes per frame", refresh_rate,
+             presenter->frame_duration / presenter->refresh_period);
+
+    // The first present goes out on the next vblank
+    presenter->last_present_us = av_gettime_relative();
+    presenter->running = 1;
+    return 0;
+}
+
+void presenter_request_stats(Presenter *presenter) {
+    atomic_store(&presenter->log_request, 1);
+}
+
+void presenter_stop(Presenter *presenter) {
+    if (!presenter->running) {
+        return;
+    }
+    presenter->running = 0;
+    presenter_log_stats(presenter);
+}
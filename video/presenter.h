@@ -0,0 +1,77 @@
+//
+// Created by Deshy on 2025/06/18.
+//
+
+#ifndef PRESENTER_H
+#define PRESENTER_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define PRESENTER_DEFAULT_REFRESH_RATE 60 // when the display mode doesn't say
+#define PRESENTER_INTERVAL_HISTORY 4096 // present intervals kept for the jitter percentiles, about a minute at 60 Hz
+#define PRESENTER_CADENCE_TOLERANCE 1.25 // refresh periods the video may drift off the clock before the cadence bends
+#define PRESENTER_RESYNC_THRESHOLD 0.25 // seconds off the clock after which pictures are picked by the clock alone
+#define PRESENTER_CLOCK_SMOOTHING 0.95 // per vsync, evens out the steps the audio clock moves in
+
+// Forward declarations
+typedef struct VideoState VideoState;
+typedef struct VideoPicture VideoPicture;
+
+typedef struct PresenterStats {
+    int64_t intervals_us[PRESENTER_INTERVAL_HISTORY]; // time between presents, ring buffer
+    int64_t presents;
+    int64_t pictures; // new pictures put on screen
+    int64_t starved; // vsyncs that were due a new picture but the queue was empty
+    int64_t corrections; // vsyncs added to or taken from a picture's slot to pull the video back to the clock
+    int64_t resyncs; // pictures picked by the clock alone, after a seek or a stall
+    int64_t missed_vsyncs; // presents that came more than one and a half refresh periods after the last one
+    int64_t seeks; // seeks whose first picture made it to the screen
+    int64_t seek_latency_total_us; // from the key press to that picture's present
+    int64_t seek_latency_max_us;
+} PresenterStats;
+
+/** Presents paced by vsync rather than a timer per frame, on the main thread that owns SDL's renderer, with input
+ * handled in between presents. For every vblank it works out what the master clock will read when the present
+ * reaches the screen and keeps the picture on screen for a whole number of refreshes matching its duration, carrying
+ * the remainder into the next one: 24p on 60 Hz comes out as an even 3:2 cadence instead of whatever order timer
+ * wakeups happen to land in. The cadence only bends, by one refresh at a time, once the video has drifted more than
+ * PRESENTER_CADENCE_TOLERANCE refreshes off the clock. **/
+typedef struct Presenter {
+    VideoState *video_state;
+    int running; // between presenter_start() and presenter_stop()
+    atomic_int log_request; // logged on the next present
+    int64_t vsync_us; // the vblank the present being prepared lands on
+    VideoPicture *picked; // to upload for that vblank, NULL keeps the texture as it is
+
+    double refresh_period; // seconds, from the display mode
+    double vsync_period; // measured, follows the display's real rate (59.94 Hz reports as 59)
+    int64_t last_present_us;
+
+    double clock_offset; // master clock minus wall clock, smoothed
+    int clock_valid;
+
+    int showing; // the texture holds a picture of serial
+    int serial;
+    double shown_pts;
+    double frame_duration; // of the picture on screen
+    int vsyncs_left; // of the picture's slot, including the current one
+    double cadence_carry; // fraction of a refresh owed to the next picture, +-0.5 for 24p on 60 Hz
+
+    PresenterStats stats;
+} Presenter;
+
+// Sets up pacing for video_state->renderer's display. Main thread only, like presenter_present().
+int presenter_start(Presenter *presenter, VideoState *video_state);
+
+/** Picks the picture for the next vblank from the picture queue, uploads it and presents, waiting for vsync. Returns
+ * the wall time (av_gettime_relative()) the present counts for: later than now when it came straight back without
+ * vsync and the caller should wait for events until then. Main thread only. **/
+int64_t presenter_present(Presenter *presenter);
+
+// Logs frame pacing and present interval percentiles on the next present, safe from any thread
+void presenter_request_stats(Presenter *presenter);
+
+// Logs the final frame pacing. No-op if it isn't running.
+void presenter_stop(Presenter *presenter);
+#endif //PRESENTER_H
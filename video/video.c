@@ -2,123 +2,193 @@
 // Created by Deshy on 2025/05/17.
 //
 #include "video.h"
-#include <SDL_events.h>
-#include <SDL_timer.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL_cpuinfo.h>
 #include <libswscale/swscale.h>
 #include <libavutil/time.h>
 #include "../libs/microlog/microlog.h"
 #include "../player/player.h"
 #include  "../audio/audio.h"
 #include "../utils/sync.h"
+#include "../utils/trace.h"
 
-#define AV_SYNC_THRESHOLD 0.01
 #define AV_NOSYNC_THRESHOLD 10.0
 
-void set_get_audio_clock_fn(GetAudioClockFn fn, VideoState *video_state, void *userdata) {
-    AudioState *audio_state = (AudioState *) userdata;
-    video_state->get_audio_clock = fn;
-    video_state->audio_clock_userdata = audio_state;
-    log_info("Set get audio clock function and userdata");
+static int upload_picture(VideoState *video_state, VideoPicture *video_picture);
+
+// Release the picture at the read index and let queue_picture() know there is space
+void picture_queue_advance(VideoState *video_state) {
+    // Hand the decoder's buffer back as soon as the frame has been shown
+    av_frame_unref(video_state->picture_queue[video_state->picture_queue_read_index].frame);
+
+    if (++video_state->picture_queue_read_index == video_state->picture_queue_capacity) {
+        log_info("Resetting picture queue read index");
+        video_state->picture_queue_read_index = 0;
+    }
+
+    SDL_LockMutex(video_state->picture_queue_mutex);
+    video_state->picture_queue_size--;
+    log_info("Decremented picture queue size: %d", video_state->picture_queue_size);
+    SDL_CondSignal(video_state->picture_queue_cond);
+    SDL_UnlockMutex(video_state->picture_queue_mutex);
 }
 
-static Uint32 sdl_refresh_timer_callback(Uint32 interval, void *user_data) {
-    SDL_Event event;
-    event.type = FF_REFRESH_EVENT;
-    event.user.data1 = user_data;
-    SDL_PushEvent(&event);
-    log_info("Pushed refresh event");
-    return 0;
+VideoPicture *picture_queue_peek(VideoState *video_state, int offset) {
+    SDL_LockMutex(video_state->picture_queue_mutex);
+    int size = video_state->picture_queue_size;
+    SDL_UnlockMutex(video_state->picture_queue_mutex);
+
+    if (offset >= size) {
+        return NULL;
+    }
+    return &video_state->picture_queue[(video_state->picture_queue_read_index + offset) %
+                                       video_state->picture_queue_capacity];
 }
 
-void schedule_refresh(VideoState *video_state, int delay) {
-    log_info("Scheduling refresh with delay: %d", delay);
-    SDL_AddTimer(delay, sdl_refresh_timer_callback, video_state);
+static const struct {
+    enum AVDiscard skip_loop_filter;
+    enum AVDiscard skip_frame;
+    const char *description;
+} load_shed_levels[LOAD_SHED_LEVEL_MAX + 1] = {
+    {AVDISCARD_DEFAULT, AVDISCARD_DEFAULT, "full quality"},
+    {AVDISCARD_NONREF, AVDISCARD_DEFAULT, "no deblocking on non-reference frames"},
+    {AVDISCARD_ALL, AVDISCARD_DEFAULT, "no deblocking"},
+    {AVDISCARD_ALL, AVDISCARD_NONREF, "no deblocking, non-reference frames skipped"},
+    {AVDISCARD_ALL, AVDISCARD_NONKEY, "no deblocking, keyframes only"},
+};
+
+/** Called by the presenter for every picture it puts on screen. Sheds a level when the smoothed lag stays high while the
+ * picture queue runs dry, i.e. decode rather than display is what can't keep up, and gives one back once the lag has
+ * been low for a while. **/
+void load_shedder_observe(VideoState *video_state, double lag) {
+    LoadShedder *shedder = &video_state->load_shedder;
+
+    if (!shedder->enabled || isnan(lag) || fabs(lag) >= AV_NOSYNC_THRESHOLD) {
+        return;
+    }
+    shedder->lag_average = LOAD_SHED_LAG_SMOOTHING * shedder->lag_average + (1.0 - LOAD_SHED_LAG_SMOOTHING) * lag;
+
+    int64_t now = av_gettime_relative();
+    int64_t since_change = now - shedder->last_change_us;
+    int level = atomic_load(&shedder->level);
+    int new_level = level;
+
+    if (shedder->lag_average > LOAD_SHED_RAISE_LAG && video_state->picture_queue_size <= 1 &&
+        level < LOAD_SHED_LEVEL_MAX && since_change >= LOAD_SHED_RAISE_HOLD_US) {
+        new_level = level + 1;
+        shedder->raises++;
+    } else if (shedder->lag_average < LOAD_SHED_LOWER_LAG && level > 0 && since_change >= LOAD_SHED_LOWER_HOLD_US) {
+        new_level = level - 1;
+        shedder->lowers++;
+    } else {
+        return;
+    }
+
+    atomic_store(&shedder->level, new_level);
+    shedder->last_change_us = now;
+    log_warn("Load shedding level %d -> %d, %s (lag %.0f ms, %d pictures queued)", level, new_level,
+             load_shed_levels[new_level].description, shedder->lag_average * 1000, video_state->picture_queue_size);
+    trace_counter("load_shed_level", new_level);
 }
 
-void video_refresh_timer(void *userdata) {
-    VideoState *video_state = (VideoState *) userdata;
-    VideoPicture *video_picture;
+// Decode thread, between packets
+static void load_shedder_apply(VideoState *video_state) {
+    LoadShedder *shedder = &video_state->load_shedder;
+    int level = atomic_load(&shedder->level);
 
-    double actual_delay;
-    double delay;
-    double sync_threshold;
-    double ref_clock;
-    double diff;
-
-    if (video_state->stream) {
-        // Pull from the queue when we have something in the queue and then set timer so we display the next video frame
-        if (video_state->picture_queue_size == 0) {
-            log_warn("No picture in queue");
-            schedule_refresh(video_state, 1);
-        } else {
-            video_picture = &video_state->picture_queue[video_state->picture_queue_read_index];
-
-            video_state->video_current_pts = video_picture->presentation_time_stamp;
-            video_state->video_current_pts_time = av_gettime();
-
-            delay = video_picture->presentation_time_stamp - video_state->frame_last_presentation_time_stamp;
-            if (delay < 0 || delay >= 1.0) {
-                log_warn("Incorrect delay, using previous one");
-                delay = video_state->frame_last_delay;
-            }
-
-            video_state->frame_last_delay = delay;
-            video_state->frame_last_presentation_time_stamp = video_picture->presentation_time_stamp;
-
-            if (sync_state->av_sync_type == AV_SYNC_AUDIO_MASTER) {
-                ref_clock = video_state->get_audio_clock(video_state->audio_clock_userdata);
-            } else if (sync_state->av_sync_type == AV_SYNC_EXTERNAL_MASTER) {
-                ref_clock = get_external_clock();
-            } else {
-                ref_clock = video_picture->presentation_time_stamp;
-            }
-
-            diff = video_picture->presentation_time_stamp - ref_clock;
-            sync_threshold = (delay > AV_SYNC_THRESHOLD) ? delay : AV_SYNC_THRESHOLD;
-
-            if (fabs(diff) < AV_NOSYNC_THRESHOLD) {
-                if (diff <= -sync_threshold) {
-                    delay = 0;
-                } else if (diff >= sync_threshold) {
-                    delay = 2 * delay;
-                }
-            }
-
-            video_state->frame_timer += delay;
-            actual_delay = video_state->frame_timer - (av_gettime() / 1000000.0);
-            // note :av_gettime returns the time in microseconds
-
-            if (actual_delay < 0.010) {
-                log_warn("Actual delay too small, setting to 0.010");
-                actual_delay = 0.010;
-            }
-
-            schedule_refresh(video_state, (int) (actual_delay * 1000 + 0.5));
-            video_display(video_state);
-
-            // update queue for the next picture
-            if (++video_state->picture_queue_read_index == VIDEO_PICTURE_QUEUE_SIZE) {
-                log_info("Resetting picture queue read index");
-                video_state->picture_queue_read_index = 0;
-            }
-
-            SDL_LockMutex(video_state->picture_queue_mutex);
-            video_state->picture_queue_size--;
-            log_info("Decremented picture queue size: %d", video_state->picture_queue_size);
-            SDL_CondSignal(video_state->picture_queue_cond);
-            SDL_UnlockMutex(video_state->picture_queue_mutex);
-        }
-    } else {
-        schedule_refresh(video_state, 100);
+    if (level == shedder->applied_level) {
+        return;
     }
+    // Frame threads pick these up from the user context with the next packet
+    video_state->codec_context->skip_loop_filter = load_shed_levels[level].skip_loop_filter;
+    video_state->codec_context->skip_frame = load_shed_levels[level].skip_frame;
+    shedder->applied_level = level;
+    log_info("Decoder now running with %s", load_shed_levels[level].description);
 }
 
-void alloc_picture(void *userdata) {
-    VideoState *video_state = (VideoState *) userdata;
-    VideoPicture *video_picture;
+void video_get_frame_stats(VideoState *video_state, VideoFrameCounts *counts) {
+    counts->on_time = atomic_load(&video_state->frame_stats.on_time);
+    counts->late = atomic_load(&video_state->frame_stats.late);
+    counts->dropped_late = atomic_load(&video_state->frame_stats.dropped_late);
+    counts->dropped_stale = video_state->frames_dropped_stale;
+}
 
-    video_picture = &video_state->picture_queue[video_state->picture_queue_write_index];
+void video_log_frame_stats(VideoState *video_state) {
+    VideoFrameCounts counts;
+    video_get_frame_stats(video_state, &counts);
+    int64_t shown = counts.on_time + counts.late;
+    int64_t dropped = counts.dropped_late;
+
+    log_info("Video frames: %lld shown (%lld on time, %lld late), %lld dropped late, %.1f%% dropped, %lld stale "
+             "after seeks",
+             (long long) shown, (long long) counts.on_time, (long long) counts.late, (long long) dropped,
+             shown + dropped ? 100.0 * dropped / (shown + dropped) : 0.0, (long long) counts.dropped_stale);
+    log_info("Load shedding: level %d, raised %lld times, lowered %lld times",
+             atomic_load(&video_state->load_shedder.level), (long long) video_state->load_shedder.raises,
+             (long long) video_state->load_shedder.lowers);
+}
+
+/** Null video sink for headless runs. Takes the next picture once clock has reached it (NAN takes it straight away) and
+ * does the same upload work the presenter would, minus presenting and vsync. Without a renderer only the queue
+ * is drained. Returns 1 when a picture was consumed. **/
+int video_present_headless(VideoState *video_state, double clock) {
+    if (video_state->picture_queue_size == 0) {
+        return 0;
+    }
+
+    VideoPicture *video_picture = &video_state->picture_queue[video_state->picture_queue_read_index];
+    if (video_picture->serial != atomic_load(&video_state->packet_queue->serial)) {
+        video_state->frames_dropped_stale++;
+        picture_queue_advance(video_state);
+        return 1;
+    }
+    if (!isnan(clock) && video_picture->presentation_time_stamp > clock) {
+        return 0;
+    }
+
+    clock_set(&sync_state->video_clock, video_picture->presentation_time_stamp, video_picture->serial);
+    if (video_state->renderer && upload_picture(video_state, video_picture) < 0) {
+        log_error("Could not upload picture");
+    }
+    atomic_fetch_add_explicit(&pipeline_stats.video_frames, 1, memory_order_relaxed);
+
+    picture_queue_advance(video_state);
+    return 1;
+}
 
+int picture_queue_headroom(VideoState *video_state) {
+    SDL_LockMutex(video_state->picture_queue_mutex);
+    int headroom = video_state->picture_queue_capacity - video_state->picture_queue_size;
+    SDL_UnlockMutex(video_state->picture_queue_mutex);
+    return headroom;
+}
+
+// SDL texture format the frame can be uploaded into as is, or SDL_PIXELFORMAT_UNKNOWN when it needs sws_scale
+static Uint32 direct_texture_format(const AVFrame *frame) {
+    // Bottom-up frames have negative strides, let swscale deal with those
+    for (int i = 0; i < 3 && frame->data[i]; i++) {
+        if (frame->linesize[i] <= 0) {
+            return SDL_PIXELFORMAT_UNKNOWN;
+        }
+    }
+
+    // SDL renders YUV textures as limited range, full-range (JPEG) frames would come out with crushed blacks
+    if (frame->color_range == AVCOL_RANGE_JPEG) {
+        return SDL_PIXELFORMAT_UNKNOWN;
+    }
+
+    switch (frame->format) {
+        case AV_PIX_FMT_YUV420P:
+            return SDL_PIXELFORMAT_IYUV;
+        case AV_PIX_FMT_NV12:
+            return SDL_PIXELFORMAT_NV12;
+        default:
+            return SDL_PIXELFORMAT_UNKNOWN;
+    }
+}
+
+static void alloc_picture(VideoState *video_state, int width, int height, Uint32 format) {
     if (video_state->texture) {
         log_warn("Releasing old texture");
         SDL_DestroyTexture(video_state->texture);
@@ -127,33 +197,134 @@ void alloc_picture(void *userdata) {
     SDL_LockMutex(video_state->screen_mutex);
     // Allocate a place to put YUV image
     video_state->texture = SDL_CreateTexture(video_state->renderer,
-                                             SDL_PIXELFORMAT_IYUV,
+                                             format,
                                              SDL_TEXTUREACCESS_STREAMING,
-                                             video_state->stream->codecpar->width,
-                                             video_state->stream->codecpar->height);
+                                             width,
+                                             height);
     log_info("Created texture: %p", video_state->texture);
 
     SDL_UnlockMutex(video_state->screen_mutex);
 
-    video_picture->width = video_state->stream->codecpar->width;
-    video_picture->height = video_state->stream->codecpar->height;
-    video_picture->allocated = 1;
-
-    log_info("Allocated video picture: %dx%d", video_picture->width, video_picture->height);
+    video_state->texture_width = width;
+    video_state->texture_height = height;
+    video_state->texture_format = format;
+    log_info("Allocated video texture: %dx%d, %s", width, height,
+             format == SDL_PIXELFORMAT_NV12 ? "NV12" : "IYUV");
 
     SDL_SetTextureBlendMode(video_state->texture, SDL_BLENDMODE_NONE);
 }
 
-int queue_picture(VideoState *video_state, AVFrame *frame, double presentation_time_stamp) {
+// Anything SDL can't take directly is converted to YUV420P straight into the locked texture
+static int convert_picture(VideoState *video_state, AVFrame *frame) {
+    void *pixels;
+    int pitch;
+
+    video_state->sws_ctx = sws_getCachedContext(video_state->sws_ctx,
+                                                frame->width,
+                                                frame->height,
+                                                frame->format,
+                                                frame->width,
+                                                frame->height,
+                                                AV_PIX_FMT_YUV420P,
+                                                SWS_BILINEAR, NULL, NULL, NULL);
+    if (!video_state->sws_ctx) {
+        log_error("Could not create SWS context");
+        return -1;
+    }
+    /** The texture is shown as limited range, so full-range input is scaled into it. Set on every frame, the cached
+     * context is reused across frames of the same format whatever range they are tagged with. **/
+    int full_range = frame->color_range == AVCOL_RANGE_JPEG || frame->format == AV_PIX_FMT_YUVJ420P ||
+                     frame->format == AV_PIX_FMT_YUVJ422P || frame->format == AV_PIX_FMT_YUVJ444P;
+    const int *coefficients = sws_getCoefficients(SWS_CS_DEFAULT);
+    sws_setColorspaceDetails(video_state->sws_ctx, coefficients, full_range, coefficients, 0, 0, 1 << 16, 1 << 16);
+
+    int64_t trace = trace_begin();
+    if (SDL_LockTexture(video_state->texture, NULL, &pixels, &pitch) < 0) {
+        log_error("Could not lock texture");
+        return -1;
+    }
+    trace_end("lock_texture", trace, NAN);
+    // Prepare destination planes (YUV format)
+    // Since YUV420P uses 3 channels , 3 planes hav to be set
+    uint8_t *dst_planes[3];
+    dst_planes[0] = pixels; // Y plane
+    dst_planes[1] = pixels + frame->height * pitch; // U plane
+    dst_planes[2] = dst_planes[1] + (frame->height * pitch / 4); // V plane
+
+    int dst_linesize[3] = {pitch, pitch / 2, pitch / 2};
+
+    // Convert the image into YUV format that SDL uses
+    trace = trace_begin();
+    int64_t begin = stats_begin();
+    sws_scale(video_state->sws_ctx,
+              (uint8_t const * const *) frame->data,
+              frame->linesize,
+              0,
+              frame->height,
+              dst_planes,
+              dst_linesize);
+    stats_end(STATS_SWS, begin);
+    trace_end("sws", trace, NAN);
+    log_info("Converted image to YUV format");
+
+    SDL_UnlockTexture(video_state->texture);
+    return 0;
+}
+
+/** The single uploader: runs on the main thread right before the picture is shown, so the video thread never
+ * touches the renderer and only ever queues frame references. YUV420P and NV12 frames, i.e. most 8-bit H.264/HEVC,
+ * go straight from the decoder's planes into the texture. **/
+static int upload_picture(VideoState *video_state, VideoPicture *video_picture) {
+    AVFrame *frame = video_picture->frame;
+    Uint32 direct_format = direct_texture_format(frame);
+    Uint32 format = direct_format != SDL_PIXELFORMAT_UNKNOWN ? direct_format : SDL_PIXELFORMAT_IYUV;
+
+    // allocate or resize the texture
+    if (!video_state->texture ||
+        video_state->texture_width != frame->width ||
+        video_state->texture_height != frame->height ||
+        video_state->texture_format != format) {
+        log_info("Allocating new video texture");
+        alloc_picture(video_state, frame->width, frame->height, format);
+        if (!video_state->texture) {
+            log_error("Could not create video texture: %s", SDL_GetError());
+            return -1;
+        }
+    }
+
+    if (direct_format == SDL_PIXELFORMAT_UNKNOWN) {
+        // sws writes straight into the locked texture and is charged to its own stage, there is no upload after it
+        return convert_picture(video_state, frame);
+    }
+
+    int64_t trace = trace_begin();
+    int64_t begin = stats_begin();
+    int ret;
+    if (direct_format == SDL_PIXELFORMAT_IYUV) {
+        ret = SDL_UpdateYUVTexture(video_state->texture, NULL,
+                                   frame->data[0], frame->linesize[0],
+                                   frame->data[1], frame->linesize[1],
+                                   frame->data[2], frame->linesize[2]);
+    } else {
+        ret = SDL_UpdateNVTexture(video_state->texture, NULL,
+                                  frame->data[0], frame->linesize[0],
+                                  frame->data[1], frame->linesize[1]);
+    }
+    stats_end(STATS_UPLOAD, begin);
+    trace_end("upload", trace, video_picture->presentation_time_stamp);
+    return ret;
+}
+
+int queue_picture(VideoState *video_state, AVFrame *frame, double presentation_time_stamp, int serial) {
     VideoPicture *video_picture;
 
 
     // Inorder to write to the queue, we need to wait for the buffer to clear out so we have space to store
-    // the VideoPicture.
-
+    // the VideoPicture. The span includes that wait, so back pressure from the display shows up in the trace.
+    int64_t trace = trace_begin();
     SDL_LockMutex(video_state->picture_queue_mutex);
-    while (video_state->picture_queue_size >= VIDEO_PICTURE_QUEUE_SIZE && !(*video_state->quit)) {
-        log_warn("Picture queue full, waiting for space");
+    while (video_state->picture_queue_size >= video_state->picture_queue_capacity && !(*video_state->quit)) {
+        log_debug("Picture queue full, waiting for space");
         SDL_CondWait(video_state->picture_queue_cond, video_state->picture_queue_mutex);
     }
     SDL_UnlockMutex(video_state->picture_queue_mutex);
@@ -164,166 +335,133 @@ int queue_picture(VideoState *video_state, AVFrame *frame, double presentation_t
         return -1;
     }
 
-    video_picture = &video_state->picture_queue[video_state->picture_queue_write_index];
-
-    // allocate or resize the buffer
-    if (!video_state->texture ||
-        video_picture->width != video_state->codec_context->width ||
-        video_picture->height != video_state->codec_context->height) {
-        log_info("Allocating new video picture buffer");
-        video_picture->allocated = 0;
-        alloc_picture(video_state);
-        if (*video_state->quit) {
-            log_warn("Video state quit, not queuing picture");
-            return -1;
-        }
+    if (serial != atomic_load(&video_state->packet_queue->serial)) {
+        // A seek happened while we were waiting for space
+        video_state->frames_dropped_stale++;
+        trace_end("queue_picture", trace, presentation_time_stamp);
+        return 0;
     }
 
-    // Now we convert the image into YUV format that SDL can use
-    if (video_state->texture) {
-        void *pixels;
-        int pitch;
+    video_picture = &video_state->picture_queue[video_state->picture_queue_write_index];
 
-        video_picture->presentation_time_stamp = presentation_time_stamp;
+    // The slot takes over the decoder's buffer, no copy until the uploader converts it into the texture
+    av_frame_move_ref(video_picture->frame, frame);
+    video_picture->width = video_picture->frame->width;
+    video_picture->height = video_picture->frame->height;
+    video_picture->allocated = 1;
+    video_picture->presentation_time_stamp = presentation_time_stamp;
+    video_picture->serial = serial;
 
-        if (SDL_LockTexture(video_state->texture, NULL, &pixels, &pitch) < 0) {
-            log_error("Could not lock texture");
-            return -1;
-        }
-        // Prepare destination planes (YUV format)
-        // Since YUV420P uses 3 channels , 3 planes hav to be set
-        uint8_t *dst_planes[3];
-        dst_planes[0] = pixels; // Y plane
-        dst_planes[1] = pixels + video_state->codec_context->height * pitch; // U plane
-        dst_planes[2] = dst_planes[1] + (video_state->codec_context->height * pitch / 4); // V plane
-
-        int dst_linesize[3] = {pitch, pitch / 2, pitch / 2};
-
-        // Convert the image into YUV format that SDL uses
-        sws_scale(video_state->sws_ctx,
-                  (uint8_t const * const *) frame->data,
-                  frame->linesize,
-                  0,
-                  frame->height,
-                  dst_planes,
-                  dst_linesize);
-        log_info("Converted image to YUV format");
-
-        SDL_UnlockTexture(video_state->texture);
-
-        if (++video_state->picture_queue_write_index == VIDEO_PICTURE_QUEUE_SIZE) {
-            log_info("Resetting picture queue write index");
-            video_state->picture_queue_write_index = 0;
-        }
-        SDL_LockMutex(video_state->picture_queue_mutex);
-        video_state->picture_queue_size++;
-        log_info("Incremented picture queue size: %d", video_state->picture_queue_size);
-        SDL_UnlockMutex(video_state->picture_queue_mutex);
+    if (++video_state->picture_queue_write_index == video_state->picture_queue_capacity) {
+        log_info("Resetting picture queue write index");
+        video_state->picture_queue_write_index = 0;
     }
+    SDL_LockMutex(video_state->picture_queue_mutex);
+    video_state->picture_queue_size++;
+    int pictures = video_state->picture_queue_size;
+    log_info("Incremented picture queue size: %d, headroom: %d",
+             video_state->picture_queue_size,
+             video_state->picture_queue_capacity - video_state->picture_queue_size);
+    SDL_UnlockMutex(video_state->picture_queue_mutex);
+    trace_end("queue_picture", trace, presentation_time_stamp);
+    trace_counter("pictures", pictures);
     return 0;
 }
 
 int video_thread(void *userdata) {
     PlayerState *player_state = (PlayerState *) userdata;
     VideoState *video_state = player_state->video_state;
-    AVPacket *packet = av_packet_alloc();
-    AVFrame *frame = av_frame_alloc();
+    AVFrame *frame = object_pool_get(&video_state->frame_pool);
     double presentation_time_stamp; // Tells us when the video should be displayed
+    int ret;
 
+    trace_thread_name("video decode");
     while (true) {
         wait_if_paused();
+        load_shedder_apply(video_state);
 
-        if (packet_queue_get(video_state->packet_queue, packet, 1) < 0) {
-            log_warn("Nothing in the video queue");
+        int64_t trace = trace_begin();
+        ret = decoder_decode_frame(&video_state->decoder, frame);
+        atomic_store(&video_state->finished_serial, video_state->decoder.finished);
+        if (ret < 0) {
+            log_warn("Video queue aborted");
             break;
         }
-        //send packet for decoding
-        if (avcodec_send_packet(video_state->codec_context, packet) < 0) {
-            log_error("Failed to send packet for decoding");
-            av_packet_unref(packet);
+        if (ret == 0) {
+            // End of stream, every frame is out. The next call blocks until a seek brings new packets.
             continue;
         }
-        log_info("Sent video packet for decoding");
 
-        // Get decoded frame.
-        if (avcodec_receive_frame(video_state->codec_context, frame) < 0) {
-            log_error("Failed to get a frame");
-            // TODO: What do we do when we fail to get a frame???
-            // Just continue for now and hope everything works :D
-            continue;
-        }
-
-        if (packet->dts == AV_NOPTS_VALUE) {
-            log_warn("Undefined DTS value, using best effort");
-            presentation_time_stamp = frame->best_effort_timestamp;
+        // best_effort_timestamp is in pkt_timebase and accounts for reordering, packet dts does not
+        if (frame->best_effort_timestamp == AV_NOPTS_VALUE) {
+            log_warn("Undefined frame timestamp, predicting from the previous frame");
+            presentation_time_stamp = 0;
         } else {
-            presentation_time_stamp = packet->dts;
+            presentation_time_stamp = frame->best_effort_timestamp * av_q2d(video_state->stream->time_base);
         }
-
-        presentation_time_stamp *= av_q2d(video_state->stream->time_base);
         log_info("Got video frame: presentation_time_stamp=%f", presentation_time_stamp);
+        trace_end("decode", trace, presentation_time_stamp);
 
         presentation_time_stamp = synchronize_video(video_state, frame, presentation_time_stamp);
-        if (queue_picture(video_state, frame, presentation_time_stamp) < 0) {
+        if (queue_picture(video_state, frame, presentation_time_stamp, video_state->decoder.packet_serial) < 0) {
             log_error("Failed to queue picture");
             break;
         }
         log_info("Queued picture");
-
-        av_packet_unref(packet);
     }
 
-    av_free(frame);
-
-    av_free(packet);
+    object_pool_put(&video_state->frame_pool, frame);
 
     return 0;
 }
 
-void video_display(VideoState *video_state) {
-    if (!video_state || !video_state->texture || !video_state->stream) {
-        log_error("Invalid video state or missing components");
-        return;
-    }
-
-    VideoPicture *video_picture = &video_state->picture_queue[video_state->picture_queue_read_index];
-    if (!video_picture->allocated) {
-        log_warn("No frame available to display");
-        return;
-    }
-
-    // Calculate display aspect ratio
-    AVRational sar = video_state->stream->codecpar->sample_aspect_ratio;
-    float aspect_ratio = (float) video_picture->width / (float) video_picture->height;
-    if (sar.num != 0) {
-        aspect_ratio = av_q2d(sar) * video_picture->width / video_picture->height;
+int video_show_picture(VideoState *video_state, VideoPicture *video_picture) {
+    if (upload_picture(video_state, video_picture) < 0) {
+        log_error("Could not upload picture");
+        return -1;
     }
+    clock_set(&sync_state->video_clock, video_picture->presentation_time_stamp, video_picture->serial);
+    clock_sync_to_slave(&sync_state->external_clock, &sync_state->video_clock);
+    video_state->display_sample_aspect_ratio = video_picture->frame->sample_aspect_ratio.num
+                                                   ? video_picture->frame->sample_aspect_ratio
+                                                   : video_state->stream->codecpar->sample_aspect_ratio;
+    return 0;
+}
 
+void video_render(VideoState *video_state) {
+    PlayerState *player_state = sync_state->player_state;
     int render_width;
     int render_height;
-    SDL_GetRendererOutputSize(video_state->renderer, &render_width, &render_height);
 
-    // Calculate target dimensions maintaining aspect ratio
-    int width = render_height * aspect_ratio;
-    int height = render_height;
+    SDL_LockMutex(video_state->screen_mutex);
+    SDL_RenderClear(video_state->renderer);
 
-    if (width > render_width) {
-        width = render_width;
-        height = width / aspect_ratio;
-    }
+    if (video_state->texture) {
+        // Calculate display aspect ratio
+        AVRational sar = video_state->display_sample_aspect_ratio;
+        float aspect_ratio = (float) video_state->texture_width / (float) video_state->texture_height;
+        if (sar.num != 0) {
+            aspect_ratio = av_q2d(sar) * video_state->texture_width / video_state->texture_height;
+        }
 
-    int x = (render_width - width) / 2;
-    int y = (render_height - height) / 2;
+        SDL_GetRendererOutputSize(video_state->renderer, &render_width, &render_height);
 
-    SDL_Rect rect = {x, y, width, height};
+        // Calculate target dimensions maintaining aspect ratio
+        int width = render_height * aspect_ratio;
+        int height = render_height;
 
-    SDL_LockMutex(video_state->screen_mutex);
-    SDL_RenderClear(video_state->renderer);
-    log_info("Cleared renderer");
-    SDL_RenderCopy(video_state->renderer, video_state->texture, NULL, &rect);
-    log_info("Copied texture to renderer");
+        if (width > render_width) {
+            width = render_width;
+            height = width / aspect_ratio;
+        }
+
+        int x = (render_width - width) / 2;
+        int y = (render_height - height) / 2;
+
+        SDL_Rect rect = {x, y, width, height};
+        SDL_RenderCopy(video_state->renderer, video_state->texture, NULL, &rect);
+    }
 
-    PlayerState *player_state = sync_state->player_state;
     SDL_RenderCopy(video_state->renderer, player_state->rewind_texture, NULL, &player_state->rewind_button);
 
     SDL_Texture *pause_play_texture = player_state->paused ? player_state->play_texture : player_state->pause_texture;
@@ -331,16 +469,16 @@ void video_display(VideoState *video_state) {
 
     SDL_RenderCopy(video_state->renderer, player_state->forward_texture, NULL, &player_state->forward_button);
 
-
+    // Blocks until the next vblank with SDL_RENDERER_PRESENTVSYNC, which is what paces the presenter
     SDL_RenderPresent(video_state->renderer);
-    log_info("Presented renderer");
     SDL_UnlockMutex(video_state->screen_mutex);
 }
 
-static int find_stream_index(VideoState *video_state, AVFormatContext *format_context) {
+// wanted_stream is the cache's earlier pick, -1 leaves it to av_find_best_stream()
+static int find_stream_index(VideoState *video_state, AVFormatContext *format_context, int wanted_stream) {
     video_state->stream_index = av_find_best_stream(format_context,
                                                     AVMEDIA_TYPE_VIDEO,
-                                                    -1,
+                                                    wanted_stream,
                                                     -1,
                                                     NULL,
                                                     0);
@@ -354,7 +492,90 @@ static int find_stream_index(VideoState *video_state, AVFormatContext *format_co
     return 0;
 }
 
-int stream_component_open(VideoState *video_state, AVFormatContext *format_context) {
+static int thread_type_from_string(const char *value) {
+    if (!value || strcmp(value, "auto") == 0) {
+        return 0;
+    } else if (strcmp(value, "frame") == 0) {
+        return FF_THREAD_FRAME;
+    } else if (strcmp(value, "slice") == 0) {
+        return FF_THREAD_SLICE;
+    }
+    log_warn("Unknown decoder thread type %s, using auto", value);
+    return 0;
+}
+
+static const char *thread_type_name(int thread_type) {
+    switch (thread_type) {
+        case FF_THREAD_FRAME:
+            return "frame";
+        case FF_THREAD_SLICE:
+            return "slice";
+        case FF_THREAD_FRAME | FF_THREAD_SLICE:
+            return "frame+slice";
+        default:
+            return "none";
+    }
+}
+
+/** Picks thread_type/thread_count before avcodec_open2(). More pixels per frame means more work to spread, so the
+ * thread count scales with resolution and is capped by the available cores. Frame threading gives the best throughput
+ * when the codec supports it, slice threading is the fallback. CLI options win over the NOT_VLC_DECODER_THREADS and
+ * NOT_VLC_DECODER_THREAD_TYPE environment variables. **/
+static void configure_decoder_threads(AVCodecContext *codec_ctx, const AVCodec *codec, const PlayerOptions *options) {
+    int cores = SDL_GetCPUCount();
+    int64_t pixels = (int64_t) codec_ctx->width * codec_ctx->height;
+    int thread_count = options->decoder_threads;
+    int thread_type = options->decoder_thread_type;
+
+    if (thread_count <= 0 && SDL_getenv("NOT_VLC_DECODER_THREADS")) {
+        thread_count = atoi(SDL_getenv("NOT_VLC_DECODER_THREADS"));
+    }
+    if (thread_type == 0) {
+        thread_type = thread_type_from_string(SDL_getenv("NOT_VLC_DECODER_THREAD_TYPE"));
+    }
+
+    if (thread_count <= 0) {
+        if (pixels <= 720 * 576) {
+            thread_count = 4;
+        } else if (pixels <= 1920 * 1088) {
+            thread_count = 8;
+        } else if (pixels <= 3840 * 2160) {
+            thread_count = 16;
+        } else {
+            thread_count = 24;
+        }
+        thread_count = FFMAX(1, FFMIN(thread_count, cores));
+    }
+
+    if (thread_type == 0) {
+        if (codec->capabilities & AV_CODEC_CAP_FRAME_THREADS) {
+            thread_type |= FF_THREAD_FRAME;
+        }
+        if (codec->capabilities & AV_CODEC_CAP_SLICE_THREADS) {
+            thread_type |= FF_THREAD_SLICE;
+        }
+    }
+
+    codec_ctx->thread_count = thread_count;
+    codec_ctx->thread_type = thread_type;
+    log_info("Requested %d %s decoder threads for %dx%d %s on %d cores",
+             thread_count, thread_type_name(thread_type), codec_ctx->width, codec_ctx->height, codec->name, cores);
+}
+
+/** Frame threading holds thread_count - 1 frames inside the decoder before the first one comes out. The sync model
+ * needs to know so the first frame after a seek isn't treated as late and the demuxer keeps enough packets queued to
+ * fill the pipeline. **/
+static double decoder_delay(AVCodecContext *codec_ctx, AVFormatContext *format_context, AVStream *stream) {
+    if (!(codec_ctx->active_thread_type & FF_THREAD_FRAME) || codec_ctx->thread_count <= 1) {
+        return 0.0;
+    }
+
+    AVRational frame_rate = av_guess_frame_rate(format_context, stream, NULL);
+    double frame_duration = (frame_rate.num && frame_rate.den) ? av_q2d(av_inv_q(frame_rate)) : 40e-3;
+    return (codec_ctx->thread_count - 1) * frame_duration;
+}
+
+int stream_component_open(VideoState *video_state, AVFormatContext *format_context, const PlayerOptions *options) {
     int ret = 0;
     const AVCodec *codec = avcodec_find_decoder(format_context->streams[video_state->stream_index]->codecpar->codec_id);
     AVCodecContext *codec_ctx;
@@ -379,6 +600,9 @@ int stream_component_open(VideoState *video_state, AVFormatContext *format_conte
         goto cleanup;
     }
 
+    codec_ctx->pkt_timebase = format_context->streams[video_state->stream_index]->time_base;
+    configure_decoder_threads(codec_ctx, codec, options);
+
     if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
         log_error("Could not open codec");
         ret = -1;
@@ -388,39 +612,24 @@ int stream_component_open(VideoState *video_state, AVFormatContext *format_conte
 
     video_state->stream = format_context->streams[video_state->stream_index];
     video_state->codec_context = codec_ctx;
-    video_state->sws_ctx = sws_getContext(video_state->codec_context->width,
-                                          video_state->codec_context->height,
-                                          video_state->codec_context->pix_fmt,
-                                          video_state->codec_context->width,
-                                          video_state->codec_context->height,
-                                          AV_PIX_FMT_YUV420P,
-                                          SWS_BILINEAR, NULL, NULL, NULL
-    );
+    video_state->decoder_delay = decoder_delay(codec_ctx, format_context, video_state->stream);
+    log_info("Video decoder running %d %s threads, adding %.3fs of decode latency",
+             codec_ctx->thread_count, thread_type_name(codec_ctx->active_thread_type), video_state->decoder_delay);
 
-    if (!video_state->sws_ctx) {
-        log_error("Could not create SWS context");
-        ret = -1;
-        goto cleanup;
-    }
-
-    video_state->frame_timer = (double) av_gettime() / 1000000.0;
-    video_state->frame_last_delay = 40e-3;
-    video_state->video_current_pts_time = av_gettime();
+    video_state->predicted_pts = 0;
 
     return ret;
 cleanup:
     if (codec_ctx) {
         avcodec_free_context(&codec_ctx);
     }
-    if (video_state->sws_ctx) {
-        sws_freeContext(video_state->sws_ctx);
-    }
 
     return ret;
 }
 
 int video_init(VideoState *video_state, PlayerState *player_state, SDL_Renderer *renderer) {
-    if (find_stream_index(video_state, player_state->format_context) < 0) {
+    // Without probing the codec_info counts av_find_best_stream() ranks by are all 0, keep the stream picked last time
+    if (find_stream_index(video_state, player_state->format_context, player_state->sidecar_cache.video_stream) < 0) {
         log_error("Could not find stream info");
         return -1;
     }
@@ -432,16 +641,54 @@ int video_init(VideoState *video_state, PlayerState *player_state, SDL_Renderer
     video_state->picture_queue_size = 0;
     video_state->picture_queue_read_index = 0;
     video_state->picture_queue_write_index = 0;
+    video_state->frames_dropped_stale = 0;
+    atomic_init(&video_state->frame_stats.on_time, 0);
+    atomic_init(&video_state->frame_stats.late, 0);
+    atomic_init(&video_state->frame_stats.dropped_late, 0);
+    video_state->display_sample_aspect_ratio = (AVRational){0, 1};
+    atomic_init(&video_state->seek_serial, 0);
+    atomic_init(&video_state->seek_issued_us, 0);
+    atomic_init(&video_state->finished_serial, 0);
+    video_state->load_shedder.enabled = player_state->options.load_shedding;
+    atomic_init(&video_state->load_shedder.level, 0);
+    video_state->load_shedder.applied_level = 0;
+    video_state->load_shedder.lag_average = 0;
+    video_state->load_shedder.last_change_us = 0;
+    video_state->load_shedder.raises = 0;
+    video_state->load_shedder.lowers = 0;
+    video_state->texture_width = 0;
+    video_state->texture_height = 0;
+    video_state->texture_format = SDL_PIXELFORMAT_UNKNOWN;
+    video_state->sws_ctx = NULL; // created on first use, only frames SDL can't upload directly need it
+    video_state->picture_queue_capacity = FFMAX(1, FFMIN(player_state->options.picture_queue_size,
+                                                         VIDEO_PICTURE_QUEUE_MAX));
+    // One frame per slot plus the one the video thread decodes into
+    if (frame_pool_init(&video_state->frame_pool, "Video Frames", video_state->picture_queue_capacity + 2) < 0) {
+        log_error("Could not create video frame pool");
+        return -1;
+    }
+    for (int i = 0; i < video_state->picture_queue_capacity; i++) {
+        video_state->picture_queue[i].frame = object_pool_get(&video_state->frame_pool);
+        video_state->picture_queue[i].allocated = 0;
+        if (!video_state->picture_queue[i].frame) {
+            return -1;
+        }
+    }
+    log_info("Picture queue holds %d frames", video_state->picture_queue_capacity);
 
-    if (stream_component_open(video_state, player_state->format_context) < 0) {
+    if (stream_component_open(video_state, player_state->format_context, &player_state->options) < 0) {
         log_error("Could not open video stream component");
         return -1;
     }
     video_state->packet_queue = malloc(sizeof(PacketQueue));
 
-    if (packet_queue_init(video_state->packet_queue, "Video Queue") < 0) {
+    if (packet_queue_init(video_state->packet_queue, "Video Queue", video_state->stream->time_base) < 0) {
         return -1;
     };
+    if (decoder_init(&video_state->decoder, "Video Decoder", video_state->codec_context,
+                     video_state->packet_queue, STATS_VIDEO_DECODE) < 0) {
+        return -1;
+    }
 
 
     return 0;
@@ -449,10 +696,9 @@ int video_init(VideoState *video_state, PlayerState *player_state, SDL_Renderer
 
 int video_state_reset(VideoState *video_state) {
     // TODO: What about the pictures queues?
-    video_state->frame_timer = (double) av_gettime() / 1000000.0;
-    video_state->frame_last_delay = 40e-3;
-    video_state->video_current_pts = NAN;
-    video_state->video_current_pts_time = av_gettime();
+    // Pictures from before the seek are dropped by serial, the presenter then picks up the new ones by the clock.
+    // The video clock goes stale by serial on its own.
+    return 0;
 }
 
 void video_cleanup(VideoState *video_state) {
@@ -466,6 +712,9 @@ void video_cleanup(VideoState *video_state) {
         log_info("SWS context destroyed");
     }
 
+    video_log_frame_stats(video_state);
+    decoder_destroy(&video_state->decoder);
+
     if (video_state->codec_context) {
         avcodec_free_context(&video_state->codec_context);
         log_info("Codec context destroyed");
@@ -490,4 +739,9 @@ void video_cleanup(VideoState *video_state) {
         packet_queue_destroy(video_state->packet_queue);
         log_info("Packet queue destroyed");
     }
+
+    for (int i = 0; i < video_state->picture_queue_capacity; i++) {
+        object_pool_put(&video_state->frame_pool, video_state->picture_queue[i].frame);
+    }
+    object_pool_destroy(&video_state->frame_pool);
 }
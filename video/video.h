@@ -8,33 +8,72 @@
 #include <SDL_render.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
+#include "../utils/decoder.h"
 #include "../utils/packet_queue.h"
+#include "../utils/pool.h"
 
-#define VIDEO_PICTURE_QUEUE_SIZE 1
-#define FF_REFRESH_EVENT (SDL_USEREVENT)
+#define VIDEO_PICTURE_QUEUE_MAX 16
+#define DEFAULT_PICTURE_QUEUE_SIZE 3
 #define FF_QUIT_EVENT (SDL_USEREVENT + 1)
 
 // Forward declarations
 typedef struct PlayerState PlayerState;
 
-typedef double (*GetAudioClockFn)(void *userdata);
-
 typedef struct VideoPicture {
+    AVFrame *frame; // decoded frame, the slot holds the reference until it is displayed
     int width;
     int height;
     int allocated;
     double presentation_time_stamp;
+    int serial; // seek generation the frame was decoded in
 } VideoPicture;
 
+/** Presentation counters, bumped by the presenter and readable from any thread while playing **/
+typedef struct VideoFrameStats {
+    atomic_int_fast64_t on_time; // first shown within a refresh period of their pts
+    atomic_int_fast64_t late; // first shown later than that
+    atomic_int_fast64_t dropped_late; // never shown, the clock had already reached the picture after them
+} VideoFrameStats;
+
+typedef struct VideoFrameCounts {
+    int64_t on_time;
+    int64_t late;
+    int64_t dropped_late;
+    int64_t dropped_stale;
+} VideoFrameCounts;
+
+#define LOAD_SHED_LEVEL_MAX 4
+#define LOAD_SHED_RAISE_LAG 0.060 // smoothed lag behind the master clock that sheds more decode work
+#define LOAD_SHED_LOWER_LAG 0.010 // lag low enough to try a higher quality level again
+#define LOAD_SHED_RAISE_HOLD_US 1000000 // the decoder needs a moment before a change shows up in the lag
+#define LOAD_SHED_LOWER_HOLD_US 3000000 // recovering is slower than shedding, so levels don't flap
+#define LOAD_SHED_LAG_SMOOTHING 0.9
+
+/** Trades picture quality for decode time when the video falls behind: first the deblocking filter is skipped, then
+ * non-reference frames, then everything but keyframes. The presenter picks the level from the lag and the
+ * picture queue, the decode thread applies it to the codec context between packets. **/
+typedef struct LoadShedder {
+    int enabled;
+    atomic_int level; // wanted level, written by the presenter
+    int applied_level; // decode thread only
+    double lag_average; // seconds the video is behind the master clock, smoothed
+    int64_t last_change_us;
+    int64_t raises;
+    int64_t lowers;
+} LoadShedder;
+
 typedef struct VideoState {
     int stream_index;
     AVStream *stream;
 
     AVCodecContext *codec_context;
-    struct SwsContext *sws_ctx;
+    struct SwsContext *sws_ctx; // only for frames that can't be uploaded as is
 
     PacketQueue *packet_queue;
-    VideoPicture picture_queue[VIDEO_PICTURE_QUEUE_SIZE];
+    Decoder decoder;
+    ObjectPool frame_pool;
+    VideoPicture picture_queue[VIDEO_PICTURE_QUEUE_MAX];
+    int picture_queue_capacity; // slots in use, from PlayerOptions
     int picture_queue_size;
     int picture_queue_read_index;
     int picture_queue_write_index;
@@ -43,21 +82,28 @@ typedef struct VideoState {
 
     SDL_Renderer *renderer;
     SDL_Texture *texture;
+    int texture_width;
+    int texture_height;
+    Uint32 texture_format;
+    AVRational display_sample_aspect_ratio; // of the picture in the texture
     SDL_mutex *screen_mutex;
 
-    double frame_last_presentation_time_stamp;
-    double frame_last_delay;
-    double frame_timer;
-    double video_current_pts;
-    int64_t video_current_pts_time;
+    int64_t frames_dropped_stale;
+    VideoFrameStats frame_stats;
+    LoadShedder load_shedder;
+
+    double decoder_delay; // seconds of frames held back by frame threading
+
+    // Last seek, until the presenter shows its first picture. seek_issued_us is 0 once reported.
+    atomic_int seek_serial;
+    atomic_int_fast64_t seek_issued_us;
+
+    double predicted_pts; // decode thread only, pts the next frame gets when it comes without one
+    atomic_int finished_serial; // published from the decoder by the decode thread, 0 while decoding
 
-    GetAudioClockFn get_audio_clock;
-    void *audio_clock_userdata;
     int *quit;
 } VideoState;
 
-void set_get_audio_clock_fn(GetAudioClockFn fn, VideoState *video_state, void *userdata);
-
 int video_init(VideoState *video_state, PlayerState *player_state, SDL_Renderer *renderer);
 
 int video_state_reset(VideoState *video_state);
@@ -66,9 +112,28 @@ void video_cleanup(VideoState *video);
 
 int video_thread(void *userdata);
 
-void video_display(VideoState *video);
+// Free slots left in the picture queue, i.e. how many more frames decode can run ahead
+int picture_queue_headroom(VideoState *video_state);
+
+// Picture offset places behind the read index, NULL if the queue doesn't hold that many
+VideoPicture *picture_queue_peek(VideoState *video_state, int offset);
+
+// Releases the picture at the read index
+void picture_queue_advance(VideoState *video_state);
+
+// Uploads the picture into the texture and sets the video clock to it. Main thread only, the renderer's.
+int video_show_picture(VideoState *video_state, VideoPicture *video_picture);
+
+// Draws the texture and the controls and presents, waiting for vsync. Main thread only, the renderer's.
+void video_render(VideoState *video_state);
+
+// Lag is how far the picture being shown is behind the master clock, in seconds
+void load_shedder_observe(VideoState *video_state, double lag);
+
+// Snapshot of the presentation counters, safe to call while playing
+void video_get_frame_stats(VideoState *video_state, VideoFrameCounts *counts);
 
-void video_refresh_timer(void *userdata);
+void video_log_frame_stats(VideoState *video_state);
 
-void schedule_refresh(VideoState *video, int delay);
+int video_present_headless(VideoState *video_state, double clock);
 #endif //VIDEO_H